@@ -0,0 +1,67 @@
+#include "AlarmIdMap.h"
+
+void AlarmIdMap::clear()
+{
+  for (int i = 0; i < ALARM_ID_BUCKETS; i++)
+    buckets[i].id = 0;
+}
+
+int AlarmIdMap::locate(uint32_t id) const
+{
+  if (id == 0)
+    return -1;
+  for (uint8_t n = 0, i = home(id); n < ALARM_ID_BUCKETS; n++, i = (i + 1) % ALARM_ID_BUCKETS)
+  {
+    if (buckets[i].id == id)
+      return i;
+    if (buckets[i].id == 0)
+      return -1;
+  }
+  return -1;
+}
+
+bool AlarmIdMap::insert(uint32_t id, uint8_t zone, uint8_t slot)
+{
+  if (id == 0 || locate(id) >= 0)
+    return false;
+  for (uint8_t n = 0, i = home(id); n < ALARM_ID_BUCKETS; n++, i = (i + 1) % ALARM_ID_BUCKETS)
+  {
+    if (buckets[i].id == 0)
+    {
+      buckets[i] = {id, zone, slot};
+      return true;
+    }
+  }
+  return false;
+}
+
+bool AlarmIdMap::find(uint32_t id, uint8_t *zone, uint8_t *slot) const
+{
+  int i = locate(id);
+  if (i < 0)
+    return false;
+  *zone = buckets[i].zone;
+  *slot = buckets[i].slot;
+  return true;
+}
+
+void AlarmIdMap::remove(uint32_t id)
+{
+  int hole = locate(id);
+  if (hole < 0)
+    return;
+  buckets[hole].id = 0;
+
+  // Backward-shift: move up entries whose probe sequence passes the hole
+  for (int i = (hole + 1) % ALARM_ID_BUCKETS; buckets[i].id; i = (i + 1) % ALARM_ID_BUCKETS)
+  {
+    int target = home(buckets[i].id);
+    bool reachable = hole <= i ? (target <= hole || target > i) : (target <= hole && target > i);
+    if (reachable)
+    {
+      buckets[hole] = buckets[i];
+      buckets[i].id = 0;
+      hole = i;
+    }
+  }
+}
@@ -0,0 +1,33 @@
+#ifndef ALARM_ID_MAP_H
+#define ALARM_ID_MAP_H
+
+#include <Arduino.h>
+
+#define ALARM_ID_BITS 6                        // 64 buckets for 40 alarm slots keeps probes short
+#define ALARM_ID_BUCKETS (1 << ALARM_ID_BITS)
+
+// Alarm id -> (zone, slot), open addressing with linear probing. Removal
+// shifts later entries back instead of leaving tombstones, so lookups stay
+// O(1) however often alarms are replaced. Guarded by the scheduler's state lock.
+class AlarmIdMap
+{
+public:
+  AlarmIdMap() { clear(); }
+  bool insert(uint32_t id, uint8_t zone, uint8_t slot); // false if id is 0, taken or the map is full
+  bool find(uint32_t id, uint8_t *zone, uint8_t *slot) const;
+  void remove(uint32_t id);
+  void clear();
+
+private:
+  struct Bucket
+  {
+    uint32_t id; // 0 = empty
+    uint8_t zone;
+    uint8_t slot;
+  };
+  Bucket buckets[ALARM_ID_BUCKETS];
+  static uint8_t home(uint32_t id) { return (uint32_t)(id * 2654435761UL) >> (32 - ALARM_ID_BITS); } // Fibonacci hashing
+  int locate(uint32_t id) const;
+};
+
+#endif
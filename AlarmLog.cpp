@@ -0,0 +1,122 @@
+#include "AlarmLog.h"
+
+AlarmLog alarmLog;
+
+static const char LEVEL_TAGS[] = {'-', 'E', 'W', 'I', 'D'};
+
+void PrintLogSink::write(const LogRecord &record)
+{
+  out.printf("[%c %lu] %s\r\n", LEVEL_TAGS[record.level], (unsigned long)record.millis, record.text);
+}
+
+void FileLogSink::write(const LogRecord &record)
+{
+  File file = fs.open(path, FILE_APPEND);
+  if (!file)
+    return;
+  size_t size = file.size();
+  file.printf("[%c %lu] %s\n", LEVEL_TAGS[record.level], (unsigned long)record.millis, record.text);
+  file.close();
+  if (size < maxBytes)
+    return;
+
+  // Keep one previous generation
+  char oldPath[40];
+  snprintf(oldPath, sizeof(oldPath), "%s.1", path);
+  if (fs.exists(oldPath))
+    fs.remove(oldPath);
+  fs.rename(path, oldPath);
+}
+
+AlarmLog::AlarmLog() : serialSink(Serial), sink(&serialSink), runtimeLevel(ALARM_LOG_LEVEL), rateLimit(LOG_RATE_LIMIT),
+                       tokens(LOG_RATE_LIMIT), windowStart(0), droppedTotal(0), droppedUnreported(0), queue(nullptr), drainTask(nullptr) {}
+
+void AlarmLog::begin()
+{
+  if (queue)
+    return;
+  queue = xQueueCreateStatic(LOG_RING_SIZE, sizeof(LogRecord), queueStorage, &queueControl);
+  xTaskCreate(drainTaskEntry, "alarm_log", 3072, this, 0, &drainTask);
+}
+
+void AlarmLog::setSink(LogSink *newSink)
+{
+  flush();
+  sink = newSink ? newSink : &serialSink;
+}
+
+void AlarmLog::log(uint8_t level, const char *format, ...)
+{
+  if (level > runtimeLevel || level == ALARM_LOG_NONE)
+    return;
+
+  // Token bucket per second; approximate across tasks, which is fine for a limiter
+  uint32_t nowMs = millis();
+  if (nowMs - windowStart >= 1000)
+  {
+    windowStart = nowMs;
+    tokens = rateLimit;
+  }
+  if (rateLimit && tokens == 0)
+  {
+    droppedTotal++;
+    droppedUnreported++;
+    return;
+  }
+  if (tokens)
+    tokens--;
+
+  LogRecord record;
+  record.millis = nowMs;
+  record.level = level;
+  va_list args;
+  va_start(args, format);
+  vsnprintf(record.text, sizeof(record.text), format, args);
+  va_end(args);
+
+  if (!queue)
+  {
+    sink->write(record);
+    return;
+  }
+  if (xQueueSend(queue, &record, 0) != pdTRUE)
+  {
+    droppedTotal++;
+    droppedUnreported++;
+  }
+}
+
+void AlarmLog::reportDropped()
+{
+  uint32_t count = droppedUnreported;
+  if (count == 0)
+    return;
+  droppedUnreported -= count;
+  LogRecord record;
+  record.millis = millis();
+  record.level = ALARM_LOG_WARN;
+  snprintf(record.text, sizeof(record.text), "%lu log records dropped", (unsigned long)count);
+  sink->write(record);
+}
+
+void AlarmLog::flush()
+{
+  if (!queue)
+    return;
+  LogRecord record;
+  while (xQueueReceive(queue, &record, 0) == pdTRUE)
+    sink->write(record);
+  reportDropped();
+}
+
+void AlarmLog::drainTaskEntry(void *arg)
+{
+  AlarmLog *self = static_cast<AlarmLog *>(arg);
+  LogRecord record;
+  for (;;)
+  {
+    if (xQueueReceive(self->queue, &record, portMAX_DELAY) == pdTRUE)
+      self->sink->write(record);
+    self->reportDropped();
+  }
+}
@@ -0,0 +1,116 @@
+#ifndef ALARM_LOG_H
+#define ALARM_LOG_H
+
+#include <Arduino.h>
+#include <FS.h>
+
+#define ALARM_LOG_NONE 0
+#define ALARM_LOG_ERROR 1
+#define ALARM_LOG_WARN 2
+#define ALARM_LOG_INFO 3
+#define ALARM_LOG_DEBUG 4
+
+// Highest level compiled in; calls above it vanish, arguments included
+#ifndef ALARM_LOG_LEVEL
+#define ALARM_LOG_LEVEL ALARM_LOG_INFO
+#endif
+
+#define LOG_TEXT_LEN 96   // Preformatted text per record, truncated beyond
+#define LOG_RING_SIZE 16  // Records buffered for the drain task
+#define LOG_RATE_LIMIT 20 // Default records per second, 0 = unlimited
+
+#if ALARM_LOG_LEVEL >= ALARM_LOG_ERROR
+#define ALARM_LOGE(...) alarmLog.log(ALARM_LOG_ERROR, __VA_ARGS__)
+#else
+#define ALARM_LOGE(...) ((void)0)
+#endif
+#if ALARM_LOG_LEVEL >= ALARM_LOG_WARN
+#define ALARM_LOGW(...) alarmLog.log(ALARM_LOG_WARN, __VA_ARGS__)
+#else
+#define ALARM_LOGW(...) ((void)0)
+#endif
+#if ALARM_LOG_LEVEL >= ALARM_LOG_INFO
+#define ALARM_LOGI(...) alarmLog.log(ALARM_LOG_INFO, __VA_ARGS__)
+#else
+#define ALARM_LOGI(...) ((void)0)
+#endif
+#if ALARM_LOG_LEVEL >= ALARM_LOG_DEBUG
+#define ALARM_LOGD(...) alarmLog.log(ALARM_LOG_DEBUG, __VA_ARGS__)
+#else
+#define ALARM_LOGD(...) ((void)0)
+#endif
+
+struct LogRecord
+{
+  uint32_t millis; // Uptime when logged
+  uint8_t level;   // ALARM_LOG_*
+  char text[LOG_TEXT_LEN];
+};
+
+// Destination of drained records; runs on the drain task
+class LogSink
+{
+public:
+  virtual ~LogSink() {}
+  virtual void write(const LogRecord &record) = 0;
+};
+
+// Any Print: Serial (default), a WiFiClient, a UDP wrapper...
+class PrintLogSink : public LogSink
+{
+public:
+  PrintLogSink(Print &out) : out(out) {}
+  void write(const LogRecord &record) override;
+
+private:
+  Print &out;
+};
+
+// Appends to a file, rotating it to "<path>.1" past maxBytes
+class FileLogSink : public LogSink
+{
+public:
+  FileLogSink(fs::FS &fs, const char *path = "/alarm.log", size_t maxBytes = 16384) : fs(fs), path(path), maxBytes(maxBytes) {}
+  void write(const LogRecord &record) override;
+
+private:
+  fs::FS &fs;
+  const char *path;
+  size_t maxBytes;
+};
+
+// Callers format into a fixed record and queue it without blocking; a
+// low-priority task writes records to the sink. Records beyond the rate
+// limit or a full ring are dropped and reported as a count.
+class AlarmLog
+{
+public:
+  AlarmLog();
+  void begin();                        // Start the drain task; until then records are written inline
+  void setSink(LogSink *sink);         // nullptr restores Serial
+  void setLevel(uint8_t level) { runtimeLevel = level; } // Further filter below ALARM_LOG_LEVEL
+  void setRateLimit(uint16_t perSecond) { rateLimit = perSecond; }
+  void log(uint8_t level, const char *format, ...) __attribute__((format(printf, 3, 4)));
+  void flush();                        // Drain inline, e.g. before deep sleep
+  uint32_t dropped() const { return droppedTotal; }
+
+private:
+  PrintLogSink serialSink;
+  LogSink *sink;
+  uint8_t runtimeLevel;
+  uint16_t rateLimit;
+  uint16_t tokens;           // Records left in the current second
+  uint32_t windowStart;      // millis() of the current rate window
+  volatile uint32_t droppedTotal;
+  volatile uint32_t droppedUnreported;
+  QueueHandle_t queue;
+  StaticQueue_t queueControl;
+  uint8_t queueStorage[LOG_RING_SIZE * sizeof(LogRecord)];
+  TaskHandle_t drainTask;
+  void reportDropped();
+  static void drainTaskEntry(void *arg);
+};
+
+extern AlarmLog alarmLog;
+
+#endif
@@ -11,49 +11,103 @@ bool isValidDate(int year, int month, int date)
   return date <= daysInMonth[month - 1];
 }
 
+// Helper: Parse local "YYYY-MM-DD HH:MM[:SS]"
+static bool parseLocalTime(const char *timeStr, time_t *local)
+{
+  int year, month, date, hour, minute, second = 0;
+  int fields = sscanf(timeStr, "%d-%d-%d %d:%d:%d", &year, &month, &date, &hour, &minute, &second);
+  if (fields < 5 || !isValidDate(year, month, date) ||
+      hour < 0 || hour > 23 || minute < 0 || minute > 59 || second < 0 || second > 59)
+    return false;
+  tmElements_t tm;
+  tm.Year = CalendarYrToTm(year);
+  tm.Month = month;
+  tm.Day = date;
+  tm.Hour = hour;
+  tm.Minute = minute;
+  tm.Second = second;
+  *local = makeTime(tm);
+  return true;
+}
+
 // ZoneAlarms Implementation
-ZoneAlarms::ZoneAlarms(uint8_t id) : zoneId(id), Zone(nullptr), alarmCount(0), lastTriggerMinute(0)
+ZoneAlarms::ZoneAlarms(uint8_t id, ZoneResources *shared) : zoneId(id), alarmCount(0), lastTriggerMinute(0), version(0), shared(shared)
 {
   for (int i = 0; i < 10; i++)
   {
     alarms[i].isActive = false;
     alarms[i].isDateBased = false;
     alarms[i].isOneTime = false;
+    alarms[i].action[0] = '\0';
+    alarms[i].dataState = DATA_CLEAN;
+    alarms[i].pendingHandle = 0;
+    alarms[i].detailsPending = false;
+    alarms[i].id = 0;
+    alarms[i].rev = 0;
+    alarms[i].staleId = 0;
+    matchDays[i] = 0;
+    indexSlot(i);
   }
 }
 
-bool ZoneAlarms::addAlarm(JsonDocument &doc)
+#define MATCH_NEVER_MINUTE 0xFFFF
+#define MATCH_NEVER_DATE 0xFFFFFFFFUL
+#define MATCH_YEARLY_MASK 0x1FFUL // Month and date bits of a date key
+#define ALARM_FILE_OVERHEAD 192  // alarms.json fields around the alarm list, in bytes and pool memory
+
+// Helper: One comparable word per calendar date
+static inline uint32_t matchDateKey(uint16_t year, uint8_t month, uint8_t date)
 {
-  if (alarmCount >= 10)
-  {
-    doc.clear();
-    doc["status"] = "error";
-    doc["message"] = "Zone full";
-    return false;
-  }
-  // Find inactive slot
-  int slot = -1;
-  for (int i = 0; i < 10; i++)
-  {
-    if (!alarms[i].isActive)
-    {
-      slot = i;
-      break;
-    }
-  }
-  if (slot == -1)
-    return false;
+  return ((uint32_t)year << 9) | (month << 5) | date;
+}
+
+// Helper: Day of the week from the epoch, sun = 0 (1970-01-01 was a Thursday)
+static inline uint8_t weekdayOf(time_t t)
+{
+  return (t / SECS_PER_DAY + 4) % 7;
+}
+
+// Breaks the current minute down once for all zones
+static void makeTick(CalendarTick &tick, time_t utcNow, time_t localNow, time_t skippedFrom)
+{
+  tmElements_t tm;
+  breakTime(localNow, tm);
+  tick.utcNow = utcNow;
+  tick.localNow = localNow;
+  tick.localMinute = localNow - localNow % 60;
+  tick.dayStart = localNow - localNow % SECS_PER_DAY;
+  tick.skippedFrom = skippedFrom;
+  tick.dateKey = matchDateKey(tmYearToCalendar(tm.Year), tm.Month, tm.Day);
+  tick.minuteOfDay = (tick.localMinute - tick.dayStart) / 60;
+  tick.weekday = weekdayOf(localNow);
+  tick.minuteOfWeek = tick.weekday * 1440 + tick.minuteOfDay;
+}
+
+// Helper: Storage key of one alarm's zone_data, e.g. "/z80000005" (fits NVS key limits)
+static void zoneDataKey(uint32_t alarmId, char *key, size_t len)
+{
+  snprintf(key, len, "/z%08lx", (unsigned long)alarmId);
+}
+
+// Helper: Key older versions used, by zone and slot, e.g. "/zd1_5"
+static void slotDataKey(uint8_t zoneId, uint8_t slot, char *key, size_t len)
+{
+  snprintf(key, len, "/zd%u_%u", zoneId, slot);
+}
 
+// Validates the schedule fields of doc into alarm; on failure doc holds the error
+bool ZoneAlarms::parseAlarm(JsonDocument &doc, Alarm &alarm)
+{
   // Validate type
-  String type = doc["type"].as<String>();
-  if (type != "day" && type != "date")
+  const char *type = doc["type"] | "";
+  if (strcmp(type, "day") != 0 && strcmp(type, "date") != 0)
   {
     doc.clear();
     doc["status"] = "error";
     doc["message"] = "Invalid type";
     return false;
   }
-  bool isDateBased = (type == "date");
+  bool isDateBased = strcmp(type, "date") == 0;
 
   // Validate oneTime
   if (isDateBased)
@@ -75,9 +129,9 @@ bool ZoneAlarms::addAlarm(JsonDocument &doc)
   }
 
   // Validate time
-  String timeStr = doc["time"].as<String>();
+  const char *timeStr = doc["time"] | "";
   int hour, minute;
-  if (sscanf(timeStr.c_str(), "%d:%d", &hour, &minute) != 2 ||
+  if (sscanf(timeStr, "%d:%d", &hour, &minute) != 2 ||
       hour < 0 || hour > 23 || minute < 0 || minute > 59)
   {
     doc.clear();
@@ -87,58 +141,36 @@ bool ZoneAlarms::addAlarm(JsonDocument &doc)
   }
 
   // Validate action
-  String action = doc["action"].as<String>();
+  const char *action = doc["action"] | "";
   // if (action != "ON" && action != "OFF") {
   //   doc.clear();
   //   doc["status"] = "error";
   //   doc["message"] = "Invalid action";
   //   return false;
   // }
-
-  // Validate zone_data
-  if (!doc.containsKey("zone_data"))
-  {
-    doc.clear();
-    doc["status"] = "error";
-    doc["message"] = "zone_data required";
-    return false;
-  }
-
-  JsonObject zoneDataObj = doc["zone_data"].as<JsonObject>();
-  if (zoneDataObj.isNull())
-  {
-    doc.clear();
-    doc["status"] = "error";
-    doc["message"] = "zone_data must be JSON object";
-    return false;
-  }
-
-  // Check zone_data size (approximate)
-  String zoneDataStr;
-  serializeJson(zoneDataObj, zoneDataStr);
-  if (zoneDataStr.length() > 1000)
+  if (strlen(action) >= ALARM_ACTION_LEN)
   {
     doc.clear();
     doc["status"] = "error";
-    doc["message"] = "zone_data too large (max 1000 bytes)";
+    doc["message"] = "action too long (max 63 chars)";
     return false;
   }
 
-  // Initialize alarm
-  Alarm &alarm = alarms[slot];
-  alarm.isActive = true;
   alarm.isDateBased = isDateBased;
   alarm.isOneTime = isDateBased ? doc["oneTime"].as<bool>() : false;
   alarm.hour = hour;
   alarm.minute = minute;
   // alarm.action = (action == "ON");
-  alarm.action = action;
+  strcpy(alarm.action, action);
+  for (int i = 0; i < 7; i++)
+    alarm.days[i] = false;
+  alarm.year = 0;
+  alarm.month = 0;
+  alarm.date = 0;
 
   // Handle day-based
   if (!isDateBased)
   {
-    for (int i = 0; i < 7; i++)
-      alarm.days[i] = false;
     JsonArray days = doc["days"].as<JsonArray>();
     if (days.isNull() || days.size() == 0)
     {
@@ -149,21 +181,20 @@ bool ZoneAlarms::addAlarm(JsonDocument &doc)
     }
     for (JsonVariant dayVar : days)
     {
-      String day = dayVar.as<String>();
-      day.toLowerCase();
-      if (day == "sun")
+      const char *day = dayVar | "";
+      if (strcasecmp(day, "sun") == 0)
         alarm.days[0] = true;
-      else if (day == "mon")
+      else if (strcasecmp(day, "mon") == 0)
         alarm.days[1] = true;
-      else if (day == "tue")
+      else if (strcasecmp(day, "tue") == 0)
         alarm.days[2] = true;
-      else if (day == "wed")
+      else if (strcasecmp(day, "wed") == 0)
         alarm.days[3] = true;
-      else if (day == "thu")
+      else if (strcasecmp(day, "thu") == 0)
         alarm.days[4] = true;
-      else if (day == "fri")
+      else if (strcasecmp(day, "fri") == 0)
         alarm.days[5] = true;
-      else if (day == "sat")
+      else if (strcasecmp(day, "sat") == 0)
         alarm.days[6] = true;
       else
       {
@@ -177,9 +208,9 @@ bool ZoneAlarms::addAlarm(JsonDocument &doc)
   else
   {
     // Handle date-based
-    String dateStr = doc["date"].as<String>();
+    const char *dateStr = doc["date"] | "";
     int year, month, date;
-    if (sscanf(dateStr.c_str(), "%d-%d-%d", &year, &month, &date) != 3 ||
+    if (sscanf(dateStr, "%d-%d-%d", &year, &month, &date) != 3 ||
         !isValidDate(year, month, date))
     {
       doc.clear();
@@ -191,381 +222,1027 @@ bool ZoneAlarms::addAlarm(JsonDocument &doc)
     alarm.month = month;
     alarm.date = date;
   }
+  return true;
+}
 
-  // Disable same-time alarms
-  for (int i = 0; i < 10; i++)
+// Copies doc's zone_data into the pending pool; handle 0 and true when absent and optional
+bool ZoneAlarms::parseZoneData(JsonDocument &doc, bool required, uint8_t *handle)
+{
+  if (handle)
+    *handle = 0;
+  if (!doc.containsKey("zone_data"))
   {
-    if (i != slot && alarms[i].isActive &&
-        alarms[i].hour == alarm.hour && alarms[i].minute == alarm.minute)
-    {
-      alarms[i].isActive = false;
-      alarmCount--;
-    }
+    if (!required)
+      return true;
+    doc.clear();
+    doc["status"] = "error";
+    doc["message"] = "zone_data required";
+    return false;
   }
 
-  alarmCount++;
+  JsonObject zoneDataObj = doc["zone_data"].as<JsonObject>();
+  if (zoneDataObj.isNull())
+  {
+    doc.clear();
+    doc["status"] = "error";
+    doc["message"] = "zone_data must be JSON object";
+    return false;
+  }
 
-  // Store zone_data in separate file
-  DynamicJsonDocument zoneDoc(8192);
-  File file = SPIFFS.open("/zone_data.json", FILE_READ);
-  JsonArray zoneDataArray;
-  if (file)
+  // Check zone_data size (approximate)
+  size_t zoneDataLen = measureJson(zoneDataObj);
+  if (zoneDataLen > ALARM_PAYLOAD_MAX)
   {
-    DeserializationError error = deserializeJson(zoneDoc, file);
-    if (!error && zoneDoc.containsKey("zone_data"))
-    {
-      zoneDataArray = zoneDoc["zone_data"].as<JsonArray>();
-    }
-    file.close();
+    doc.clear();
+    doc["status"] = "error";
+    doc["message"] = "zone_data too large (max 1000 bytes)";
+    return false;
   }
-  if (zoneDataArray.isNull())
+  if (!handle)
+    return true;
+
+  // Queue zone_data for the background flush in the preallocated pool
+  char *pending = shared ? shared->pending->reserve(zoneDataLen, handle) : nullptr;
+  if (!pending)
   {
-    zoneDataArray = zoneDoc.createNestedArray("zone_data");
+    doc.clear();
+    doc["status"] = "error";
+    doc["message"] = "Pending zone_data buffer full, retry after the next save";
+    return false;
   }
+  serializeJson(zoneDataObj, pending, zoneDataLen + 1);
+  return true;
+}
 
-  // Add/update zone data entry
-  bool found = false;
-  for (JsonObject obj : zoneDataArray)
+bool ZoneAlarms::addAlarm(JsonDocument &doc, int restoreSlot)
+{
+  if (alarmCount >= 10)
+  {
+    doc.clear();
+    doc["status"] = "error";
+    doc["message"] = "Zone full";
+    return false;
+  }
+  // Find inactive slot; a reload keeps the saved slot so the schedule index still matches
+  int slot = -1;
+  if (restoreSlot >= 0 && restoreSlot < 10 && !alarms[restoreSlot].isActive)
+    slot = restoreSlot;
+  for (int i = 0; i < 10 && slot == -1; i++)
   {
-    if (obj["zone_id"].as<int>() == zoneId && obj["alarm_id"].as<int>() == slot)
+    if (!alarms[i].isActive)
     {
-      obj["zone_data"] = zoneDataObj;
-      found = true;
+      slot = i;
       break;
     }
   }
-  if (!found)
-  {
-    JsonObject newZoneEntry = zoneDataArray.createNestedObject();
-    newZoneEntry["zone_id"] = zoneId;
-    newZoneEntry["alarm_id"] = slot;
-    newZoneEntry["zone_data"] = zoneDataObj;
-  }
+  if (slot == -1)
+    return false;
 
-  // Save zone data
-  file = SPIFFS.open("/zone_data.json", FILE_WRITE);
-  if (file)
+  // A given id must be new; updates go through updateAlarm()
+  uint32_t id = doc["alarm_id"] | (uint32_t)0;
+  uint8_t otherZone, otherSlot;
+  if (id && shared && shared->ids->find(id, &otherZone, &otherSlot))
   {
-    serializeJson(zoneDoc, file);
-    file.close();
+    doc.clear();
+    doc["status"] = "error";
+    doc["message"] = "alarm_id already in use";
+    return false;
   }
 
+  // Validate into a copy; the slot is only written once everything passed
+  Alarm parsed = alarms[slot];
+  if (!parseAlarm(doc, parsed))
+    return false;
+  uint16_t rev = doc["rev"] | 1;
+  parsed.id = id ? id : 0xFFFFFFFF; // Longest id until one is assigned
+  parsed.rev = rev;
+  if (restoreSlot < 0 && !fitsFile(parsed, slot, doc))
+    return false; // Saved schedules still load
+
+  // Reloaded alarms keep their zone_data under their own key
+  uint8_t handle = 0;
+  bool restoredData = restoreSlot >= 0 && !doc.containsKey("zone_data");
+  if (!restoredData && !parseZoneData(doc, true, &handle))
+    return false;
+  if (!id)
+    id = ALARM_DEVICE_ID | (shared ? shared->nextId++ : slot);
+
+  Alarm &alarm = alarms[slot];
+  alarm = parsed;
+  alarm.id = id;
+  alarm.rev = rev;
+  uint32_t replaced[9];
+  uint8_t replacedCount = disableSameTime(slot, replaced);
+  alarm.isActive = true;
+  alarm.detailsPending = false;
+  indexSlot(slot);
+  alarmCount++;
+  version++;
+  if (shared)
+    shared->ids->insert(id, zoneId, slot);
+  dropPendingData(slot, restoredData ? DATA_CLEAN : DATA_WRITE);
+  alarm.pendingHandle = handle;
+
   doc.clear();
   doc["status"] = "success";
-  doc["alarm_id"] = slot;
+  doc["alarm_id"] = id;
+  doc["rev"] = rev;
+  addReplaced(doc, replaced, replacedCount);
   return true;
 }
 
-bool ZoneAlarms::deleteAlarm(uint8_t id)
+// Changes an alarm in place: fields missing from doc keep their value, the
+// id and slot stay, and only a given zone_data is rewritten
+bool ZoneAlarms::updateAlarm(uint8_t slot, JsonDocument &doc)
 {
-  if (id >= 10 || !alarms[id].isActive)
+  if (slot >= 10 || !alarms[slot].isActive)
     return false;
-  alarms[id].isActive = false;
-  alarmCount--;
-
-  // Delete corresponding zone data
-  File file = SPIFFS.open("/zone_data.json", FILE_READ);
-  if (file)
-  {
-    DynamicJsonDocument doc(8192);
-    DeserializationError error = deserializeJson(doc, file);
-    file.close();
+  if (alarms[slot].detailsPending && shared && shared->owner)
+    shared->owner->loadAlarmDetails();
 
-    if (!error && doc.containsKey("zone_data"))
-    {
-      JsonArray zoneArray = doc["zone_data"].as<JsonArray>();
-      JsonArray newArray = doc.createNestedArray("new_zone_data");
+  // Fill in the current schedule so parseAlarm() sees a complete alarm
+  fillFromSlot(slot, doc);
+  Alarm parsed = alarms[slot];
+  if (!parseAlarm(doc, parsed))
+    return false;
+  uint16_t rev = doc["rev"] | (uint16_t)(alarms[slot].rev + 1);
+  parsed.rev = rev;
+  if (!fitsFile(parsed, slot, doc))
+    return false;
+  uint8_t handle;
+  if (!parseZoneData(doc, false, &handle))
+    return false;
 
-      for (JsonObject obj : zoneArray)
-      {
-        if (!(obj["zone_id"].as<int>() == zoneId && obj["alarm_id"].as<int>() == id))
-        {
-          JsonObject newObj = newArray.createNestedObject();
-          for (JsonPair pair : obj)
-          {
-            newObj[pair.key()] = pair.value();
-          }
-        }
-      }
+  alarms[slot] = parsed;
+  indexSlot(slot);
+  uint32_t replaced[9];
+  uint8_t replacedCount = disableSameTime(slot, replaced);
+  version++;
+  if (handle)
+  {
+    dropPendingData(slot, DATA_WRITE);
+    alarms[slot].pendingHandle = handle;
+  }
 
-      doc.remove("zone_data");
-      doc["zone_data"] = newArray;
-      doc.remove("new_zone_data");
+  doc.clear();
+  doc["status"] = "success";
+  doc["alarm_id"] = alarms[slot].id;
+  doc["rev"] = rev;
+  addReplaced(doc, replaced, replacedCount);
+  return true;
+}
 
-      file = SPIFFS.open("/zone_data.json", FILE_WRITE);
-      if (file)
-      {
-        serializeJson(doc, file);
-        file.close();
-      }
+// Called with the state lock held
+void ZoneAlarms::fillFromSlot(uint8_t slot, JsonDocument &doc) const
+{
+  if (!doc.containsKey("type"))
+    doc["type"] = alarms[slot].isDateBased ? "date" : "day";
+  bool isDateBased = strcmp(doc["type"] | "", "date") == 0;
+  if (!doc.containsKey("time"))
+  {
+    char timeStr[6];
+    snprintf(timeStr, sizeof(timeStr), "%02d:%02d", alarms[slot].hour, alarms[slot].minute);
+    doc["time"] = (char *)timeStr; // Copied; the buffer goes out of scope
+  }
+  if (!doc.containsKey("action"))
+    doc["action"] = (const char *)alarms[slot].action;
+  if (isDateBased == alarms[slot].isDateBased)
+  {
+    if (isDateBased && !doc.containsKey("date"))
+    {
+      char dateStr[11];
+      snprintf(dateStr, sizeof(dateStr), "%04d-%02d-%02d", alarms[slot].year, alarms[slot].month, alarms[slot].date);
+      doc["date"] = (char *)dateStr; // Copied
     }
+    if (isDateBased && !doc.containsKey("oneTime"))
+      doc["oneTime"] = alarms[slot].isOneTime;
+    if (!isDateBased && !doc.containsKey("days"))
+      addDays(alarms[slot], doc.createNestedArray("days"));
   }
-
-  return true;
 }
 
-bool ZoneAlarms::checkAlarms()
+// Validates an add (slot < 0) or an update of slot as addAlarm() and
+// updateAlarm() would, without touching the zone or the pending pool, so a
+// batch can be refused before any of it applies. Id ownership and capacity
+// are left to the caller.
+bool ZoneAlarms::checkAlarm(JsonDocument &doc, int slot)
 {
-  if (timeStatus() != timeSet || !Zone)
+  if (slot >= 10 || (slot >= 0 && !alarms[slot].isActive))
     return false;
-  unsigned long currentMinute = now() / 60;
-  if (currentMinute == lastTriggerMinute)
+  if (slot >= 0)
+    fillFromSlot(slot, doc);
+  Alarm parsed = Alarm();
+  return parseAlarm(doc, parsed) && parseZoneData(doc, slot < 0, nullptr);
+}
+
+bool ZoneAlarms::deleteAlarm(uint8_t slot)
+{
+  if (slot >= 10 || !alarms[slot].isActive)
     return false;
+  deactivate(slot);
+  return true;
+}
 
-  bool stateChanged = false;
-  bool dateTriggered = false;
-  // Check date-based alarms first
+// Frees a slot; its stored zone_data is removed on the next flush
+void ZoneAlarms::deactivate(uint8_t slot)
+{
+  Alarm &alarm = alarms[slot];
+  alarm.isActive = false;
+  indexSlot(slot);
+  alarmCount--;
+  version++;
+  if (shared)
+    shared->ids->remove(alarm.id);
+  // One stored key per slot at most: later occupants were never flushed
+  if (!alarm.staleId)
+    alarm.staleId = alarm.id;
+  dropPendingData(slot, DATA_CLEAN);
+}
+
+// One alarm per minute and zone: a new or moved alarm disables the others at its time
+uint8_t ZoneAlarms::disableSameTime(uint8_t slot, uint32_t *replaced)
+{
+  uint8_t n = 0;
   for (int i = 0; i < 10; i++)
   {
-    if (!alarms[i].isActive || !alarms[i].isDateBased)
-      continue;
-    bool isMatch;
-    if (alarms[i].isOneTime)
-    {
-      isMatch = (alarms[i].year == year() && alarms[i].month == month() &&
-                 alarms[i].date == day() && alarms[i].hour == hour() &&
-                 alarms[i].minute == minute());
-    }
-    else
+    if (i != slot && alarms[i].isActive &&
+        alarms[i].hour == alarms[slot].hour && alarms[i].minute == alarms[slot].minute)
     {
-      isMatch = (alarms[i].month == month() && alarms[i].date == day() &&
-                 alarms[i].hour == hour() && alarms[i].minute == minute());
+      replaced[n++] = alarms[i].id;
+      deactivate(i);
     }
-    if (isMatch)
-    {
-      // Load zone data for this alarm
-      DynamicJsonDocument zoneDoc(1200);
-      JsonObject zoneData = zoneDoc.to<JsonObject>();
+  }
+  return n;
+}
 
-      File file = SPIFFS.open("/zone_data.json", FILE_READ);
-      if (file)
-      {
-        DynamicJsonDocument fileDoc(8192);
-        DeserializationError error = deserializeJson(fileDoc, file);
-        if (!error && fileDoc.containsKey("zone_data"))
-        {
-          JsonArray zoneArray = fileDoc["zone_data"].as<JsonArray>();
-          for (JsonObject zoneObj : zoneArray)
-          {
-            if (zoneObj["zone_id"].as<int>() == zoneId && zoneObj["alarm_id"].as<int>() == i)
-            {
-              JsonObject srcZoneData = zoneObj["zone_data"].as<JsonObject>();
-              for (JsonPair pair : srcZoneData)
-              {
-                zoneData[pair.key()] = pair.value();
-              }
-              break;
-            }
-          }
-        }
-        file.close();
-      }
+// Tells the sender which alarms its add or update displaced
+void ZoneAlarms::addReplaced(JsonDocument &doc, const uint32_t *replaced, uint8_t n) const
+{
+  if (!n)
+    return;
+  JsonArray arr = doc.createNestedArray("replaced");
+  for (uint8_t i = 0; i < n; i++)
+    arr.add(replaced[i]);
+}
 
-      Zone(zoneId, alarms[i].action, zoneData);
-      if (alarms[i].isOneTime)
-      {
-        alarms[i].isActive = false;
-        alarmCount--;
-        stateChanged = true;
-      }
-      char timeStr[20];
-      snprintf(timeStr, sizeof(timeStr), "%04d/%02d/%02d %02d:%02d:%02d",
-               year(), month(), day(), hour(), minute(), second());
-      Serial.println("Zone " + String(zoneId) + " triggered at " + String(timeStr));
-      dateTriggered = true;
-    }
-  }
+void ZoneAlarms::dropPendingData(uint8_t slot, uint8_t state)
+{
+  if (alarms[slot].pendingHandle && shared)
+    shared->pending->release(alarms[slot].pendingHandle);
+  alarms[slot].pendingHandle = 0;
+  alarms[slot].dataState = state;
+}
 
-  // Check day-based alarms if no date-based triggered
-  if (!dateTriggered)
+void ZoneAlarms::dispatch(uint8_t slot, time_t utcNow, time_t localNow)
+{
+  // An alarm restored from the schedule index gets its action first
+  if (alarms[slot].detailsPending && shared && shared->owner)
   {
-    for (int i = 0; i < 10; i++)
-    {
-      if (!alarms[i].isActive || alarms[i].isDateBased)
-        continue;
-      if (alarms[i].days[weekday() - 1] && alarms[i].hour == hour() &&
-          alarms[i].minute == minute())
-      {
-        // Load zone data for this alarm
-        DynamicJsonDocument zoneDoc(1200);
-        JsonObject zoneData = zoneDoc.to<JsonObject>();
+    shared->owner->loadAlarmDetails();
+    if (!alarms[slot].isActive)
+      return;
+  }
 
-        File file = SPIFFS.open("/zone_data.json", FILE_READ);
-        if (file)
-        {
-          DynamicJsonDocument fileDoc(8192);
-          DeserializationError error = deserializeJson(fileDoc, file);
-          if (!error && fileDoc.containsKey("zone_data"))
-          {
-            JsonArray zoneArray = fileDoc["zone_data"].as<JsonArray>();
-            for (JsonObject zoneObj : zoneArray)
-            {
-              if (zoneObj["zone_id"].as<int>() == zoneId && zoneObj["alarm_id"].as<int>() == i)
-              {
-                JsonObject srcZoneData = zoneObj["zone_data"].as<JsonObject>();
-                for (JsonPair pair : srcZoneData)
-                {
-                  zoneData[pair.key()] = pair.value();
-                }
-                break;
-              }
-            }
-          }
-          file.close();
-        }
+  // Load zone data for this alarm into the shared payload document
+  StaticJsonDocument<16> emptyDoc;
+  JsonDocument &zoneDoc = shared ? *shared->payloadDoc : emptyDoc;
+  if (!loadZoneData(slot, zoneDoc))
+    zoneDoc.to<JsonObject>();
+  if (shared)
+    shared->stats->notePeak(2, zoneDoc.memoryUsage());
 
-        Zone(zoneId, alarms[i].action, zoneData);
-        char timeStr[20];
-        snprintf(timeStr, sizeof(timeStr), "%04d/%02d/%02d %02d:%02d:%02d",
-                 year(), month(), day(), hour(), minute(), second());
-        Serial.println("Zone " + String(zoneId) + " triggered at " + String(timeStr));
-      }
-    }
+  if (shared && shared->workers[zoneId - 1])
+  {
+    enqueue(slot, utcNow, localNow, zoneDoc);
+    return;
   }
+  JsonObject zoneData = zoneDoc.as<JsonObject>();
+  recordFire(alarms[slot].id, alarms[slot].action, utcNow, localNow, invoke(alarms[slot].id, alarms[slot].action, zoneData));
+}
 
-  lastTriggerMinute = currentMinute;
-  return stateChanged;
+// Called with the state lock held; never blocks
+bool ZoneAlarms::enqueue(uint8_t slot, time_t utcNow, time_t localNow, JsonDocument &zoneDoc)
+{
+  ZoneJob job;
+  job.utcNow = utcNow;
+  job.localNow = localNow;
+  job.alarmId = alarms[slot].id;
+  job.payloadHandle = 0;
+  memcpy(job.action, alarms[slot].action, sizeof(job.action));
+  size_t len = zoneDoc.as<JsonObject>().size() ? measureJson(zoneDoc) : 0;
+  if (len)
+  {
+    char *payload = shared->pending->reserve(len, &job.payloadHandle);
+    if (payload)
+      serializeJson(zoneDoc, payload, len + 1);
+  }
+  if ((len && !job.payloadHandle) || xQueueSend(shared->workers[zoneId - 1], &job, 0) != pdTRUE)
+  {
+    if (job.payloadHandle)
+      shared->pending->release(job.payloadHandle);
+    shared->stats->dropped[zoneId - 1]++;
+    ALARM_LOGW("Zone %u worker busy, alarm %u dropped", zoneId, slot);
+    return false;
+  }
+  return true;
 }
 
-void ZoneAlarms::listAlarms(JsonArray &arr)
+uint32_t ZoneAlarms::invoke(uint32_t alarmId, const char *action, JsonObject &zoneData)
 {
-  for (int i = 0; i < 10; i++)
-  {
-    if (!alarms[i].isActive)
-      continue;
-    JsonObject obj = arr.createNestedObject();
-    obj["zone_id"] = zoneId;
-    obj["alarm_id"] = i;
-    obj["type"] = alarms[i].isDateBased ? "date" : "day";
-    char timeStr[6];
-    snprintf(timeStr, sizeof(timeStr), "%02d:%02d", alarms[i].hour, alarms[i].minute);
-    obj["time"] = timeStr;
-    obj["action"] = alarms[i].action;
+  unsigned long start = micros();
+  if (Zone)
+    Zone(zoneId, action, zoneData);
+  if (shared)
+    shared->subscribers->fanOut(zoneId, alarmId, action, zoneData);
+  return micros() - start;
+}
 
-    if (alarms[i].isDateBased)
-    {
-      char dateStr[11];
-      snprintf(dateStr, sizeof(dateStr), "%04d-%02d-%02d", alarms[i].year, alarms[i].month, alarms[i].date);
-      obj["date"] = dateStr;
-      obj["oneTime"] = alarms[i].isOneTime;
-    }
-    else
-    {
-      JsonArray days = obj.createNestedArray("days");
-      if (alarms[i].days[0])
-        days.add("sun");
-      if (alarms[i].days[1])
-        days.add("mon");
-      if (alarms[i].days[2])
-        days.add("tue");
-      if (alarms[i].days[3])
-        days.add("wed");
-      if (alarms[i].days[4])
-        days.add("thu");
-      if (alarms[i].days[5])
-        days.add("fri");
-      if (alarms[i].days[6])
-        days.add("sat");
-    }
+bool ZoneAlarms::hasZone() const
+{
+  return Zone || (shared && shared->subscribers->count(zoneId));
+}
 
-    // Add zone_data to the output
-    DynamicJsonDocument zoneDoc(1200);
-    JsonObject zoneData = zoneDoc.to<JsonObject>();
-    File file = SPIFFS.open("/zone_data.json", FILE_READ);
-    if (file)
-    {
-      DynamicJsonDocument fileDoc(8192);
-      DeserializationError error = deserializeJson(fileDoc, file);
-      if (!error && fileDoc.containsKey("zone_data"))
-      {
-        JsonArray zoneArray = fileDoc["zone_data"].as<JsonArray>();
-        for (JsonObject zoneObj : zoneArray)
-        {
-          if (zoneObj["zone_id"].as<int>() == zoneId && zoneObj["alarm_id"].as<int>() == i)
-          {
-            JsonObject srcZoneData = zoneObj["zone_data"].as<JsonObject>();
-            for (JsonPair pair : srcZoneData)
-            {
-              zoneData[pair.key()] = pair.value();
-            }
-            break;
-          }
-        }
-      }
-      file.close();
+// Called with the state lock held
+void ZoneAlarms::recordFire(uint32_t alarmId, const char *action, time_t utcNow, time_t localNow, uint32_t elapsedUs)
+{
+  if (shared)
+  {
+    // Seconds past the alarm's minute, including any time spent queued
+    uint32_t lateness = localNow % 60 + (uint32_t)(now() - utcNow);
+    shared->history->record(utcNow, zoneId, alarmId, action, lateness < 255 ? lateness : 255, elapsedUs);
+    shared->stats->callbackUs.record(elapsedUs);
+    shared->stats->latenessS.record(lateness);
+    if (lateness >= STATS_LATE_THRESHOLD_S)
+      shared->stats->lateFires++;
+    shared->stats->fires[zoneId - 1]++;
+    if (!shared->stats->firstDispatchMs)
+      shared->stats->firstDispatchMs = millis() - shared->stats->bootStartMs;
+    if (shared->budgetUs && elapsedUs > shared->budgetUs)
+    {
+      shared->stats->overruns[zoneId - 1]++;
+      ALARM_LOGW("Zone %u callback took %lu us, budget %lu us", zoneId, (unsigned long)elapsedUs, (unsigned long)shared->budgetUs);
     }
-    obj["zone_data"] = zoneData;
+  }
+  tmElements_t tm;
+  breakTime(localNow, tm);
+  char timeStr[20];
+  snprintf(timeStr, sizeof(timeStr), "%04d/%02d/%02d %02d:%02d:%02d",
+           tmYearToCalendar(tm.Year), tm.Month, tm.Day, tm.Hour, tm.Minute, tm.Second);
+  ALARM_LOGI("Zone %u triggered at %s", zoneId, timeStr);
+}
 
-    
+// Refreshes a slot's match table entry after its timing or state changed
+void ZoneAlarms::indexSlot(uint8_t slot)
+{
+  const Alarm &alarm = alarms[slot];
+  if (matchDays[slot] && shared)
+    shared->week->release();
+  matchMinute[slot] = MATCH_NEVER_MINUTE;
+  matchDays[slot] = 0;
+  matchDate[slot] = MATCH_NEVER_DATE; // Never equal to a masked key
+  matchDateMask[slot] = 0;
+  if (!alarm.isActive)
+    return;
+  matchMinute[slot] = alarm.hour * 60 + alarm.minute;
+  if (alarm.isDateBased)
+  {
+    matchDate[slot] = matchDateKey(alarm.isOneTime ? alarm.year : 0, alarm.month, alarm.date);
+    matchDateMask[slot] = alarm.isOneTime ? MATCH_NEVER_DATE : MATCH_YEARLY_MASK;
+    return;
+  }
+  for (int d = 0; d < 7; d++)
+  {
+    if (alarm.days[d])
+      matchDays[slot] |= 1 << d;
   }
+  if (shared)
+    shared->week->add(matchDays[slot], matchMinute[slot]);
 }
 
-void ZoneAlarms::clearAlarms()
+void ZoneAlarms::indexWeek() const
 {
   for (int i = 0; i < 10; i++)
   {
-    alarms[i].isActive = false;
-    alarms[i].isDateBased = false;
-    alarms[i].isOneTime = false;
-    for (int j = 0; j < 7; j++)
-      alarms[i].days[j] = false;
-    alarms[i].year = 0;
-    alarms[i].month = 0;
-    alarms[i].date = 0;
-    alarms[i].hour = 0;
-    alarms[i].minute = 0;
-    alarms[i].action = "";
+    if (matchDays[i])
+      shared->week->add(matchDays[i], matchMinute[i]);
   }
-  alarmCount = 0;
 }
 
-// AlarmScheduler Implementation
-AlarmScheduler::AlarmScheduler(unsigned long timeOffset) : zones{ZoneAlarms(1), ZoneAlarms(2), ZoneAlarms(3), ZoneAlarms(4)},
-                                                           rtc(nullptr), wire(nullptr), ntpUDP(nullptr), timeClient(nullptr), lastSyncMillis(0), offset(timeOffset), spiffsInitialized(false) {}
-
-AlarmScheduler::~AlarmScheduler()
+// Compares every slot without branching; free slots never match
+uint16_t ZoneAlarms::matchSlots(uint16_t minuteOfDay, uint8_t weekdayBit, uint32_t dateKey, uint16_t *dayHits) const
 {
-  delete timeClient;
-  delete ntpUDP;
-  delete rtc;
-  delete wire;
+  uint16_t dates = 0;
+  uint16_t days = 0;
+  for (int i = 0; i < 10; i++)
+  {
+    uint16_t atTime = matchMinute[i] == minuteOfDay;
+    dates |= (atTime & ((dateKey & matchDateMask[i]) == matchDate[i])) << i;
+    days |= (atTime & ((matchDays[i] & weekdayBit) != 0)) << i;
+  }
+  *dayHits = days;
+  return dates;
 }
 
-void AlarmScheduler::updateOffsetValue(unsigned long _offset)
+bool ZoneAlarms::checkAlarms(const CalendarTick &tick)
 {
-  offset = _offset;
-  timeClient->setTimeOffset(_offset);
-  setRTCFromNTP();
+  if (timeStatus() != timeSet || !hasZone())
+    return false;
+  unsigned long currentMinute = tick.utcNow / 60;
+  if (currentMinute == lastTriggerMinute)
+    return false;
+
+  uint16_t dateHits = 0;
+  uint16_t dayHits = 0;
+  if (tick.skippedFrom)
+  {
+    // Alarms set inside a DST gap fire on the first minute after it
+    for (int i = 0; i < 10; i++)
+    {
+      time_t t = nextOccurrence(i, tick.skippedFrom);
+      if (t && t <= tick.localMinute)
+      {
+        if (alarms[i].isDateBased)
+          dateHits |= 1 << i;
+        else
+          dayHits |= 1 << i;
+      }
+    }
+  }
+  else
+  {
+    // Day-based alarms are only looked for in minutes the week index marks
+    uint8_t weekdayBit = !shared || shared->week->test(tick.minuteOfWeek) ? 1 << tick.weekday : 0;
+    dateHits = matchSlots(tick.minuteOfDay, weekdayBit, tick.dateKey, &dayHits);
+  }
+
+  bool stateChanged = false;
+  // Date-based alarms first; day-based ones only fire if none did
+  for (int i = 0; i < 10; i++)
+  {
+    if (!(dateHits & (1 << i)))
+      continue;
+    dispatch(i, tick.utcNow, tick.localNow);
+    if (alarms[i].isActive && alarms[i].isOneTime)
+    {
+      deactivate(i); // Its zone_data key goes with it
+      stateChanged = true;
+    }
+  }
+  for (int i = 0; i < 10 && !dateHits; i++)
+  {
+    if (dayHits & (1 << i))
+      dispatch(i, tick.utcNow, tick.localNow);
+  }
+
+  lastTriggerMinute = currentMinute;
+  return stateChanged;
+}
+
+time_t ZoneAlarms::dateOccurrence(const Alarm &alarm, int year) const
+{
+  if (!isValidDate(year, alarm.month, alarm.date))
+    return 0;
+  tmElements_t tm;
+  tm.Year = CalendarYrToTm(year);
+  tm.Month = alarm.month;
+  tm.Day = alarm.date;
+  tm.Hour = alarm.hour;
+  tm.Minute = alarm.minute;
+  tm.Second = 0;
+  return makeTime(tm);
+}
+
+time_t ZoneAlarms::nextOccurrence(uint8_t slot, time_t from)
+{
+  const Alarm &alarm = alarms[slot];
+  if (!alarm.isActive)
+    return 0;
+  if (alarm.isDateBased)
+  {
+    // One-time alarms have a single candidate; yearly ones are searched forward
+    // far enough to reach the next Feb 29 when needed
+    int firstYear = alarm.isOneTime ? alarm.year : year(from);
+    int lastYear = alarm.isOneTime ? alarm.year : firstYear + 8;
+    for (int y = firstYear; y <= lastYear; y++)
+    {
+      time_t t = dateOccurrence(alarm, y);
+      if (t && t >= from)
+        return t;
+    }
+    return 0;
+  }
+
+  time_t dayStart = previousMidnight(from);
+  for (int d = 0; d <= 7; d++)
+  {
+    time_t day = dayStart + d * SECS_PER_DAY;
+    if (!alarm.days[weekdayOf(day)])
+      continue;
+    time_t t = day + alarm.hour * SECS_PER_HOUR + alarm.minute * SECS_PER_MIN;
+    if (t >= from)
+      return t;
+  }
+  return 0;
+}
+
+time_t ZoneAlarms::previousOccurrence(uint8_t slot, time_t at)
+{
+  const Alarm &alarm = alarms[slot];
+  if (!alarm.isActive)
+    return 0;
+  if (alarm.isDateBased)
+  {
+    int lastYear = alarm.isOneTime ? alarm.year : year(at);
+    int firstYear = alarm.isOneTime ? alarm.year : lastYear - 8;
+    for (int y = lastYear; y >= firstYear; y--)
+    {
+      time_t t = dateOccurrence(alarm, y);
+      if (t && t <= at)
+        return t;
+    }
+    return 0;
+  }
+
+  time_t dayStart = previousMidnight(at);
+  for (int d = 0; d <= 7; d++)
+  {
+    time_t day = dayStart - d * SECS_PER_DAY;
+    if (!alarm.days[weekdayOf(day)])
+      continue;
+    time_t t = day + alarm.hour * SECS_PER_HOUR + alarm.minute * SECS_PER_MIN;
+    if (t <= at)
+      return t;
+  }
+  return 0;
+}
+
+time_t ZoneAlarms::nextTriggerTime(time_t from)
+{
+  time_t next = 0;
+  for (int i = 0; i < 10; i++)
+  {
+    time_t candidate = nextOccurrence(i, from);
+    if (candidate && (!next || candidate < next))
+      next = candidate;
+  }
+  return next;
+}
+
+bool ZoneAlarms::describe(uint8_t slot, SimulatedFire &fire) const
+{
+  fire.zone = zoneId;
+  fire.slot = slot;
+  fire.alarmId = alarms[slot].id;
+  fire.dateBased = alarms[slot].isDateBased;
+  fire.action = alarms[slot].action;
+  return alarms[slot].isActive;
+}
+
+bool ZoneAlarms::loadZoneData(uint8_t slot, JsonDocument &doc)
+{
+  if (!shared)
+    return false;
+  if (alarms[slot].dataState == DATA_WRITE)
+  {
+    uint16_t len;
+    const char *pending = shared->pending->get(alarms[slot].pendingHandle, &len);
+    return pending && !deserializeJson(doc, pending, len);
+  }
+
+  char key[STORAGE_KEY_LEN];
+  zoneDataKey(alarms[slot].id, key, sizeof(key));
+  if (!shared->storage->readJson(key, doc, shared->scratch, ALARM_PAYLOAD_MAX + 1))
+    return true;
+  if (!shared->slotKeys)
+    return false;
+  slotDataKey(zoneId, slot, key, sizeof(key)); // Not moved to its id key yet
+  return !shared->storage->readJson(key, doc, shared->scratch, ALARM_PAYLOAD_MAX + 1);
+}
+
+bool ZoneAlarms::pendingZoneData(uint8_t slot, char *buffer, uint16_t *len, uint32_t *id, uint32_t *staleId)
+{
+  const Alarm &alarm = alarms[slot];
+  *len = 0;
+  *id = alarm.id;
+  *staleId = alarm.staleId;
+  const char *pending = alarm.isActive && alarm.dataState == DATA_WRITE ? shared->pending->get(alarm.pendingHandle, len) : nullptr;
+  if (pending)
+    memcpy(buffer, pending, *len + 1);
+  return pending || alarm.staleId;
+}
+
+uint32_t ZoneAlarms::storedDataId(uint8_t slot) const
+{
+  const Alarm &alarm = alarms[slot];
+  return alarm.isActive && alarm.dataState == DATA_CLEAN ? alarm.id : 0;
+}
+
+void ZoneAlarms::clearZoneDataChanges()
+{
+  for (int i = 0; i < 10; i++)
+  {
+    dropPendingData(i, DATA_CLEAN);
+    alarms[i].staleId = 0;
+  }
+}
+
+void ZoneAlarms::addDays(const Alarm &alarm, JsonArray days) const
+{
+  static const char *const names[7] = {"sun", "mon", "tue", "wed", "thu", "fri", "sat"};
+  for (int d = 0; d < 7; d++)
+  {
+    if (alarm.days[d])
+      days.add(names[d]);
+  }
+}
+
+void ZoneAlarms::listAlarm(JsonObject obj, const Alarm &alarm, uint8_t slot) const
+{
+  obj["zone_id"] = zoneId;
+  obj["alarm_id"] = alarm.id;
+  obj["slot"] = slot;
+  obj["rev"] = alarm.rev;
+  obj["type"] = alarm.isDateBased ? "date" : "day";
+  char timeStr[6];
+  snprintf(timeStr, sizeof(timeStr), "%02d:%02d", alarm.hour, alarm.minute);
+  obj["time"] = timeStr;
+  obj["action"] = alarm.action;
+
+  if (alarm.isDateBased)
+  {
+    char dateStr[11];
+    snprintf(dateStr, sizeof(dateStr), "%04d-%02d-%02d", alarm.year, alarm.month, alarm.date);
+    obj["date"] = dateStr;
+    obj["oneTime"] = alarm.isOneTime;
+  }
+  else
+  {
+    addDays(alarm, obj.createNestedArray("days"));
+  }
+}
+
+// Serialized bytes (with the separating comma) and pool memory of one entry
+void ZoneAlarms::entryUsage(const Alarm &alarm, uint8_t slot, size_t *bytes, size_t *memory) const
+{
+  StaticJsonDocument<512> entry;
+  JsonArray arr = entry.to<JsonArray>();
+  listAlarm(arr.createNestedObject(), alarm, slot);
+  *bytes += measureJson(arr[0]) + 1;
+  *memory += entry.memoryUsage();
+}
+
+void ZoneAlarms::fileUsage(size_t *bytes, size_t *memory, int skipSlot) const
+{
+  for (int i = 0; i < 10; i++)
+  {
+    if (alarms[i].isActive && i != skipSlot)
+      entryUsage(alarms[i], i, bytes, memory);
+  }
+}
+
+// alarms.json has to fit the flush buffer, the snapshot document and one
+// value of the storage backend, or the schedule could never be saved
+bool ZoneAlarms::fitsFile(const Alarm &alarm, uint8_t slot, JsonDocument &doc)
+{
+  if (!shared || !shared->zones)
+    return true;
+  if (shared->owner)
+    shared->owner->loadAlarmDetails(); // Actions still on flash would be counted short
+  size_t bytes = ALARM_FILE_OVERHEAD;
+  size_t memory = ALARM_FILE_OVERHEAD;
+  for (int z = 0; z < 4; z++)
+    shared->zones[z].fileUsage(&bytes, &memory, z + 1 == zoneId ? slot : -1);
+  entryUsage(alarm, slot, &bytes, &memory);
+  if (bytes <= shared->fileLimit && memory <= ALARM_FILE_DOC_SIZE)
+    return true;
+  doc.clear();
+  doc["status"] = "error";
+  doc["message"] = "Schedule too large to save on this storage";
+  return false;
+}
+
+void ZoneAlarms::listAlarms(JsonArray &arr, bool withZoneData)
+{
+  for (int i = 0; i < 10; i++)
+  {
+    if (!alarms[i].isActive)
+      continue;
+    JsonObject obj = arr.createNestedObject();
+    listAlarm(obj, alarms[i], i);
+
+    // Add zone_data to the output
+    if (withZoneData)
+    {
+      JsonObject zoneData = obj.createNestedObject("zone_data");
+      if (shared && loadZoneData(i, *shared->payloadDoc))
+        zoneData.set(shared->payloadDoc->as<JsonObject>());
+    }
+  }
+}
+
+void ZoneAlarms::clearAlarms()
+{
+  for (int i = 0; i < 10; i++)
+  {
+    alarms[i].isDateBased = false;
+    alarms[i].isOneTime = false;
+    for (int j = 0; j < 7; j++)
+      alarms[i].days[j] = false;
+    alarms[i].year = 0;
+    alarms[i].month = 0;
+    alarms[i].date = 0;
+    alarms[i].hour = 0;
+    alarms[i].minute = 0;
+    alarms[i].action[0] = '\0';
+    alarms[i].detailsPending = false;
+    if (alarms[i].isActive && shared)
+      shared->ids->remove(alarms[i].id);
+    alarms[i].isActive = false;
+    indexSlot(i);
+    alarms[i].id = 0;
+    alarms[i].rev = 0;
+    alarms[i].staleId = 0;
+    dropPendingData(i, DATA_CLEAN);
+  }
+  alarmCount = 0;
+}
+
+size_t ZoneAlarms::exportCompact(CompactAlarm *out) const
+{
+  size_t n = 0;
+  for (int i = 0; i < 10; i++)
+  {
+    const Alarm &alarm = alarms[i];
+    if (!alarm.isActive)
+      continue;
+    CompactAlarm &entry = out[n++];
+    entry.zone = zoneId;
+    entry.slot = i;
+    entry.flags = (alarm.isDateBased ? COMPACT_DATE_BASED : 0) | (alarm.isOneTime ? COMPACT_ONE_TIME : 0);
+    entry.days = 0;
+    for (int d = 0; d < 7; d++)
+    {
+      if (alarm.days[d])
+        entry.days |= 1 << d;
+    }
+    entry.year = alarm.year;
+    entry.month = alarm.month;
+    entry.date = alarm.date;
+    entry.hour = alarm.hour;
+    entry.minute = alarm.minute;
+    entry.id = alarm.id;
+  }
+  return n;
+}
+
+bool ZoneAlarms::restoreCompact(const CompactAlarm &entry)
+{
+  if (entry.slot >= 10 || alarms[entry.slot].isActive || entry.hour > 23 || entry.minute > 59 ||
+      !shared || !shared->ids->insert(entry.id, zoneId, entry.slot))
+    return false;
+  Alarm &alarm = alarms[entry.slot];
+  alarm.isDateBased = entry.flags & COMPACT_DATE_BASED;
+  alarm.isOneTime = entry.flags & COMPACT_ONE_TIME;
+  for (int d = 0; d < 7; d++)
+    alarm.days[d] = entry.days & (1 << d);
+  alarm.year = entry.year;
+  alarm.month = entry.month;
+  alarm.date = entry.date;
+  alarm.hour = entry.hour;
+  alarm.minute = entry.minute;
+  alarm.id = entry.id;
+  alarm.rev = 0;
+  alarm.staleId = 0;
+  alarm.action[0] = '\0';
+  alarm.detailsPending = true;
+  dropPendingData(entry.slot, DATA_CLEAN); // zone_data stays under its key until first use
+  alarm.isActive = true;
+  indexSlot(entry.slot);
+  alarmCount++;
+  return true;
+}
+
+bool ZoneAlarms::applyDetails(JsonObject obj)
+{
+  int slot = obj["slot"] | -1;
+  if (slot < 0 || slot >= 10 || !alarms[slot].isActive || alarms[slot].id != (obj["alarm_id"] | (uint32_t)0))
+    return false;
+  Alarm &alarm = alarms[slot];
+  if (!alarm.detailsPending)
+    return true; // Replaced since boot; the live alarm wins
+  char timeStr[6];
+  snprintf(timeStr, sizeof(timeStr), "%02d:%02d", alarm.hour, alarm.minute);
+  const char *action = obj["action"] | "";
+  if (strcmp(obj["time"] | "", timeStr) != 0 || alarm.isDateBased != (strcmp(obj["type"] | "", "date") == 0) ||
+      strlen(action) >= ALARM_ACTION_LEN)
+    return false;
+  strcpy(alarm.action, action);
+  alarm.rev = obj["rev"] | 1;
+  alarm.detailsPending = false;
+  return true;
+}
+
+bool ZoneAlarms::detailsPending() const
+{
+  for (int i = 0; i < 10; i++)
+  {
+    if (alarms[i].isActive && alarms[i].detailsPending)
+      return true;
+  }
+  return false;
+}
+
+int ZoneAlarms::findId(uint32_t id) const
+{
+  uint8_t zone, slot;
+  if (shared)
+    return shared->ids->find(id, &zone, &slot) && zone == zoneId ? slot : -1;
+  for (int i = 0; i < 10; i++)
+  {
+    if (alarms[i].isActive && alarms[i].id == id)
+      return i;
+  }
+  return -1;
+}
+
+uint32_t ZoneAlarms::scheduleHash() const
+{
+  // Ascending id order, each pair as 4 + 2 little-endian bytes, so a
+  // controller reproduces the hash from its own copy of the schedule
+  uint8_t order[10];
+  uint8_t n = 0;
+  for (int i = 0; i < 10; i++)
+  {
+    if (!alarms[i].isActive)
+      continue;
+    uint8_t j = n++;
+    for (; j > 0 && alarms[order[j - 1]].id > alarms[i].id; j--)
+      order[j] = order[j - 1];
+    order[j] = i;
+  }
+  uint32_t hash = 2166136261UL;
+  for (uint8_t k = 0; k < n; k++)
+  {
+    const Alarm &alarm = alarms[order[k]];
+    uint8_t bytes[6] = {(uint8_t)alarm.id, (uint8_t)(alarm.id >> 8), (uint8_t)(alarm.id >> 16), (uint8_t)(alarm.id >> 24),
+                        (uint8_t)alarm.rev, (uint8_t)(alarm.rev >> 8)};
+    for (uint8_t b : bytes)
+    {
+      hash ^= b;
+      hash *= 16777619UL;
+    }
+  }
+  return hash;
+}
+
+void ZoneAlarms::listRevisions(JsonArray &arr) const
+{
+  for (int i = 0; i < 10; i++)
+  {
+    if (!alarms[i].isActive)
+      continue;
+    JsonObject entry = arr.createNestedObject();
+    entry["alarm_id"] = alarms[i].id;
+    entry["rev"] = alarms[i].rev;
+  }
+}
+
+// AlarmScheduler Implementation
+volatile uint32_t CountingAllocator::allocations = 0;
+
+AlarmScheduler::AlarmScheduler(unsigned long timeOffset) : zones{ZoneAlarms(1, &zoneResources), ZoneAlarms(2, &zoneResources), ZoneAlarms(3, &zoneResources), ZoneAlarms(4, &zoneResources)},
+                                                           rtc(nullptr), wire(nullptr), ntpUDP(nullptr), timeClient(nullptr), lastSyncMillis(0), timeZone((long)timeOffset), storageReady(false), legacyZoneData(false),
+                                                           waitingTask(nullptr), planSeq(0), plannedSeq(0), plannedFrom(0), nextTrigger(0), detailsPending(false), scheduleGeneration(0), indexGeneration(0), stateLock(nullptr), flushLock(nullptr), persistTask(nullptr),
+                                                           dirtyZones(0), mutationSeq(0), firstDirtyMillis(0), persistWindowMs(PERSIST_WINDOW_MS),
+                                                           pendingByteCount(0), requestLock(nullptr), ioChunk(STORAGE_CHUNK), storage(&defaultStorage),
+                                                           requestDoc(ALARM_REQUEST_DOC_SIZE), responseDoc(ALARM_RESPONSE_DOC_SIZE),
+                                                           payloadDoc(ALARM_PAYLOAD_DOC_SIZE), fileDoc(ALARM_FILE_DOC_SIZE),
+                                                           zoneResources{this, &defaultStorage, &pendingPool, &payloadDoc, payloadScratch, &statistics, &history, &subscribers, 0, {nullptr, nullptr, nullptr, nullptr}, 0, &alarmIds, &weekIndex, false, zones, ALARM_FILE_BUFFER_SIZE - 1},
+                                                           historySpill(false), stateReplay(false), replayZones(0)
+{
+  statistics.reset();
+  for (int i = 0; i < 4; i++)
+  {
+    workers[i].owner = this;
+    workers[i].zone = i;
+    workers[i].task = nullptr;
+    workers[i].queue = nullptr;
+  }
+}
+
+AlarmScheduler::~AlarmScheduler()
+{
+  if (persistTask)
+    vTaskDelete(persistTask);
+  for (int i = 0; i < 4; i++)
+  {
+    if (workers[i].task)
+      vTaskDelete(workers[i].task);
+  }
+  if (stateLock)
+    vSemaphoreDelete(stateLock);
+  if (flushLock)
+    vSemaphoreDelete(flushLock);
+  if (requestLock)
+    vSemaphoreDelete(requestLock);
+  delete timeClient;
+  delete ntpUDP;
+  delete rtc;
+  delete wire;
+}
+
+void AlarmScheduler::updateOffsetValue(unsigned long _offset)
+{
+  // Clocks run on UTC, so a new offset only changes how local time is derived
+  timeZone.setFixedOffset((long)_offset);
+  saveTimeZoneToSpiffs();
+  notifyWaiter();
+}
+
+bool AlarmScheduler::setTimeZone(const char *posixTz)
+{
+  if (!timeZone.setPosix(posixTz))
+    return false;
+  saveTimeZoneToSpiffs();
+  notifyWaiter();
+  return true;
+}
+
+time_t AlarmScheduler::localTime()
+{
+  return timeZone.toLocal(now());
+}
+
+bool AlarmScheduler::saveTimeZoneToSpiffs()
+{
+  if (!storageReady)
+    return false;
+  // Serialized with the persist task, which writes the same backend
+  if (flushLock)
+    xSemaphoreTake(flushLock, portMAX_DELAY);
+  bool ok = storage->write("/timezone.txt", (const uint8_t *)timeZone.posix(), strlen(timeZone.posix()));
+  if (flushLock)
+    xSemaphoreGive(flushLock);
+  return ok;
+}
+
+void AlarmScheduler::loadTimeZoneFromSpiffs()
+{
+  char tz[TZ_SPEC_LEN];
+  size_t len = storage->read("/timezone.txt", (uint8_t *)tz, sizeof(tz) - 1);
+  if (len == 0)
+    return;
+  tz[len] = '\0';
+  if (!timeZone.setPosix(tz))
+    ALARM_LOGW("Invalid time zone in timezone.txt, keeping default offset");
+}
+
+void AlarmScheduler::setStorage(AlarmStorage &backend)
+{
+  storage = &backend;
+  zoneResources.storage = &backend;
+  size_t limit = backend.maxValueSize();
+  zoneResources.fileLimit = limit < sizeof(flushBuffer) - 1 ? limit : sizeof(flushBuffer) - 1;
 }
 
 void AlarmScheduler::begin(uint8_t rstPin, uint8_t datPin, uint8_t clkPin)
 {
+  statistics.bootStartMs = millis();
   wire = new ThreeWire(datPin, clkPin, rstPin);
   rtc = new RtcDS1302<ThreeWire>(*wire);
   rtc->Begin();
 
   // Initialize NTP client components
   ntpUDP = new WiFiUDP();
-  timeClient = new NTPClient(*ntpUDP, "pool.ntp.org", offset, 86400000);
+  timeClient = new NTPClient(*ntpUDP, "pool.ntp.org", 0, 86400000); // UTC; local time comes from timeZone
 
-  // Initialize SPIFFS
-  spiffsInitialized = SPIFFS.begin(true); // Format on failure
-  if (!spiffsInitialized)
+  alarmLog.begin();
+
+  // Initialize storage
+  storageReady = storage->begin();
+  if (!storageReady)
   {
-    Serial.println("Failed to initialize SPIFFS");
+    ALARM_LOGE("Failed to initialize %s storage", storage->name());
   }
   else
   {
-    Serial.println("SPIFFS initialized successfully");
+    ALARM_LOGI("%s storage initialized successfully", storage->name());
+    // Bounded recovery: at most two slot checks per file
+    storage->recover("/alarms.json");
+    storage->recover("/timezone.txt");
+    storage->recover("/schedule.bin");
+    migrateRtcToUtc();
+    loadTimeZoneFromSpiffs();
+    history.begin(historySpill ? storage : nullptr);
   }
 
   if (rtc->GetIsRunning())
   {
-    Serial.println("DS1302 initialized and running.");
+    ALARM_LOGI("DS1302 initialized and running");
   }
   else
   {
-    Serial.println("DS1302 detected but not running. Set time using 'set' command.");
+    ALARM_LOGW("DS1302 detected but not running. Set time using 'set' command");
     rtc->SetIsRunning(true);
   }
 
@@ -574,25 +1251,267 @@ void AlarmScheduler::begin(uint8_t rstPin, uint8_t datPin, uint8_t clkPin)
   if (rtcTime > 0)
     setTime(rtcTime);
 
-  // Load alarms from SPIFFS
-  if (spiffsInitialized)
+  stateLock = xSemaphoreCreateRecursiveMutex();
+  flushLock = xSemaphoreCreateMutex();
+  requestLock = xSemaphoreCreateMutex();
+
+  // Load alarms from storage; the compact index lets dispatch start before alarms.json is parsed
+  if (storageReady)
+  {
+    if (loadScheduleIndex())
+    {
+      ALARM_LOGI("Schedule index restored");
+    }
+    else if (!loadAlarmsFromSpiffs())
+    {
+      ALARM_LOGE("Failed to load alarms from storage");
+    }
+    else
+    {
+      ALARM_LOGI("Alarms loaded from storage successfully");
+      lockState();
+      markDirty(0x0F, 0); // Write the index for the next boot
+      unlockState();
+    }
+    xTaskCreate(persistTaskEntry, "alarm_persist", 8192, this, 1, &persistTask);
+    if (dirtyZones || detailsPending)
+      xTaskNotifyGive(persistTask);
+  }
+  if (stateReplay)
+    replayZones = 0x0F; // Zones registered after begin() are replayed on their first check
+  statistics.stagedBoot = detailsPending;
+  statistics.beginMs = millis() - statistics.bootStartMs;
+}
+
+struct ScheduleIndexHeader
+{
+  uint32_t generation; // Matches "generation" in alarms.json
+  uint16_t count;
+  uint16_t reserved;
+};
+
+bool AlarmScheduler::loadScheduleIndex()
+{
+  size_t len = storage->read("/schedule.bin", (uint8_t *)flushBuffer, sizeof(flushBuffer));
+  ScheduleIndexHeader header;
+  if (len < sizeof(header))
+    return false;
+  memcpy(&header, flushBuffer, sizeof(header));
+  if (header.count > 40 || len != sizeof(header) + header.count * sizeof(CompactAlarm))
+    return false;
+
+  lockState();
+  for (int i = 0; i < 4; i++)
+    zones[i].clearAlarms();
+  const CompactAlarm *entries = (const CompactAlarm *)(flushBuffer + sizeof(header));
+  for (uint16_t i = 0; i < header.count; i++)
+  {
+    CompactAlarm entry;
+    memcpy(&entry, &entries[i], sizeof(entry));
+    if (entry.zone < 1 || entry.zone > 4 || !zones[entry.zone - 1].restoreCompact(entry))
+    {
+      for (int j = 0; j < 4; j++)
+        zones[j].clearAlarms();
+      unlockState();
+      return false;
+    }
+  }
+  indexGeneration = scheduleGeneration = header.generation;
+  detailsPending = true; // Even an empty index is checked against alarms.json
+  unlockState();
+  return true;
+}
+
+bool AlarmScheduler::loadAlarmDetails()
+{
+  if (!detailsPending)
+    return true;
+  // A stale index is replayed by restoreAlarms(), which may migrate
+  // zone_data to storage under the flush lock. That lock ranks before the
+  // state lock, so callers already holding the state lock (dispatch, edits)
+  // replay without writing and leave the zone_data to the pending pool.
+  bool writes = !stateLock || xSemaphoreGetMutexHolder(stateLock) != xTaskGetCurrentTaskHandle();
+  if (writes && flushLock)
+    xSemaphoreTake(flushLock, portMAX_DELAY);
+  PooledJsonDocument doc(ALARM_FILE_DOC_SIZE); // Once per boot, like loadAlarmsFromSpiffs(); counted by heapAllocations()
+  DeserializationError error = storage->readJson("/alarms.json", doc);
+
+  lockState();
+  bool success = true;
+  if (detailsPending)
   {
-    if (!loadAlarmsFromSpiffs())
+    // Fill in the restored alarms; any disagreement means the index is stale
+    bool consistent = !error && (doc["generation"] | (uint32_t)0) == indexGeneration;
+    for (JsonObject alarm : doc["alarms"].as<JsonArray>())
     {
-      Serial.println("Failed to load alarms from SPIFFS");
+      int zoneId = alarm["zone_id"] | 0;
+      if (!consistent)
+        break;
+      consistent = zoneId >= 1 && zoneId <= 4 && zones[zoneId - 1].applyDetails(alarm);
+    }
+    for (int i = 0; i < 4 && consistent; i++)
+      consistent = !zones[i].detailsPending();
+
+    if (error)
+    {
+      ALARM_LOGE("Cannot read alarms.json, keeping indexed alarms without actions");
+      success = false;
+    }
+    else if (!consistent)
+    {
+      ALARM_LOGW("Schedule index out of date, reloading alarms.json");
+      success = restoreAlarms(doc, writes);
+      markDirty(0x0F, 0); // Rewrite the index
     }
     else
     {
-      Serial.println("Alarms loaded from SPIFFS successfully");
+      restoreVersions(doc, true);
     }
+    detailsPending = false;
+  }
+  unlockState();
+  if (writes && flushLock)
+    xSemaphoreGive(flushLock);
+  return success;
+}
+
+void AlarmScheduler::lockState()
+{
+  if (stateLock)
+    xSemaphoreTakeRecursive(stateLock, portMAX_DELAY);
+}
+
+void AlarmScheduler::unlockState()
+{
+  if (stateLock)
+    xSemaphoreGiveRecursive(stateLock);
+}
+
+// Called with the state lock held
+void AlarmScheduler::markDirty(uint8_t zoneMask, size_t bytes)
+{
+  if (!dirtyZones)
+    firstDirtyMillis = millis();
+  dirtyZones |= zoneMask;
+  mutationSeq++;
+  planSeq++;
+  pendingByteCount += bytes;
+  if (persistTask)
+    xTaskNotifyGive(persistTask);
+}
+
+void AlarmScheduler::persistTaskEntry(void *arg)
+{
+  AlarmScheduler *self = static_cast<AlarmScheduler *>(arg);
+  for (;;)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    if (self->detailsPending)
+      self->loadAlarmDetails();
+    // Let further mutations within the window join the same write
+    while (self->dirtyZones)
+    {
+      unsigned long age = millis() - self->firstDirtyMillis;
+      if (age < self->persistWindowMs)
+      {
+        vTaskDelay(pdMS_TO_TICKS(self->persistWindowMs - age));
+        continue;
+      }
+      if (!self->flush())
+        vTaskDelay(pdMS_TO_TICKS(self->persistWindowMs)); // Retry after a failed write
+    }
+    if (self->history.spillDue())
+      self->spillHistory(false);
+  }
+}
+
+bool AlarmScheduler::startZoneWorkers(uint32_t stackSize, UBaseType_t priority)
+{
+  bool success = true;
+  for (int i = 0; i < 4; i++)
+  {
+    if (workers[i].task)
+      continue;
+    if (!workers[i].queue)
+      workers[i].queue = xQueueCreateStatic(ZONE_QUEUE_LEN, sizeof(ZoneJob), workers[i].queueStorage, &workers[i].queueControl);
+    QueueHandle_t queue = workers[i].queue;
+    char name[14];
+    snprintf(name, sizeof(name), "alarm_zone%d", i + 1);
+    // The task reads its queue from the worker, so it may start before the queue is published
+    if (!queue || xTaskCreate(workerTaskEntry, name, stackSize, &workers[i], priority, &workers[i].task) != pdPASS)
+    {
+      workers[i].task = nullptr;
+      success = false;
+      continue;
+    }
+    lockState();
+    zoneResources.workers[i] = queue;
+    unlockState();
+  }
+  return success;
+}
+
+void AlarmScheduler::workerTaskEntry(void *arg)
+{
+  ZoneWorker *worker = static_cast<ZoneWorker *>(arg);
+  AlarmScheduler *self = worker->owner;
+  ZoneAlarms &zone = self->zones[worker->zone];
+  StaticJsonDocument<ALARM_PAYLOAD_DOC_SIZE> doc; // Worker's own copy; the shared one stays under the state lock
+  ZoneJob job;
+  for (;;)
+  {
+    if (xQueueReceive(worker->queue, &job, portMAX_DELAY) != pdTRUE)
+      continue;
+    doc.clear();
+    self->lockState();
+    uint16_t len;
+    const char *payload = self->pendingPool.get(job.payloadHandle, &len);
+    if (!payload || deserializeJson(doc, payload, len)) // Copies, so the entry can go
+      doc.to<JsonObject>();
+    self->pendingPool.release(job.payloadHandle);
+    self->unlockState();
+
+    // Only this zone waits on a slow callback
+    JsonObject zoneData = doc.as<JsonObject>();
+    uint32_t elapsed = zone.invoke(job.alarmId, job.action, zoneData);
+    self->lockState();
+    zone.recordFire(job.alarmId, job.action, job.utcNow, job.localNow, elapsed);
+    self->unlockState();
   }
 }
 
-void AlarmScheduler::registerZone(uint8_t id, void (*zone)(int id, String _action, JsonObject &zoneData))
+void AlarmScheduler::registerZone(uint8_t id, ZoneCallback zone)
 {
   if (id < 1 || id > 4)
     return;
   zones[id - 1].setZone(zone);
+  notifyWaiter();
+}
+
+bool AlarmScheduler::subscribe(uint8_t zone, uint16_t target, TargetFunction fn, void *context, uint32_t alarmId)
+{
+  lockState();
+  bool success = subscribers.subscribe(zone, target, fn, context, alarmId);
+  unlockState();
+  if (success)
+    notifyWaiter(); // The zone may have just gained its first handler
+  return success;
+}
+
+size_t AlarmScheduler::unsubscribe(uint8_t zone, uint16_t target, TargetFunction fn, void *context)
+{
+  lockState();
+  size_t removed = subscribers.unsubscribe(zone, target, fn, context);
+  unlockState();
+  return removed;
+}
+
+void AlarmScheduler::notifyWaiter()
+{
+  planSeq++; // Handlers, time zone or clock changed
+  TaskHandle_t task = waitingTask;
+  if (task)
+    xTaskNotifyGive(task);
 }
 
 time_t AlarmScheduler::getRtcTime()
@@ -602,11 +1521,33 @@ time_t AlarmScheduler::getRtcTime()
   RtcDateTime now = rtc->GetDateTime();
   if (now.IsValid())
   {
-    return now.TotalSeconds() + 946684800L; // Unix time (2000 to 1970 offset)
+    return now.TotalSeconds() + 946684800L; // Unix time (2000 to 1970 offset), RTC holds UTC
   }
   return 0;
 }
 
+// Older versions kept local time at the constructor offset in the RTC. The
+// first boot of this one shifts it to UTC, once: the marker is written before
+// the RTC, so a reset in between can leave the old time but never shift twice.
+void AlarmScheduler::migrateRtcToUtc()
+{
+  // The marker lives in NVS rather than the swappable backend, which a
+  // format or setStorage() would empty. Older versions never wrote
+  // schedule.bin, so only their alarms.json can come with a local RTC.
+  Preferences prefs;
+  if (!prefs.begin("alarmrtc", false))
+    return;
+  bool migrate = !prefs.getBool("utc", false) && prefs.putBool("utc", true);
+  prefs.end();
+  if (!migrate || storage->size("/alarms.json") == 0 || storage->size("/schedule.bin") != 0)
+    return;
+  time_t local = getRtcTime();
+  if (local <= 0)
+    return;
+  rtc->SetDateTime(RtcDateTime(timeZone.toUtc(local) - 946684800L));
+  ALARM_LOGI("RTC moved from local time to UTC");
+}
+
 bool AlarmScheduler::setRTCFromNTP()
 {
   if (WiFi.status() != WL_CONNECTED)
@@ -627,7 +1568,7 @@ bool AlarmScheduler::setRTCFromNTP()
   // Validate epoch time (must be after 2025 and before 2100)
   if (epochTime < 1735689600 || epochTime > 4102444800)
   {
-    Serial.println("Invalid NTP time received. Skipping RTC update.");
+    ALARM_LOGW("Invalid NTP time %lu received, skipping RTC update", epochTime);
     return false;
   }
 
@@ -646,16 +1587,18 @@ bool AlarmScheduler::setRTCFromNTP()
   rtc->SetDateTime(ntpTime);
 
   // Update TimeLib as well
+  statistics.lastNtpDrift = (int32_t)(epochTime - now());
+  statistics.lastNtpSync = epochTime;
   setTime(epochTime);
 
   if (rtc->IsDateTimeValid())
   {
-    Serial.println("RTC time set from NTP successfully!");
+    ALARM_LOGI("RTC time set from NTP, drift %ld s", (long)statistics.lastNtpDrift);
     return true;
   }
   else
   {
-    Serial.println("Failed to set RTC time from NTP.");
+    ALARM_LOGE("Failed to set RTC time from NTP");
     return false;
   }
 }
@@ -664,7 +1607,8 @@ bool AlarmScheduler::syncWithNTP()
 {
   if (WiFi.status() != WL_CONNECTED)
   {
-    Serial.println("No Wi-Fi connection. Cannot sync with NTP.");
+    ALARM_LOGW("No Wi-Fi connection, cannot sync with NTP");
+    statistics.ntpFailures++;
     return false;
   }
 
@@ -679,237 +1623,297 @@ bool AlarmScheduler::syncWithNTP()
   // End NTP client to free resources
   timeClient->end();
 
+  if (success)
+    statistics.ntpSyncs++;
+  else
+    statistics.ntpFailures++;
+  if (success && stateReplay)
+    replayState();
   return success;
 }
 
 bool AlarmScheduler::saveZoneDataToSpiffs()
 {
-  if (!spiffsInitialized)
+  // Each alarm's zone_data has its own key; writing pending entries is a flush
+  return flush();
+}
+
+bool AlarmScheduler::loadZoneDataForAlarm(uint8_t zoneId, uint32_t alarmId, JsonObject &zoneData)
+{
+  if (!storageReady)
   {
     return false;
   }
 
-  DynamicJsonDocument doc(8192); // Larger buffer for zone data
-  JsonArray zoneDataArray = doc.createNestedArray("zone_data");
-
-  // Read existing zone data file if it exists
-  File file = SPIFFS.open("/zone_data.json", FILE_READ);
-  if (file)
+  lockState();
+  uint8_t zone, slot;
+  bool found = alarmIds.find(alarmId, &zone, &slot) && zone == zoneId && zones[zone - 1].loadZoneData(slot, payloadDoc);
+  if (found)
   {
-    DynamicJsonDocument existingDoc(8192);
-    DeserializationError error = deserializeJson(existingDoc, file);
-    if (!error && existingDoc.containsKey("zone_data"))
+    for (JsonPair pair : payloadDoc.as<JsonObject>())
     {
-      JsonArray existing = existingDoc["zone_data"].as<JsonArray>();
-      for (JsonObject obj : existing)
-      {
-        JsonObject newObj = zoneDataArray.createNestedObject();
-        for (JsonPair pair : obj)
-        {
-          newObj[pair.key()] = pair.value();
-        }
-      }
+      zoneData[pair.key()] = pair.value();
     }
-    file.close();
-  }
-
-  // Write back to file
-  file = SPIFFS.open("/zone_data.json", FILE_WRITE);
-  if (!file)
-  {
-    return false;
   }
+  unlockState();
+  return found;
+}
 
-  if (serializeJson(doc, file) == 0)
+bool AlarmScheduler::deleteZoneDataFromSpiffs(uint8_t zoneId, uint32_t alarmId)
+{
+  if (!storageReady || zoneId < 1 || zoneId > 4 || alarmId == 0)
   {
-    file.close();
     return false;
   }
 
-  file.close();
+  if (flushLock)
+    xSemaphoreTake(flushLock, portMAX_DELAY);
+  char key[STORAGE_KEY_LEN];
+  zoneDataKey(alarmId, key, sizeof(key));
+  storage->remove(key); // A missing key means nothing to delete
+  if (flushLock)
+    xSemaphoreGive(flushLock);
   return true;
 }
 
-bool AlarmScheduler::loadZoneDataForAlarm(uint8_t zoneId, uint8_t alarmId, JsonObject &zoneData)
+bool AlarmScheduler::saveAlarmsToSpiffs()
 {
-  if (!spiffsInitialized)
-  {
-    return false;
-  }
-
-  File file = SPIFFS.open("/zone_data.json", FILE_READ);
-  if (!file)
-  {
-    return false;
-  }
+  return flush();
+}
 
-  DynamicJsonDocument doc(8192);
-  DeserializationError error = deserializeJson(doc, file);
-  file.close();
+bool AlarmScheduler::runJob(StorageJob &job)
+{
+  StorageJob::Status status;
+  while ((status = job.step(ioChunk)) == StorageJob::RUNNING)
+    vTaskDelay(1); // Let the loop and other zones run between slices of flash work
+  return status == StorageJob::DONE;
+}
 
-  if (error)
+// Called with the flush lock held
+bool AlarmScheduler::writeFile(const char *path, const char *content, size_t len)
+{
+  if (!ioJob.startWrite(*storage, path, (const uint8_t *)content, len) || !runJob(ioJob))
   {
+    ALARM_LOGE("Failed to write to %s", path + 1);
     return false;
   }
-
-  JsonArray zoneDataArray = doc["zone_data"].as<JsonArray>();
-  for (JsonObject obj : zoneDataArray)
-  {
-    if (obj["zone_id"].as<int>() == zoneId && obj["alarm_id"].as<int>() == alarmId)
-    {
-      JsonObject srcZoneData = obj["zone_data"].as<JsonObject>();
-      for (JsonPair pair : srcZoneData)
-      {
-        zoneData[pair.key()] = pair.value();
-      }
-      return true;
-    }
-  }
-  return false;
+  statistics.bytesPersisted += len;
+  return true;
 }
 
-bool AlarmScheduler::deleteZoneDataFromSpiffs(uint8_t zoneId, uint8_t alarmId)
+bool AlarmScheduler::flush()
 {
-  if (!spiffsInitialized)
+  if (!storageReady)
   {
+    ALARM_LOGE("Storage not initialized");
     return false;
   }
-
-  File file = SPIFFS.open("/zone_data.json", FILE_READ);
-  if (!file)
-  {
-    return true; // No file means nothing to delete
-  }
-
-  DynamicJsonDocument doc(8192);
-  DeserializationError error = deserializeJson(doc, file);
-  file.close();
-
-  if (error)
+  loadAlarmDetails(); // The snapshot needs every action
+  if (!dirtyZones)
+    return spillHistory(true);
+
+  if (flushLock)
+    xSemaphoreTake(flushLock, portMAX_DELAY);
+  unsigned long start = millis();
+
+  // Snapshot in RAM under the lock so triggers never wait on flash
+  lockState();
+  uint32_t snapshotSeq = mutationSeq;
+  fileDoc.clear();
+  ScheduleIndexHeader index = {++scheduleGeneration, 0, 0};
+  fileDoc["generation"] = index.generation;
+  fileDoc["next_id"] = zoneResources.nextId;
+  fileDoc["zone_data_keys"] = "id"; // Absent in files whose zone_data is keyed by slot
+  JsonArray versions = fileDoc.createNestedArray("versions");
+  for (int i = 0; i < 4; i++)
+    versions.add(zones[i].scheduleVersion());
+  JsonArray alarms = fileDoc.createNestedArray("alarms");
+  CompactAlarm compact[40];
+  for (int i = 0; i < 4; i++)
   {
-    return false;
+    zones[i].listAlarms(alarms, false);
+    index.count += zones[i].exportCompact(compact + index.count);
   }
+  unlockState();
 
-  JsonArray zoneDataArray = doc["zone_data"].as<JsonArray>();
-  JsonArray newArray = doc.createNestedArray("new_zone_data");
-
-  // Copy all entries except the one to delete
-  for (JsonObject obj : zoneDataArray)
+  // Only changed payloads are touched, each under its own key and copied
+  // out one at a time so the pool stays usable while flash is busy. Keys of
+  // removed alarms go first, as a replacement may reuse the id in another slot.
+  bool success = !zoneResources.slotKeys || migrateSlotKeys();
+  for (int pass = 0; pass < 2; pass++)
   {
-    if (!(obj["zone_id"].as<int>() == zoneId && obj["alarm_id"].as<int>() == alarmId))
+    for (int i = 0; i < 4; i++)
     {
-      JsonObject newObj = newArray.createNestedObject();
-      for (JsonPair pair : obj)
+      for (int j = 0; j < 10; j++)
       {
-        newObj[pair.key()] = pair.value();
+        uint16_t len;
+        uint32_t id, staleId;
+        lockState();
+        bool changed = zones[i].pendingZoneData(j, flushBuffer, &len, &id, &staleId);
+        unlockState();
+        if (!changed)
+          continue;
+        char key[STORAGE_KEY_LEN];
+        if (pass == 0 && staleId)
+        {
+          zoneDataKey(staleId, key, sizeof(key));
+          storage->remove(key);
+        }
+        else if (pass == 1 && len)
+        {
+          zoneDataKey(id, key, sizeof(key));
+          success = writeFile(key, flushBuffer, len) && success;
+        }
       }
     }
   }
 
-  // Replace the array
-  doc.remove("zone_data");
-  doc["zone_data"] = newArray;
-  doc.remove("new_zone_data");
-
-  // Write back to file
-  file = SPIFFS.open("/zone_data.json", FILE_WRITE);
-  if (!file)
+  statistics.notePeak(3, fileDoc.memoryUsage());
+  size_t alarmsLen = measureJson(fileDoc);
+  if (fileDoc.overflowed() || alarmsLen >= sizeof(flushBuffer))
   {
-    return false;
+    ALARM_LOGE("alarms.json exceeds its buffer");
+    success = false;
   }
-
-  if (serializeJson(doc, file) == 0)
+  else
   {
-    file.close();
-    return false;
+    serializeJson(fileDoc, flushBuffer, sizeof(flushBuffer));
+    success = success && writeFile("/alarms.json", flushBuffer, alarmsLen);
   }
-
-  file.close();
-  return true;
-}
-
-bool AlarmScheduler::saveAlarmsToSpiffs()
-{
-  if (!spiffsInitialized)
+  if (success)
   {
-    StaticJsonDocument<128> response;
-    response["status"] = "error";
-    response["message"] = "SPIFFS not initialized";
-    serializeJson(response, Serial);
-    Serial.println();
-    return false;
+    // Written second: a stale index is detected by its generation and ignored
+    size_t indexLen = sizeof(index) + index.count * sizeof(CompactAlarm);
+    memcpy(flushBuffer, &index, sizeof(index));
+    memcpy(flushBuffer + sizeof(index), compact, index.count * sizeof(CompactAlarm));
+    success = writeFile("/schedule.bin", flushBuffer, indexLen);
   }
 
-  DynamicJsonDocument doc(4096); // Large enough for 40 alarms
-  JsonArray alarms = doc.createNestedArray("alarms");
-  for (int i = 0; i < 4; i++)
+  // The combined file of older versions is obsolete once alarms.json no longer embeds zone_data
+  if (success && legacyZoneData)
   {
-    zones[i].listAlarms(alarms);
+    storage->remove("/zone_data.json");
+    legacyZoneData = false;
   }
 
-  File file = SPIFFS.open("/alarms.json", FILE_WRITE);
-  if (!file)
+  // Changes made while writing stay pending for the next pass
+  lockState();
+  if (success && mutationSeq == snapshotSeq)
   {
-    StaticJsonDocument<128> response;
-    response["status"] = "error";
-    response["message"] = "Failed to open alarms.json for writing";
-    serializeJson(response, Serial);
-    Serial.println();
-    return false;
-  }
+    for (int i = 0; i < 4; i++)
+    {
+      zones[i].clearZoneDataChanges();
+    }
+    dirtyZones = 0;
+    pendingByteCount = 0;
+  }
+  unlockState();
+
+  statistics.flushes++;
+  if (!success)
+    statistics.flushFailures++;
+  statistics.flushMs.record(millis() - start);
+  if (flushLock)
+    xSemaphoreGive(flushLock);
+  return spillHistory(true) && success;
+}
 
-  if (serializeJson(doc, file) == 0)
+// Called with the flush lock held
+bool AlarmScheduler::migrateSlotKeys()
+{
+  bool success = true;
+  for (int i = 0; i < 4; i++)
   {
-    file.close();
-    StaticJsonDocument<128> response;
-    response["status"] = "error";
-    response["message"] = "Failed to write to alarms.json";
-    serializeJson(response, Serial);
-    Serial.println();
-    return false;
+    for (int j = 0; j < 10; j++)
+    {
+      char oldKey[STORAGE_KEY_LEN];
+      char newKey[STORAGE_KEY_LEN];
+      slotDataKey(i + 1, j, oldKey, sizeof(oldKey));
+      lockState();
+      uint32_t id = zones[i].storedDataId(j);
+      unlockState();
+      if (id)
+      {
+        size_t len = storage->read(oldKey, (uint8_t *)flushBuffer, sizeof(flushBuffer));
+        zoneDataKey(id, newKey, sizeof(newKey));
+        if (len && !writeFile(newKey, flushBuffer, len))
+        {
+          success = false;
+          continue; // Keep the old key for the next attempt
+        }
+      }
+      storage->remove(oldKey); // Also drops payloads of alarms deleted since
+    }
   }
-
-  file.close();
-  return true;
+  if (success)
+    zoneResources.slotKeys = false;
+  return success;
 }
 
-bool AlarmScheduler::loadAlarmsFromSpiffs()
+bool AlarmScheduler::spillHistory(bool partial)
 {
-  if (!spiffsInitialized)
+  if (flushLock)
+    xSemaphoreTake(flushLock, portMAX_DELAY);
+  bool success = true;
+  for (;;)
   {
-    StaticJsonDocument<128> response;
-    response["status"] = "error";
-    response["message"] = "SPIFFS not initialized";
-    serializeJson(response, Serial);
-    Serial.println();
-    return false;
+    lockState();
+    size_t len = history.packBlock(partial);
+    unlockState();
+    if (len == 0)
+      break;
+    if (!history.writeBlock(len))
+    {
+      ALARM_LOGE("Failed to write history block");
+      success = false;
+      break;
+    }
+    statistics.bytesPersisted += len;
+    lockState();
+    bool full = history.commitBlock();
+    unlockState();
+    if (!full)
+      break;
   }
+  if (flushLock)
+    xSemaphoreGive(flushLock);
+  return success;
+}
 
-  File file = SPIFFS.open("/alarms.json", FILE_READ);
-  if (!file)
+bool AlarmScheduler::loadAlarmsFromSpiffs()
+{
+  if (!storageReady)
   {
-    StaticJsonDocument<128> response;
-    response["status"] = "error";
-    response["message"] = "No alarms.json file found";
-    serializeJson(response, Serial);
-    Serial.println();
+    ALARM_LOGE("Storage not initialized");
     return false;
   }
 
-  DynamicJsonDocument doc(4096); // Large enough for 40 alarms
-  DeserializationError error = deserializeJson(doc, file);
-  file.close();
-
-  if (error)
-  {
-    StaticJsonDocument<128> response;
-    response["status"] = "error";
-    response["message"] = "Invalid JSON in alarms.json";
-    serializeJson(response, Serial);
-    Serial.println();
-    return false;
-  }
+  PooledJsonDocument doc(ALARM_FILE_DOC_SIZE); // Counted by heapAllocations()
+  if (flushLock)
+    xSemaphoreTake(flushLock, portMAX_DELAY);
+  DeserializationError error = DeserializationError::EmptyInput;
+  if (ioJob.startRead(*storage, "/alarms.json", (uint8_t *)flushBuffer, sizeof(flushBuffer)) && runJob(ioJob))
+    error = deserializeJson(doc, (const char *)flushBuffer, ioJob.length()); // Copies, so the buffer is free again
+  else if (ioJob.status() == StorageJob::TOO_SMALL)
+    error = storage->readJson("/alarms.json", doc); // Older files embedding zone_data can exceed the buffer
+
+  bool success = false;
+  if (error == DeserializationError::EmptyInput)
+    ALARM_LOGW("No alarms.json file found");
+  else if (error)
+    ALARM_LOGE("Invalid JSON in alarms.json");
+  else
+    success = restoreAlarms(doc, true); // Still under the flush lock for the migration writes
+  if (flushLock)
+    xSemaphoreGive(flushLock);
+  return success;
+}
 
+// Called with the flush lock held when migrate is set
+bool AlarmScheduler::restoreAlarms(JsonDocument &doc, bool migrate)
+{
+  lockState();
+  scheduleGeneration = doc["generation"] | scheduleGeneration;
   // Clear existing alarms
   for (int i = 0; i < 4; i++)
   {
@@ -918,64 +1922,268 @@ bool AlarmScheduler::loadAlarmsFromSpiffs()
 
   JsonArray alarms = doc["alarms"].as<JsonArray>();
   bool success = true;
+  bool assignedIds = false;
+  zoneResources.slotKeys = strcmp(doc["zone_data_keys"] | "", "id") != 0;
   for (JsonObject alarm : alarms)
   {
-    DynamicJsonDocument alarmDoc(512);
+    JsonDocument &alarmDoc = payloadDoc; // Under the state lock
+    alarmDoc.clear();
     for (JsonPair pair : alarm)
     {
       alarmDoc[pair.key()] = pair.value();
     }
     alarmDoc["command"] = "add";
+    // Older files used the slot as alarm_id, and later carried the id as "uid"
+    bool current = alarm.containsKey("slot");
+    int slot = current ? alarm["slot"] | -1 : alarm["alarm_id"] | -1;
+    alarmDoc.remove("slot");
+    if (!current)
+    {
+      alarmDoc.remove("alarm_id");
+      if (alarm.containsKey("uid"))
+        alarmDoc["alarm_id"] = alarm["uid"];
+      alarmDoc.remove("uid");
+    }
     int zoneId = alarm["zone_id"].as<int>();
     if (zoneId < 1 || zoneId > 4)
     {
-      StaticJsonDocument<128> response;
-      response["status"] = "error";
-      response["message"] = "Invalid zone ID in alarms.json: " + String(zoneId);
-      serializeJson(response, Serial);
-      Serial.println();
+      ALARM_LOGE("Invalid zone ID in alarms.json: %d", zoneId);
       success = false;
       continue;
     }
-    if (!zones[zoneId - 1].addAlarm(alarmDoc))
+    if (!alarmDoc.containsKey("alarm_id"))
+      assignedIds = true; // Older files; save the ids given now so they stay stable
+    // Files from older versions embed zone_data. It is written to the alarm's
+    // own key right away, as the pending pool cannot hold a whole schedule;
+    // only if that fails, or writes are not allowed here, does it wait in
+    // the pool for the next flush.
+    uint32_t migratedId = 0;
+    if (alarm.containsKey("zone_data"))
+    {
+      legacyZoneData = true;
+      if (slot >= 0 && migrate)
+      {
+        if (!alarmDoc.containsKey("alarm_id"))
+          alarmDoc["alarm_id"] = ALARM_DEVICE_ID | zoneResources.nextId++;
+        migratedId = alarmDoc["alarm_id"];
+        if (migrateZoneData(migratedId, alarm["zone_data"]))
+          alarmDoc.remove("zone_data");
+        else
+          migratedId = 0;
+      }
+    }
+    if (!zones[zoneId - 1].addAlarm(alarmDoc, slot))
     {
       success = false;
+      if (migratedId)
+      {
+        char key[STORAGE_KEY_LEN];
+        zoneDataKey(migratedId, key, sizeof(key));
+        storage->remove(key);
+      }
     }
   }
+  restoreVersions(doc, false);
+  if (legacyZoneData || assignedIds || zoneResources.slotKeys)
+    markDirty(0x0F, 0);
+  unlockState();
 
   return success;
 }
 
-void AlarmScheduler::processJson(String &json)
+// Called with the flush lock and the state lock held; the latter guards payloadScratch
+bool AlarmScheduler::migrateZoneData(uint32_t id, JsonVariant zoneData)
+{
+  size_t len = measureJson(zoneData);
+  if (!zoneData.is<JsonObject>() || len > ALARM_PAYLOAD_MAX)
+    return false;
+  serializeJson(zoneData, (char *)payloadScratch, sizeof(payloadScratch));
+  char key[STORAGE_KEY_LEN];
+  zoneDataKey(id, key, sizeof(key));
+  if (!storage->write(key, payloadScratch, len))
+  {
+    ALARM_LOGW("Cannot migrate zone_data of alarm %lu yet", (unsigned long)id);
+    return false;
+  }
+  statistics.bytesPersisted += len;
+  return true;
+}
+
+// Called with the state lock held; keepChanges adds mutations made since boot
+void AlarmScheduler::restoreVersions(JsonDocument &doc, bool keepChanges)
+{
+  JsonArray versions = doc["versions"].as<JsonArray>();
+  for (int i = 0; i < 4; i++)
+  {
+    uint32_t saved = versions[i] | (uint32_t)0;
+    zones[i].setScheduleVersion(saved + (keepChanges ? zones[i].scheduleVersion() : 0));
+  }
+  uint32_t nextId = doc["next_id"] | (doc["next_uid"] | (uint32_t)0);
+  if (nextId > zoneResources.nextId)
+    zoneResources.nextId = nextId;
+}
+
+CommandStatus AlarmScheduler::processJson(String &json)
+{
+  return processJson(json.c_str(), json.length(), Serial);
+}
+
+CommandStatus AlarmScheduler::processJson(const char *json, size_t length)
+{
+  NullSink discard;
+  return processJson(json, length, discard);
+}
+
+CommandStatus AlarmScheduler::processJson(const char *json, size_t length, Print &out)
+{
+  if (requestLock)
+    xSemaphoreTake(requestLock, portMAX_DELAY);
+  CommandStatus status = handleRequest(json, length, out);
+  if (requestLock)
+    xSemaphoreGive(requestLock);
+  return status;
+}
+
+// Writes one reply line; its "status" decides the result
+CommandStatus AlarmScheduler::reply(JsonDocument &response, Print &out, bool pretty)
+{
+  if (pretty)
+    serializeJsonPretty(response, out);
+  else
+    serializeJson(response, out);
+  out.println();
+  return strcmp(response["status"] | "", "error") == 0 ? COMMAND_REJECTED : COMMAND_OK;
+}
+
+// Reads "from" and "to" (local "YYYY-MM-DD HH:MM") or "days" of a simulate
+// or analyze command; 'from' defaults to now and 'to' to defaultDays after it
+const char *AlarmScheduler::parseRange(JsonDocument &doc, long defaultDays, time_t *fromUtc, time_t *toUtc)
 {
-  StaticJsonDocument<768> doc;
-  DeserializationError error = deserializeJson(doc, json);
+  time_t local;
+  if (!doc.containsKey("from"))
+  {
+    if (timeStatus() != timeSet)
+      return "Time not set; give from";
+    *fromUtc = now();
+  }
+  else if (parseLocalTime(doc["from"] | "", &local))
+  {
+    *fromUtc = timeZone.toUtc(local);
+  }
+  else
+  {
+    return "Invalid from. Use YYYY-MM-DD HH:MM";
+  }
+  if (!doc.containsKey("to"))
+    *toUtc = *fromUtc + (doc["days"] | defaultDays) * SECS_PER_DAY;
+  else if (parseLocalTime(doc["to"] | "", &local))
+    *toUtc = timeZone.toUtc(local);
+  else
+    return "Invalid to. Use YYYY-MM-DD HH:MM";
+  if (*toUtc <= *fromUtc || *toUtc - *fromUtc > SIMULATE_DAYS_MAX * SECS_PER_DAY)
+    return "Range must be positive and at most 1830 days";
+  return nullptr;
+}
+
+// Events of the simulate command, collected a few at a time under the state
+// lock and written out after it is released. Each round resumes at the minute
+// of the last event written and skips the events already listed in it.
+struct SimulationReply
+{
+  SimulatedFire fires[SIMULATE_CHUNK];
+  char actions[SIMULATE_CHUNK][ALARM_ACTION_LEN];
+  size_t count;       // Collected this round
+  size_t listed;      // Written in earlier rounds
+  size_t limit;
+  bool more;          // Stopped at the limit
+  SimulatedFire last; // Last event written
+};
+
+// One apply_delta upsert as an add or update request; false if it does not fit
+static bool copyUpsert(JsonObject alarm, JsonDocument &doc)
+{
+  doc.clear();
+  for (JsonPair pair : alarm)
+    doc[pair.key()] = pair.value();
+  return !doc.overflowed();
+}
+
+static bool collectSimulatedFire(const SimulatedFire &fire, void *context)
+{
+  SimulationReply *reply = static_cast<SimulationReply *>(context);
+  if (reply->listed && fire.utc == reply->last.utc &&
+      (fire.zone < reply->last.zone || (fire.zone == reply->last.zone && fire.slot <= reply->last.slot)))
+    return true; // Written in an earlier round
+  if (reply->listed + reply->count == reply->limit)
+  {
+    reply->more = true;
+    return false;
+  }
+  if (reply->count == SIMULATE_CHUNK)
+    return false; // Next round
+  reply->fires[reply->count] = fire;
+  strncpy(reply->actions[reply->count], fire.action, ALARM_ACTION_LEN - 1);
+  reply->actions[reply->count][ALARM_ACTION_LEN - 1] = '\0';
+  reply->fires[reply->count].action = reply->actions[reply->count];
+  reply->count++;
+  return true;
+}
+
+static void writeSimulatedFire(const SimulatedFire &fire, bool first, Print &out)
+{
+  tmElements_t tm;
+  breakTime(fire.local, tm);
+  char timeStr[17];
+  snprintf(timeStr, sizeof(timeStr), "%04d-%02d-%02d %02d:%02d", tmYearToCalendar(tm.Year), tm.Month, tm.Day, tm.Hour, tm.Minute);
+  StaticJsonDocument<256> event;
+  event["time"] = (const char *)timeStr;
+  event["utc"] = (uint32_t)fire.utc;
+  event["zone_id"] = fire.zone;
+  event["alarm_id"] = fire.alarmId;
+  event["type"] = fire.dateBased ? "date" : "day";
+  event["action"] = fire.action;
+  if (!first)
+    out.print(',');
+  serializeJson(event, out);
+}
+
+CommandStatus AlarmScheduler::handleRequest(const char *json, size_t length, Print &out)
+{
+  JsonDocument &doc = requestDoc;
+  DeserializationError error = deserializeJson(doc, json, length);
+  statistics.commands++;
+  statistics.notePeak(0, doc.memoryUsage());
   if (error)
   {
+    // Valid JSON that outgrows the document is refused as such, so a
+    // controller knows to split an apply_delta or shorten zone_data
+    bool tooLarge = error == DeserializationError::NoMemory;
+    statistics.parseFailures++;
     StaticJsonDocument<128> response;
     response["status"] = "error";
-    response["message"] = "Invalid JSON";
-    serializeJson(response, Serial);
-    Serial.println();
-    return;
+    response["message"] = tooLarge ? "Request too large, split it into smaller ones" : "Invalid JSON";
+    reply(response, out);
+    return tooLarge ? COMMAND_REJECTED : COMMAND_INVALID_JSON;
   }
 
-  String command = doc["command"].as<String>();
-  bool saveToSpiffs = false;
+  const char *command = doc["command"] | "";
+  bool scheduleChanged = false; // Time or alarm set changed, re-plan the next wake-up
+  CommandStatus status = COMMAND_OK;
 
-  if (command == "set")
+  if (strcmp(command, "set") == 0)
   {
-    String timeStr = doc["time"].as<String>();
-    int year, month, date, hour, minute, second = 0;
-    int fields = sscanf(timeStr.c_str(), "%d-%d-%d %d:%d:%d", &year, &month, &date, &hour, &minute, &second);
-    if (fields >= 5 && isValidDate(year, month, date) &&
-        hour >= 0 && hour <= 23 && minute >= 0 && minute <= 59 && second >= 0 && second <= 59)
+    time_t local;
+    if (parseLocalTime(doc["time"] | "", &local))
     {
       if (rtc)
       {
-        RtcDateTime rtcTime(year, month, date, hour, minute, second);
-        rtc->SetDateTime(rtcTime);
-        setTime(rtcTime.TotalSeconds() + 946684800L);
+        // The given time is local wall-clock time; the RTC stores UTC
+        time_t utc = timeZone.toUtc(local);
+        rtc->SetDateTime(RtcDateTime(utc - 946684800L));
+        setTime(utc);
+        scheduleChanged = true;
+        if (stateReplay)
+          replayZones = 0x0F;
       }
       doc.clear();
       doc["status"] = "success";
@@ -986,12 +2194,12 @@ void AlarmScheduler::processJson(String &json)
       doc["status"] = "error";
       doc["message"] = "Invalid time format. Use YYYY-MM-DD HH:MM[:SS]";
     }
-    serializeJson(doc, Serial);
-    Serial.println();
+    status = reply(doc, out);
   }
-  else if (command == "ntp")
+  else if (strcmp(command, "ntp") == 0)
   {
     bool success = syncWithNTP();
+    scheduleChanged = success;
     doc.clear();
     doc["command"] = "ntp";
     doc["status"] = success ? "success" : "error";
@@ -1008,13 +2216,12 @@ void AlarmScheduler::processJson(String &json)
     }
     else
     {
-      doc["message"] = "RTC synced with NTP (IST)";
+      doc["message"] = "RTC synced with NTP";
       doc["time"] = printTime();
     }
-    serializeJson(doc, Serial);
-    Serial.println();
+    status = reply(doc, out);
   }
-  else if (command == "add")
+  else if (strcmp(command, "add") == 0)
   {
     int zoneId = doc["zone_id"].as<int>();
     if (zoneId < 1 || zoneId > 4)
@@ -1022,116 +2229,728 @@ void AlarmScheduler::processJson(String &json)
       doc.clear();
       doc["status"] = "error";
       doc["message"] = "Invalid zone ID. Use 1–4";
-      serializeJson(doc, Serial);
-      Serial.println();
-      return;
+      return reply(doc, out);
     }
+    size_t bytes = measureJson(doc);
+    lockState();
     bool success = zones[zoneId - 1].addAlarm(doc);
+    if (success)
+      markDirty(1 << (zoneId - 1), bytes);
+    unlockState();
     if (!success && !doc.containsKey("status"))
     {
       doc.clear();
       doc["status"] = "error";
       doc["message"] = "Failed to add alarm";
     }
-    serializeJson(doc, Serial);
-    Serial.println();
-    if (success)
-      saveToSpiffs = true;
+    if (success && timeStatus() == timeSet)
+    {
+      // Problems in the alarm's zone over the next days; analyze covers longer ranges
+      ScheduleAnalysis analysis;
+      uint8_t zoneMask = 1 << (zoneId - 1);
+      lockState();
+      time_t t = now();
+      analyze(analysis, t, t + ANALYSIS_WARNING_DAYS * SECS_PER_DAY, zoneMask);
+      if (analysis.issues(zoneMask))
+        analysis.issuesToJson(doc.createNestedArray("warnings"), zoneMask, ANALYSIS_WARNINGS_MAX);
+      unlockState();
+    }
+    status = reply(doc, out);
+    scheduleChanged = success;
   }
-  else if (command == "delete")
+  else if (strcmp(command, "delete") == 0)
   {
-    int zoneId = doc["zone_id"].as<int>();
-    int id = doc["alarm_id"].as<int>();
-    if (zoneId < 1 || zoneId > 4)
+    int zoneId = doc["zone_id"] | 0; // Optional, checked against the alarm's zone
+    uint32_t id = doc["alarm_id"] | (uint32_t)0;
+    if (zoneId < 0 || zoneId > 4)
     {
       doc.clear();
       doc["status"] = "error";
       doc["message"] = "Invalid zone ID";
-      serializeJson(doc, Serial);
-      Serial.println();
-      return;
+      return reply(doc, out);
     }
-    bool success = zones[zoneId - 1].deleteAlarm(id);
+    size_t bytes = measureJson(doc);
+    uint8_t zone, slot;
+    lockState();
+    bool success = alarmIds.find(id, &zone, &slot) && (zoneId == 0 || zoneId == zone) && zones[zone - 1].deleteAlarm(slot);
+    if (success)
+      markDirty(1 << (zone - 1), bytes);
+    unlockState();
     doc.clear();
     doc["status"] = success ? "success" : "error";
     if (!success)
       doc["message"] = "Invalid ID";
-    serializeJson(doc, Serial);
-    Serial.println();
+    status = reply(doc, out);
+    scheduleChanged = success;
+  }
+  else if (strcmp(command, "update") == 0)
+  {
+    // {"alarm_id":..,<any add fields>}; the alarm keeps its id and slot, and
+    // only alarms.json is rewritten unless zone_data is given
+    uint32_t id = doc["alarm_id"] | (uint32_t)0;
+    int zoneId = doc["zone_id"] | 0;
+    loadAlarmDetails();
+    size_t bytes = measureJson(doc);
+    uint8_t zone, slot;
+    lockState();
+    bool found = alarmIds.find(id, &zone, &slot);
+    bool moved = found && zoneId && zoneId != zone;
+    bool success = found && !moved && zones[zone - 1].updateAlarm(slot, doc);
     if (success)
-      saveToSpiffs = true;
+      markDirty(1 << (zone - 1), bytes);
+    unlockState();
+    if (!found || moved)
+    {
+      doc.clear();
+      doc["status"] = "error";
+      doc["message"] = found ? "Alarms cannot move between zones" : "Invalid ID";
+    }
+    status = reply(doc, out);
+    scheduleChanged = success;
   }
-  else if (command == "list")
+  else if (strcmp(command, "list") == 0)
   {
-    doc.clear();
-    doc["command"] = "list";
-    JsonArray alarms = doc.createNestedArray("alarms");
+    loadAlarmDetails();
+    responseDoc.clear();
+    responseDoc["command"] = "list";
+    JsonArray alarms = responseDoc.createNestedArray("alarms");
+    lockState();
     for (int i = 0; i < 4; i++)
     {
       zones[i].listAlarms(alarms);
     }
-    serializeJsonPretty(doc, Serial);
-    Serial.println();
+    unlockState();
+    statistics.notePeak(1, responseDoc.memoryUsage());
+    status = reply(responseDoc, out, true);
+  }
+  else if (strcmp(command, "stats") == 0)
+  {
+    bool reset = doc["reset"] | false;
+    JsonObject root = responseDoc.to<JsonObject>();
+    root["command"] = "stats";
+    statistics.toJson(root);
+    JsonObject heap = root.createNestedObject("heap");
+    heap["free"] = ESP.getFreeHeap();
+    heap["min_free"] = ESP.getMinFreeHeap();
+    heap["json_allocations"] = heapAllocations();
+    heap["pending_pool"] = pendingPool.used();
+    JsonArray pools = heap.createNestedArray("json_pools"); // request, response, payload, file
+    const JsonDocument *docs[4] = {&requestDoc, &responseDoc, &payloadDoc, &fileDoc};
+    for (int i = 0; i < 4; i++)
+    {
+      JsonObject pool = pools.createNestedObject();
+      pool["capacity"] = docs[i]->capacity();
+      pool["peak"] = statistics.jsonPeak[i];
+    }
+    root["log_dropped"] = alarmLog.dropped();
+    root["subscribers"] = subscribers.size();
+    status = reply(responseDoc, out);
+    if (reset)
+      resetStats();
+  }
+  else if (strcmp(command, "diff") == 0)
+  {
+    // {"zones":[{"zone_id":1,"hash":...}]}, all zones if omitted; a matching
+    // hash is confirmed alone, otherwise the zone's alarm_id/rev manifest follows
+    bool listed[4] = {false, false, false, false};
+    bool known[4] = {false, false, false, false};
+    uint32_t hashes[4] = {0, 0, 0, 0};
+    bool all = !doc.containsKey("zones");
+    for (JsonObject zone : doc["zones"].as<JsonArray>())
+    {
+      int zoneId = zone["zone_id"] | 0;
+      if (zoneId < 1 || zoneId > 4)
+        continue;
+      listed[zoneId - 1] = true;
+      known[zoneId - 1] = zone.containsKey("hash");
+      hashes[zoneId - 1] = zone["hash"] | (uint32_t)0;
+    }
+    loadAlarmDetails();
+    JsonObject root = responseDoc.to<JsonObject>();
+    root["command"] = "diff";
+    JsonArray result = root.createNestedArray("zones");
+    lockState();
+    for (int i = 0; i < 4; i++)
+    {
+      if (!all && !listed[i])
+        continue;
+      uint32_t hash = zones[i].scheduleHash();
+      bool match = known[i] && hashes[i] == hash;
+      JsonObject zone = result.createNestedObject();
+      zone["zone_id"] = i + 1;
+      zone["version"] = zones[i].scheduleVersion();
+      zone["hash"] = hash;
+      zone["match"] = match;
+      if (!match)
+      {
+        JsonArray revisions = zone.createNestedArray("alarms");
+        zones[i].listRevisions(revisions);
+      }
+    }
+    unlockState();
+    statistics.notePeak(1, responseDoc.memoryUsage());
+    status = reply(responseDoc, out);
+  }
+  else if (strcmp(command, "apply_delta") == 0)
+  {
+    // {"zone_id":1,"base_version":7,"delete":[id,...],"upsert":[{"alarm_id":..,"rev":..,<add fields>}]}
+    int zoneId = doc["zone_id"] | 0;
+    if (zoneId < 1 || zoneId > 4)
+    {
+      doc.clear();
+      doc["status"] = "error";
+      doc["message"] = "Invalid zone ID";
+      return reply(doc, out);
+    }
+    loadAlarmDetails();
+    size_t bytes = measureJson(doc);
+    ZoneAlarms &zone = zones[zoneId - 1];
+    JsonArray deletes = doc["delete"].as<JsonArray>();
+    JsonArray upserts = doc["upsert"].as<JsonArray>();
+    char message[48] = "";
+    size_t applied = 0;
+
+    lockState();
+    if (doc.containsKey("base_version") && (doc["base_version"] | (uint32_t)0) != zone.scheduleVersion())
+    {
+      strcpy(message, "Version conflict");
+    }
+    else
+    {
+      // Refuse up front what cannot fit or parse, rather than stopping
+      // halfway with part of the delta applied
+      int count = zone.size();
+      for (JsonVariant id : deletes)
+      {
+        if (zone.findId(id | (uint32_t)0) >= 0)
+          count--;
+      }
+      for (JsonObject alarm : upserts)
+      {
+        uint32_t id = alarm["alarm_id"] | (uint32_t)0;
+        bool deleted = false;
+        for (JsonVariant d : deletes)
+          deleted = deleted || (d | (uint32_t)0) == id;
+        int owned = zone.findId(id);
+        int slot = deleted ? -1 : owned; // A deleted id comes back as a new alarm
+        uint8_t otherZone, otherSlot;
+        JsonDocument &alarmDoc = responseDoc; // Unused until the reply; at least as large as the request
+        if (id == 0)
+          strcpy(message, "Every upsert needs an alarm_id");
+        else if (owned < 0 && alarmIds.find(id, &otherZone, &otherSlot))
+          snprintf(message, sizeof(message), "alarm_id %lu belongs to zone %u", (unsigned long)id, otherZone);
+        else if (!copyUpsert(alarm, alarmDoc))
+          strcpy(message, "Upsert too large");
+        else if (!zone.checkAlarm(alarmDoc, slot))
+          snprintf(message, sizeof(message), "%s", alarmDoc["message"] | "Invalid alarm");
+        if (message[0])
+          break;
+        if (slot < 0)
+          count++;
+      }
+      if (!message[0] && count > 10)
+        strcpy(message, "Zone full");
+    }
+    if (!message[0])
+    {
+      for (JsonVariant id : deletes)
+      {
+        int slot = zone.findId(id | (uint32_t)0);
+        if (slot >= 0 && zone.deleteAlarm(slot))
+          applied++;
+      }
+      for (JsonObject alarm : upserts)
+      {
+        // An existing id is updated in place to the new revision
+        // Checked above; only capacity (file size, pending pool) can still refuse it
+        int slot = zone.findId(alarm["alarm_id"] | (uint32_t)0);
+        JsonDocument &alarmDoc = responseDoc;
+        copyUpsert(alarm, alarmDoc);
+        if (slot >= 0 ? !zone.updateAlarm(slot, alarmDoc) : !zone.addAlarm(alarmDoc))
+        {
+          snprintf(message, sizeof(message), "%s", alarmDoc["message"] | "Failed to add alarm");
+          break;
+        }
+        applied++;
+      }
+      if (applied)
+        markDirty(1 << (zoneId - 1), bytes);
+    }
+    uint32_t version = zone.scheduleVersion();
+    uint32_t hash = zone.scheduleHash();
+    unlockState();
+
+    // On failure the controller re-diffs against the returned version and hash
+    doc.clear();
+    doc["command"] = "apply_delta";
+    doc["status"] = message[0] ? "error" : "success";
+    if (message[0])
+      doc["message"] = (const char *)message; // Serialized before it goes out of scope
+    doc["zone_id"] = zoneId;
+    doc["version"] = version;
+    doc["hash"] = hash;
+    doc["applied"] = applied;
+    status = reply(doc, out);
+    scheduleChanged = applied > 0;
+  }
+  else if (strcmp(command, "history") == 0)
+  {
+    uint32_t from = doc["from"] | (uint32_t)0; // UTC
+    uint32_t to = doc["to"] | (uint32_t)0xFFFFFFFF;
+    uint8_t zone = doc["zone"] | 0;
+    size_t limit = doc["limit"] | HISTORY_QUERY_MAX;
+    if (limit == 0 || limit > HISTORY_QUERY_MAX)
+      limit = HISTORY_QUERY_MAX;
+    HistoryEvent events[HISTORY_QUERY_MAX];
+    bool more;
+    lockState();
+    size_t n = history.query(from, to, zone, events, limit, &more);
+    uint32_t total = history.total();
+    unlockState();
+
+    JsonObject root = responseDoc.to<JsonObject>();
+    root["command"] = "history";
+    root["total"] = total;
+    JsonArray arr = root.createNestedArray("events");
+    for (size_t i = 0; i < n; i++)
+    {
+      JsonObject event = arr.createNestedObject();
+      event["seq"] = events[i].seq;
+      event["time"] = events[i].time;
+      event["local"] = (uint32_t)timeZone.toLocal(events[i].time);
+      event["zone"] = events[i].zone;
+      event["alarm_id"] = events[i].alarmId;
+      event["action"] = (const char *)events[i].action; // Stays valid until serialized
+      event["late_s"] = events[i].lateness;
+      event["callback_us"] = events[i].callbackUs;
+    }
+    root["more"] = more; // Narrow the range or raise 'from' past the last event
+    statistics.notePeak(1, responseDoc.memoryUsage());
+    status = reply(responseDoc, out);
+  }
+  else if (strcmp(command, "simulate") == 0)
+  {
+    // {"from":"YYYY-MM-DD HH:MM","to":"...","days":n,"zone_id":n,"limit":n}
+    time_t fromUtc, toUtc;
+    const char *message = parseRange(doc, 7, &fromUtc, &toUtc);
+    int zoneId = doc["zone_id"] | 0;
+    size_t limit = doc["limit"] | SIMULATE_LIMIT;
+    if (limit > SIMULATE_LIMIT_MAX)
+      limit = SIMULATE_LIMIT_MAX;
+    if (!message && (zoneId < 0 || zoneId > 4))
+      message = "Invalid zone ID";
+    if (message)
+    {
+      doc.clear();
+      doc["status"] = "error";
+      doc["message"] = message;
+      return reply(doc, out);
+    }
+    out.print("{\"command\":\"simulate\",\"status\":\"success\",\"events\":[");
+    SimulationReply events;
+    events.listed = 0;
+    events.limit = limit;
+    events.more = false;
+    do
+    {
+      events.count = 0;
+      simulate(events.listed ? events.last.utc : fromUtc, toUtc, collectSimulatedFire, &events, zoneId ? 1 << (zoneId - 1) : 0x0F);
+      for (size_t i = 0; i < events.count; i++)
+        writeSimulatedFire(events.fires[i], events.listed + i == 0, out);
+      if (events.count)
+        events.last = events.fires[events.count - 1];
+      events.listed += events.count;
+    } while (events.count == SIMULATE_CHUNK && !events.more);
+    out.printf("],\"listed\":%u,\"more\":%s}", (unsigned)events.listed, events.more ? "true" : "false");
+    out.println();
+  }
+  else if (strcmp(command, "analyze") == 0)
+  {
+    // {"from":..,"to":..,"days":n,"zone_id":n} like simulate, a year by default
+    time_t fromUtc, toUtc;
+    const char *message = parseRange(doc, ANALYSIS_DAYS, &fromUtc, &toUtc);
+    int zoneId = doc["zone_id"] | 0;
+    if (!message && (zoneId < 0 || zoneId > 4))
+      message = "Invalid zone ID";
+    if (message)
+    {
+      doc.clear();
+      doc["status"] = "error";
+      doc["message"] = message;
+      return reply(doc, out);
+    }
+    uint8_t zoneMask = zoneId ? 1 << (zoneId - 1) : 0x0F;
+    ScheduleAnalysis analysis;
+    JsonObject root = responseDoc.to<JsonObject>();
+    root["command"] = "analyze";
+    root["status"] = "success";
+    root["from"] = (uint32_t)fromUtc;
+    root["to"] = (uint32_t)toUtc;
+    loadAlarmDetails(); // Not under the state lock
+    lockState();        // The findings point at the alarms' actions until copied into the reply
+    analyze(analysis, fromUtc, toUtc, zoneMask);
+    analysis.zonesToJson(root.createNestedArray("zones"), zoneMask);
+    size_t listed = analysis.issuesToJson(root.createNestedArray("issues"), zoneMask, ANALYSIS_ISSUES_MAX);
+    root["more"] = analysis.issues(zoneMask) > listed;
+    unlockState();
+    statistics.notePeak(1, responseDoc.memoryUsage());
+    status = reply(responseDoc, out);
+  }
+  else if (strcmp(command, "state") == 0)
+  {
+    // {"zone_id":n,"replay":bool}: the alarm each zone should be showing now
+    int zoneId = doc["zone_id"] | 0;
+    bool replay = doc["replay"] | false;
+    if (zoneId < 0 || zoneId > 4)
+    {
+      doc.clear();
+      doc["status"] = "error";
+      doc["message"] = "Invalid zone ID";
+      return reply(doc, out);
+    }
+    if (timeStatus() != timeSet)
+    {
+      doc.clear();
+      doc["status"] = "error";
+      doc["message"] = "Time not set";
+      return reply(doc, out);
+    }
+    loadAlarmDetails();
+    JsonObject root = responseDoc.to<JsonObject>();
+    root["command"] = "state";
+    root["status"] = "success";
+    JsonArray result = root.createNestedArray("zones");
+    lockState();
+    time_t t = now();
+    for (int i = 0; i < 4; i++)
+    {
+      if (zoneId && zoneId != i + 1)
+        continue;
+      JsonObject zone = result.createNestedObject();
+      zone["zone_id"] = i + 1;
+      SimulatedFire fire;
+      if (!lastFire(i, t, fire))
+        continue; // No alarm has fired yet; the state is unknown
+      tmElements_t tm;
+      breakTime(fire.local, tm);
+      char timeStr[17];
+      snprintf(timeStr, sizeof(timeStr), "%04d-%02d-%02d %02d:%02d", tmYearToCalendar(tm.Year), tm.Month, tm.Day, tm.Hour, tm.Minute);
+      zone["alarm_id"] = fire.alarmId;
+      zone["action"] = (char *)fire.action; // Copied; the reply is written after the lock is released
+      zone["since"] = timeStr;
+      zone["since_utc"] = (uint32_t)fire.utc;
+    }
+    unlockState();
+    status = reply(responseDoc, out);
+    if (replay)
+      replayState(zoneId ? 1 << (zoneId - 1) : 0x0F);
   }
-  else if (command == "time")
+  else if (strcmp(command, "tz") == 0)
+  {
+    const char *tz = doc["tz"] | "";
+    bool success = doc.containsKey("tz") ? setTimeZone(tz) : true;
+    doc.clear();
+    doc["command"] = "tz";
+    doc["status"] = success ? "success" : "error";
+    if (!success)
+      doc["message"] = "Invalid POSIX TZ string";
+    doc["tz"] = timeZone.posix();
+    doc["time"] = printTime();
+    status = reply(doc, out);
+  }
+  else if (strcmp(command, "time") == 0)
   {
     doc.clear();
     doc["command"] = "time";
     doc["time"] = printTime();
-    serializeJsonPretty(doc, Serial);
-    Serial.println();
+    doc["tz"] = timeZone.posix();
+    status = reply(doc, out, true);
   }
   else
   {
+    statistics.unknownCommands++;
     StaticJsonDocument<128> response;
     response["status"] = "error";
     response["message"] = "Unknown command";
-    serializeJson(response, Serial);
-    Serial.println();
+    reply(response, out);
+    status = COMMAND_UNKNOWN;
   }
 
-  if (saveToSpiffs)
-  {
-    if (!saveAlarmsToSpiffs())
-    {
-      Serial.println("Failed to save alarms to SPIFFS after command");
-    }
-    else
-    {
-      Serial.println("Alarms saved to SPIFFS successfully");
-    }
-  }
+  if (scheduleChanged)
+    notifyWaiter();
+  return status;
 }
 
-void AlarmScheduler::checkAlarms()
+unsigned long AlarmScheduler::checkAlarms()
 {
+  unsigned long start = micros();
   // Sync time every 24 hours
   if (millis() - lastSyncMillis >= 86400000UL)
   {
     time_t rtcTime = getRtcTime();
     if (rtcTime > 0)
+    {
+      statistics.rtcSyncs++;
+      statistics.lastRtcSync = rtcTime;
+      statistics.lastRtcDrift = (int32_t)(rtcTime - now());
       setTime(rtcTime);
+    }
     lastSyncMillis = millis();
   }
-  bool stateChanged = false;
+  lockState();
+  time_t utcNow = now();
+  time_t utcMinute = utcNow - utcNow % 60;
+  time_t localNow = timeZone.toLocal(utcNow);
+  // A repeated local minute (DST fall-back) is only evaluated on its first pass
+  if (timeZone.toUtc(localNow - localNow % 60) == utcMinute)
+  {
+    // Drop the bits of removed day-based alarms
+    if (weekIndex.stale())
+    {
+      weekIndex.clear();
+      for (int i = 0; i < 4; i++)
+        zones[i].indexWeek();
+    }
+    // Replayed state is that before this minute, whose own alarms fire below
+    for (int i = 0; i < 4 && replayZones && timeStatus() == timeSet; i++)
+    {
+      SimulatedFire fire;
+      if (!(replayZones & (1 << i)) || !zones[i].hasZone())
+        continue; // A zone without a handler yet is replayed once it has one
+      replayZones &= ~(1 << i);
+      if (lastFire(i, utcMinute - 1, fire))
+      {
+        ALARM_LOGI("Zone %u replaying alarm %lu", i + 1, (unsigned long)fire.alarmId);
+        zones[i].dispatch(fire.slot, utcNow, localNow);
+      }
+    }
+    // Local minutes jumped over by a DST change are matched on the minute after it
+    long previousOffset = timeZone.offsetAt(utcMinute - 60);
+    time_t skippedFrom = 0;
+    if (timeZone.offsetAt(utcMinute) > previousOffset)
+      skippedFrom = utcMinute + previousOffset;
+    CalendarTick tick;
+    makeTick(tick, utcNow, localNow, skippedFrom);
+    for (int i = 0; i < 4; i++)
+    {
+      // Consumed one-time alarms are persisted by the background flusher
+      if (zones[i].checkAlarms(tick))
+        markDirty(1 << i, 0);
+    }
+    if (persistTask && history.spillDue())
+      xTaskNotifyGive(persistTask);
+  }
+
+  // Time until the next possible trigger, bounded by the next RTC resync
+  unsigned long waitMs = 86400000UL - (millis() - lastSyncMillis);
+  if (timeStatus() == timeSet)
+  {
+    time_t t = now();
+    // The search runs again only for a new minute, which includes a stepped
+    // clock, or after a change; loop() callers mostly reuse it
+    time_t from = (t / 60 + 1) * 60; // The current minute has just been evaluated
+    if (from != plannedFrom || planSeq != plannedSeq)
+    {
+      plannedSeq = planSeq;
+      plannedFrom = from;
+      nextTrigger = nextTriggerUtc(from);
+    }
+    time_t next = nextTrigger;
+    if (next && (unsigned long)(next - t) < waitMs / 1000UL)
+      waitMs = (unsigned long)(next - t) * 1000UL;
+  }
+  unlockState();
+  statistics.checkUs.record(micros() - start);
+  return waitMs;
+}
+
+time_t AlarmScheduler::nextTriggerUtc(time_t fromUtc)
+{
+  time_t next = 0;
   for (int i = 0; i < 4; i++)
   {
-    if (zones[i].checkAlarms())
+    if (!zones[i].hasZone())
+      continue;
+    time_t utc = zoneTriggerUtc(i, -1, fromUtc);
+    if (utc && (!next || utc < next))
+      next = utc;
+  }
+  return next;
+}
+
+time_t AlarmScheduler::zoneTriggerUtc(uint8_t zone, int slot, time_t fromUtc)
+{
+  // Zones work in local time; a candidate in the second pass of a repeated
+  // hour maps back before 'fromUtc' and is skipped, like checkAlarms() does.
+  // One in a DST gap maps to the end of the gap, where checkAlarms() fires it.
+  if (slot < 0)
+  {
+    // Any number of slots may be skipped that way, so each is followed alone
+    time_t next = 0;
+    for (int s = 0; s < 10; s++)
     {
-      stateChanged = true;
+      time_t utc = zoneTriggerUtc(zone, s, fromUtc);
+      if (utc && (!next || utc < next))
+        next = utc;
     }
+    return next;
+  }
+  time_t localFrom = timeZone.toLocal(fromUtc);
+  for (int attempt = 0; attempt < 3; attempt++)
+  {
+    time_t local = zones[zone].nextOccurrence(slot, localFrom);
+    if (!local)
+      return 0;
+    time_t utc = timeZone.toUtc(local);
+    if (utc >= fromUtc)
+      return utc;
+    localFrom = local + 60;
+  }
+  return 0;
+}
+
+size_t AlarmScheduler::simulate(time_t fromUtc, time_t toUtc, SimulationFunction fn, void *context, uint8_t zoneMask,
+                                bool withSuppressed)
+{
+  loadAlarmDetails(); // Actions are reported
+  size_t count = 0;
+  time_t next[4][10]; // Next UTC trigger per slot, 0 = never
+  fromUtc += (60 - fromUtc % 60) % 60;
+  lockState();
+  for (int z = 0; z < 4; z++)
+  {
+    for (int s = 0; s < 10; s++)
+      next[z][s] = zoneMask & (1 << z) ? zoneTriggerUtc(z, s, fromUtc) : 0;
   }
-  if (stateChanged)
+
+  bool running = true;
+  while (running)
   {
-    if (!saveAlarmsToSpiffs())
+    time_t at = 0;
+    for (int z = 0; z < 4; z++)
     {
-      Serial.println("Failed to save alarms to SPIFFS after state change");
+      for (int s = 0; s < 10; s++)
+      {
+        if (next[z][s] && next[z][s] < toUtc && (!at || next[z][s] < at))
+          at = next[z][s];
+      }
     }
-    else
+    if (!at)
+      break;
+
+    // Zones in order, then slots, as checkAlarms() dispatches them
+    SimulatedFire fire;
+    fire.utc = at;
+    fire.local = timeZone.toLocal(at);
+    for (int z = 0; z < 4; z++)
+    {
+      bool dateDue = false; // Date-based alarms suppress day-based ones in the same minute
+      for (int s = 0; s < 10; s++)
+      {
+        if (next[z][s] != at)
+          continue;
+        zones[z].describe(s, fire);
+        dateDue = dateDue || fire.dateBased;
+      }
+      for (int s = 0; s < 10; s++)
+      {
+        if (next[z][s] != at)
+          continue;
+        zones[z].describe(s, fire);
+        fire.suppressed = dateDue && !fire.dateBased;
+        if (running && (!fire.suppressed || withSuppressed))
+        {
+          count += !fire.suppressed;
+          running = fn(fire, context);
+        }
+        next[z][s] = zoneTriggerUtc(z, s, at + 60); // A one-time alarm has no next
+      }
+    }
+  }
+  unlockState();
+  return count;
+}
+
+bool AlarmScheduler::lastFire(uint8_t zone, time_t atUtc, SimulatedFire &fire)
+{
+  // Of fires in the same minute a date-based one suppresses day-based ones,
+  // and among the rest the last dispatched (highest slot) stays in effect
+  time_t localAt = timeZone.toLocal(atUtc);
+  time_t best = 0;
+  int bestSlot = -1;
+  bool bestDate = false;
+  for (int s = 0; s < 10; s++)
+  {
+    time_t local = zones[zone].previousOccurrence(s, localAt);
+    if (!local)
+      continue;
+    time_t utc = timeZone.toUtc(local);
+    if (utc > atUtc)
+      continue;
+    zones[zone].describe(s, fire);
+    if (utc > best || (utc == best && (fire.dateBased || !bestDate)))
+    {
+      best = utc;
+      bestSlot = s;
+      bestDate = fire.dateBased;
+    }
+  }
+  if (bestSlot < 0)
+    return false;
+  zones[zone].describe(bestSlot, fire);
+  fire.utc = best;
+  fire.local = timeZone.toLocal(best);
+  fire.suppressed = false;
+  return true;
+}
+
+bool AlarmScheduler::desiredState(uint8_t zone, SimulatedFire &fire, time_t atUtc)
+{
+  if (zone < 1 || zone > 4)
+    return false;
+  loadAlarmDetails(); // The action is reported
+  lockState();
+  bool found = lastFire(zone - 1, atUtc ? atUtc : now(), fire);
+  unlockState();
+  return found;
+}
+
+void AlarmScheduler::replayState(uint8_t zoneMask)
+{
+  replayZones |= zoneMask;
+  notifyWaiter();
+}
+
+void AlarmScheduler::analyze(ScheduleAnalysis &analysis, time_t fromUtc, time_t toUtc, uint8_t zoneMask)
+{
+  loadAlarmDetails();
+  lockState();
+  analysis.begin(fromUtc, toUtc);
+  SimulatedFire alarm;
+  for (int z = 0; z < 4; z++)
+  {
+    for (int s = 0; s < 10 && (zoneMask & (1 << z)); s++)
     {
-      Serial.println("Alarms saved to SPIFFS successfully after state change");
+      if (zones[z].describe(s, alarm))
+        analysis.track(alarm);
     }
   }
+  simulate(fromUtc, toUtc, ScheduleAnalysis::onFire, &analysis, zoneMask, true);
+  analysis.finish();
+  unlockState();
+}
+
+unsigned long AlarmScheduler::waitAndDispatch(unsigned long timeoutMs)
+{
+  // Publish the waiter before evaluating so a concurrent mutation is never missed
+  waitingTask = xTaskGetCurrentTaskHandle();
+  unsigned long waitMs = checkAlarms();
+  if (waitMs > timeoutMs)
+    waitMs = timeoutMs;
+  if (waitMs > 0)
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(waitMs));
+  waitingTask = nullptr;
+  return checkAlarms();
 }
 
 String AlarmScheduler::printTime()
@@ -1146,9 +2965,10 @@ String AlarmScheduler::printTime()
     {
       return "Invalid RTC year: " + String(now.Year()) + ". RTC may need reset.";
     }
+    time_t local = timeZone.toLocal(now.TotalSeconds() + 946684800L);
     char dateTimeString[20];
-    snprintf(dateTimeString, sizeof(dateTimeString), "%04u/%02u/%02u %02u:%02u:%02u",
-             now.Year(), now.Month(), now.Day(), now.Hour(), now.Minute(), now.Second());
+    snprintf(dateTimeString, sizeof(dateTimeString), "%04d/%02d/%02d %02d:%02d:%02d",
+             year(local), month(local), day(local), hour(local), minute(local), second(local));
     return String(dateTimeString);
   }
   return "RTC time invalid!";
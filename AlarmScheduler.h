@@ -8,13 +8,140 @@
 #include <WiFi.h>
 #include <NTPClient.h>
 #include <WiFiUdp.h>
-#include <SPIFFS.h>
+#include "TimeZoneRules.h"
+#include "AlarmStorage.h"
+#include "PayloadPool.h"
+#include "SchedulerStats.h"
+#include "AlarmLog.h"
+#include "EventHistory.h"
+#include "ZoneCallback.h"
+#include "ZoneSubscribers.h"
+#include "ResponseSink.h"
+#include "AlarmIdMap.h"
+#include "WeekIndex.h"
+#include "ScheduleAnalysis.h"
+
+#define PERSIST_WINDOW_MS 2000 // Default coalescing window for background saves
+#define ALARM_ACTION_LEN 64          // Action string incl. terminator
+#define ALARM_PAYLOAD_MAX 1000       // Serialized zone_data per alarm
+#define ALARM_REQUEST_DOC_SIZE 3072  // Parsed command; twice COMMAND_RX_MAX and MQTT_RX_MAX, as parsing about doubles JSON
+#define ALARM_RESPONSE_DOC_SIZE 4096 // list output
+#define ALARM_PAYLOAD_DOC_SIZE 1200  // One alarm's parsed zone_data
+#define ALARM_FILE_DOC_SIZE 8192     // alarms.json snapshot; adds that would overflow it are refused
+#define ALARM_FILE_BUFFER_SIZE 6144  // Serialized alarms.json, further capped by the storage backend
+#define ZONE_QUEUE_LEN 2             // Fires waiting per zone worker
+#define ZONE_WORKER_STACK 6144       // Worker stack, incl. one parsed zone_data document
+#define SIMULATE_LIMIT 100           // Events listed by the simulate command unless "limit" says otherwise
+#define SIMULATE_LIMIT_MAX 1000      // Highest "limit"; the run stops there
+#define SIMULATE_CHUNK 8             // Events copied out per hold of the state lock
+#define SIMULATE_DAYS_MAX 1830       // Longest simulated range, about five years
+
+// Allocator behind the scheduler's JSON pools. Every heap request is
+// counted, so heapAllocations() staying flat after begin() shows that the
+// pools are reused rather than reallocated.
+struct CountingAllocator
+{
+  static volatile uint32_t allocations;
+  void *allocate(size_t size)
+  {
+    allocations++;
+    return malloc(size);
+  }
+  void deallocate(void *ptr) { free(ptr); }
+  void *reallocate(void *ptr, size_t size)
+  {
+    allocations++;
+    return realloc(ptr, size);
+  }
+};
+typedef BasicJsonDocument<CountingAllocator> PooledJsonDocument;
+
+class AlarmScheduler;
+class ZoneAlarms;
+
+// Storage and scratch space the scheduler lends to its zones; guarded by its state lock
+struct ZoneResources
+{
+  AlarmScheduler *owner;    // Completes a staged boot on first use
+  AlarmStorage *storage;    // zone_data, one key per alarm
+  PayloadPool *pending;     // Unflushed zone_data
+  JsonDocument *payloadDoc; // One alarm's parsed zone_data
+  uint8_t *scratch;         // ALARM_PAYLOAD_MAX + 1 bytes for storage reads
+  SchedulerStats *stats;    // Fire counts, lateness and callback time
+  EventHistory *history;    // Audit log of fired alarms
+  ZoneSubscribers *subscribers; // Targets fanned out to on each fire
+  uint32_t budgetUs;        // Callback time before an overrun is reported, 0 = unchecked
+  QueueHandle_t workers[4]; // Per-zone worker queues, nullptr = callbacks run inline
+  uint32_t nextId;          // Device-assigned alarm ids count up from here (persisted)
+  AlarmIdMap *ids;          // Alarm id -> zone and slot
+  WeekIndex *week;          // Minutes of the week with a day-based alarm in any zone
+  volatile bool slotKeys;   // Some zone_data may still be under the slot keys of older versions
+  ZoneAlarms *zones;        // All four zones, for limits across the schedule
+  size_t fileLimit;         // Longest alarms.json the buffer and storage backend take
+};
+
+#define ALARM_DEVICE_ID 0x80000000UL // Set in ids the device assigns; controllers use the lower half
+
+// Timing fields of one alarm, an entry of the boot-time schedule index ("/schedule.bin")
+struct __attribute__((packed)) CompactAlarm
+{
+  uint8_t zone;  // 1–4
+  uint8_t slot;  // 0–9
+  uint8_t flags; // COMPACT_*
+  uint8_t days;  // Bit per weekday, sun = bit 0
+  uint16_t year;
+  uint8_t month;
+  uint8_t date;
+  uint8_t hour;
+  uint8_t minute;
+  uint32_t id;   // Alarm id, which also keys its zone_data
+};
+#define COMPACT_DATE_BASED 0x01
+#define COMPACT_ONE_TIME 0x02
+
+// A fire handed to a zone worker; zone_data travels as a PayloadPool entry
+struct ZoneJob
+{
+  time_t utcNow;
+  time_t localNow;
+  uint32_t alarmId;      // The slot may be reused before the job runs
+  uint8_t payloadHandle; // 0 = empty zone_data
+  char action[ALARM_ACTION_LEN];
+};
+
+// The minute being checked, broken down once per tick and shared by all zones
+struct CalendarTick
+{
+  time_t utcNow;
+  time_t localNow;
+  time_t localMinute;    // localNow at the start of its minute
+  time_t dayStart;       // Local midnight of localNow
+  time_t skippedFrom;    // Start of a DST gap just crossed (0 = none)
+  uint32_t dateKey;      // Year, month and date as one word, see matchDateKey()
+  uint16_t minuteOfDay;  // 0–1439
+  uint16_t minuteOfWeek; // 0–10079, Sunday 00:00 = 0
+  uint8_t weekday;       // sun = 0, ..., sat = 6
+};
+
+// One fire reported by AlarmScheduler::simulate()
+struct SimulatedFire
+{
+  time_t utc;
+  time_t local;
+  uint8_t zone; // 1–4
+  uint8_t slot;
+  uint32_t alarmId;
+  bool dateBased;
+  bool suppressed;    // A day-based fire masked by a date-based one (only if requested)
+  const char *action; // Valid during the callback only
+};
+typedef bool (*SimulationFunction)(const SimulatedFire &fire, void *context); // false ends the run
 
 class ZoneAlarms
 {
 private:
   uint8_t zoneId;                                        // 1–4
-  void (*Zone)(int id, String _action, JsonObject &zoneData); // Updated zone signature
+  ZoneCallback Zone;                                     // Handler bound by registerZone()
   struct Alarm
   {
     bool isActive;    // true if enabled
@@ -26,21 +153,81 @@ private:
     uint8_t date;     // 1–31
     uint8_t hour;     // 0–23
     uint8_t minute;   // 0–59
-    String action;      // true=ON, false=OFF
+    char action[ALARM_ACTION_LEN]; // Passed to the zone callback
+    uint8_t dataState;      // Unflushed zone_data change (DATA_*)
+    uint8_t pendingHandle;  // PayloadPool entry awaiting flush (0 = none)
+    bool detailsPending;    // Restored from the schedule index; action not loaded yet
+    uint32_t id;            // Stable across reloads; chosen by a controller or the device
+    uint16_t rev;           // Revision of this id's content, set by whoever writes it
+    uint32_t staleId;       // Stored zone_data of a removed alarm, deleted on the next flush (0 = none)
+  };
+  enum
+  {
+    DATA_CLEAN,  // Stored zone_data is up to date
+    DATA_WRITE   // The pending payload replaces the stored entry
   };
   Alarm alarms[10];                // 10 alarms per zone
   uint8_t alarmCount;              // Active alarms (0–10)
-  unsigned long lastTriggerMinute; // Debouncing (Unix minutes)
+  unsigned long lastTriggerMinute; // Debouncing (UTC Unix minutes)
+  uint32_t version;                // Bumped on every change to this zone's alarms
+  ZoneResources *shared;           // Storage and buffers owned by the scheduler
+  // Match table: the timing of every slot in parallel arrays, so one
+  // branch-free sweep finds the slots due in a minute (kept by indexSlot())
+  uint16_t matchMinute[10];   // Minute of day, MATCH_NEVER_MINUTE for free slots
+  uint8_t matchDays[10];      // Bit per weekday (sun = bit 0); 0 for date alarms
+  uint32_t matchDate[10];     // matchDateKey() of a date alarm, MATCH_NEVER_DATE otherwise
+  uint32_t matchDateMask[10]; // Drops the year for yearly alarms
+  void indexSlot(uint8_t slot);
+  uint16_t matchSlots(uint16_t minuteOfDay, uint8_t weekdayBit, uint32_t dateKey, uint16_t *dayHits) const; // Bit per due date alarm
+  void dropPendingData(uint8_t slot, uint8_t state);
+  bool parseAlarm(JsonDocument &doc, Alarm &alarm);                    // Schedule fields; on failure doc holds the error
+  bool parseZoneData(JsonDocument &doc, bool required, uint8_t *handle); // Into the pending pool; nullptr only checks
+  void fillFromSlot(uint8_t slot, JsonDocument &doc) const; // Current schedule fields missing from doc
+  void deactivate(uint8_t slot);
+  uint8_t disableSameTime(uint8_t slot, uint32_t *replaced); // Ids of the alarms it disabled, returns their count
+  void addReplaced(JsonDocument &doc, const uint32_t *replaced, uint8_t n) const;
+  void addDays(const Alarm &alarm, JsonArray days) const;
+  void listAlarm(JsonObject obj, const Alarm &alarm, uint8_t slot) const; // Schedule fields, as in list and alarms.json
+  void entryUsage(const Alarm &alarm, uint8_t slot, size_t *bytes, size_t *memory) const;
+  bool fitsFile(const Alarm &alarm, uint8_t slot, JsonDocument &doc); // false with an error in doc if alarms.json would outgrow its limits
+  time_t dateOccurrence(const Alarm &alarm, int year) const; // Local time in that year, 0 = no such date
+  bool enqueue(uint8_t slot, time_t utcNow, time_t localNow, JsonDocument &zoneDoc);
 
 public:
-  ZoneAlarms(uint8_t id);
-  bool addAlarm(JsonDocument &doc);
-  bool deleteAlarm(uint8_t id);
-  bool checkAlarms(); // Modified to accept scheduler reference
-  void listAlarms(JsonArray &arr);
-  void setZone(void (*zone)(int id, String _action, JsonObject &zoneData)) { Zone = zone; }
+  ZoneAlarms(uint8_t id, ZoneResources *shared = nullptr);
+  bool addAlarm(JsonDocument &doc, int restoreSlot = -1); // restoreSlot: reload into the saved slot
+  bool updateAlarm(uint8_t slot, JsonDocument &doc); // In place; omitted fields are kept
+  bool checkAlarm(JsonDocument &doc, int slot); // addAlarm() (slot < 0) or updateAlarm() checks only; fills in doc
+  bool deleteAlarm(uint8_t slot);
+  bool checkAlarms(const CalendarTick &tick); // true if consumed one-time alarms need saving
+  time_t nextTriggerTime(time_t from); // Earliest local alarm time at or after local 'from' (0 = none)
+  time_t nextOccurrence(uint8_t slot, time_t from); // Same for one slot, 0 = never
+  time_t previousOccurrence(uint8_t slot, time_t at); // Latest local time at or before 'at', 0 = none
+  void dispatch(uint8_t slot, time_t utcNow, time_t localNow); // Run the callback inline or queue it for the zone's worker
+  bool describe(uint8_t slot, SimulatedFire &fire) const; // Fills zone, slot, id, type and action; false if free
+  bool loadZoneData(uint8_t slot, JsonDocument &doc); // Pending change first, then the alarm's key
+  // Copies an unflushed payload (len 0 = none) and names a stored key to remove (staleId 0 = none); false if unchanged
+  bool pendingZoneData(uint8_t slot, char *buffer, uint16_t *len, uint32_t *id, uint32_t *staleId);
+  uint32_t storedDataId(uint8_t slot) const; // Id of an active alarm whose zone_data is only in storage, else 0
+  void listAlarms(JsonArray &arr, bool withZoneData = true);
+  void fileUsage(size_t *bytes, size_t *memory, int skipSlot = -1) const; // Adds the size of the active alarms in alarms.json
+  void clearZoneDataChanges();
+  void setZone(const ZoneCallback &zone) { Zone = zone; }
   void clearAlarms();
-  bool hasZone() const { return Zone != nullptr; }
+  size_t exportCompact(CompactAlarm *out) const;  // Active alarms, returns the count
+  bool restoreCompact(const CompactAlarm &entry); // Timing only; the rest follows via applyDetails()
+  bool applyDetails(JsonObject alarm);            // false if alarms.json disagrees with the index
+  bool detailsPending() const;
+  bool hasZone() const; // A callback or at least one subscriber
+  uint8_t size() const { return alarmCount; }
+  void indexWeek() const; // Re-adds this zone's day-based alarms after the week index was cleared
+  int findId(uint32_t id) const; // Slot holding id in this zone, -1 if none
+  uint32_t scheduleVersion() const { return version; }
+  void setScheduleVersion(uint32_t v) { version = v; }
+  uint32_t scheduleHash() const;          // FNV-1a of (id, rev) pairs in id order
+  void listRevisions(JsonArray &arr) const; // [{alarm_id, rev}] of active alarms
+  uint32_t invoke(uint32_t alarmId, const char *action, JsonObject &zoneData); // Runs the callback and subscribers, returns their duration in us
+  void recordFire(uint32_t alarmId, const char *action, time_t utcNow, time_t localNow, uint32_t elapsedUs); // Stats, history, budget
 };
 
 class AlarmScheduler
@@ -52,28 +239,147 @@ private:
   WiFiUDP *ntpUDP;             // Pointer to NTP UDP
   NTPClient *timeClient;       // Pointer to NTP client
   time_t getRtcTime();
+  void migrateRtcToUtc(); // Once, on the first boot after older versions
   unsigned long lastSyncMillis; // For manual sync
   bool setRTCFromNTP();         // NTP sync function
-  unsigned long offset;
-  bool spiffsInitialized; // Track SPIFFS initialization
+  TimeZoneRules timeZone;       // Local time rules; TimeLib and the RTC run on UTC
+  bool storageReady;            // Track storage initialization
+  bool legacyZoneData;          // Loaded alarms.json embedded zone_data (older versions)
+  TaskHandle_t waitingTask;     // Task blocked in waitAndDispatch()
+  volatile uint32_t planSeq;    // Bumped by mutations and notifyWaiter(); invalidates the cached next trigger
+  uint32_t plannedSeq;          // planSeq when nextTrigger was computed
+  time_t plannedFrom;           // Minute nextTrigger was searched from, 0 = none
+  time_t nextTrigger;           // Cached nextTriggerUtc(plannedFrom) (state lock)
+  void notifyWaiter();          // Wake waitAndDispatch() after a mutation
+  time_t nextTriggerUtc(time_t fromUtc); // Earliest trigger instant across zones (0 = none)
+  time_t zoneTriggerUtc(uint8_t zone, int slot, time_t fromUtc); // Same for zone index 0–3 and one slot (-1 = any)
+  bool lastFire(uint8_t zone, time_t atUtc, SimulatedFire &fire); // Reverse of zoneTriggerUtc() for a whole zone
+  const char *parseRange(JsonDocument &doc, long defaultDays, time_t *fromUtc, time_t *toUtc); // Error message or nullptr
+  bool saveTimeZoneToSpiffs();
+  void loadTimeZoneFromSpiffs();
+
+  // Staged boot: the compact schedule index is restored in begin(); actions
+  // and other alarm details follow from alarms.json on the persist task, or
+  // at once when an alarm fires, is listed or is flushed first
+  bool loadScheduleIndex();
+  bool restoreAlarms(JsonDocument &doc, bool migrate); // Replays alarms.json through addAlarm(); migrate writes legacy zone_data
+  void restoreVersions(JsonDocument &doc, bool keepChanges); // Zone versions and next id from alarms.json
+  bool migrateSlotKeys(); // Moves zone_data of older versions to id keys (flush lock)
+  bool migrateZoneData(uint32_t id, JsonVariant zoneData); // Writes zone_data embedded in older files to its id key
+  volatile bool detailsPending;           // Index restored, alarms.json not yet applied
+  uint32_t scheduleGeneration;            // Bumped per flush; ties schedule.bin to alarms.json
+  uint32_t indexGeneration;               // Generation of the restored index
+
+  // Background persistence: mutations mark zones dirty, persistTask flushes them
+  SemaphoreHandle_t stateLock;  // Guards alarms against the flusher task
+  SemaphoreHandle_t flushLock;  // Serializes flush() callers
+  TaskHandle_t persistTask;
+  volatile uint8_t dirtyZones;  // Bit per zone with unflushed changes
+  uint32_t mutationSeq;         // Bumped on every mutation
+  unsigned long firstDirtyMillis;
+  unsigned long persistWindowMs;
+  size_t pendingByteCount;
+  SemaphoreHandle_t requestLock; // Serializes processJson() callers sharing requestDoc
+  CommandStatus handleRequest(const char *json, size_t length, Print &out);
+  static CommandStatus reply(JsonDocument &response, Print &out, bool pretty = false);
+  void lockState();
+  void unlockState();
+  void markDirty(uint8_t zoneMask, size_t bytes);
+  bool writeFile(const char *path, const char *content, size_t len);
+  bool runJob(StorageJob &job);  // Steps a job to completion, yielding between chunks
+  StorageJob ioJob;              // Chunked alarms.json and zone_data I/O (flush lock)
+  size_t ioChunk;                // Bytes per step
+  bool spillHistory(bool partial); // Write unspilled history blocks (takes the flush lock)
+  static void persistTaskEntry(void *arg);
+  struct ZoneWorker
+  {
+    AlarmScheduler *owner;
+    uint8_t zone; // Index 0–3
+    TaskHandle_t task;
+    QueueHandle_t queue; // Set before the task starts; dispatch sees it once published in zoneResources
+    StaticQueue_t queueControl;
+    uint8_t queueStorage[ZONE_QUEUE_LEN * sizeof(ZoneJob)];
+  };
+  ZoneWorker workers[4];
+  static void workerTaskEntry(void *arg);
+  SpiffsStorage defaultStorage; // Used unless setStorage() picks another backend
+  AlarmStorage *storage;
+
+  // Preallocated pools; after begin() the check/fire/list/add paths allocate nothing
+  PooledJsonDocument requestDoc;  // processJson() input, reused for short replies
+  PooledJsonDocument responseDoc; // list output
+  PooledJsonDocument payloadDoc;  // zone_data of one alarm (state lock)
+  PooledJsonDocument fileDoc;     // alarms.json snapshot (flush lock)
+  PayloadPool pendingPool;
+  uint8_t payloadScratch[ALARM_PAYLOAD_MAX + 1];
+  char flushBuffer[ALARM_FILE_BUFFER_SIZE]; // Serialized alarms.json or one payload (flush lock)
+  ZoneResources zoneResources;
+  SchedulerStats statistics;
+  EventHistory history;
+  ZoneSubscribers subscribers;
+  AlarmIdMap alarmIds;
+  WeekIndex weekIndex;
+  bool historySpill;            // Keep history blocks in storage as well as RAM
+  bool stateReplay;             // Replay the desired state after begin() and time changes
+  volatile uint8_t replayZones; // Bit per zone whose state the next check replays
 
 public:
-  AlarmScheduler(unsigned long timeOffset = 19800);
+  AlarmScheduler(unsigned long timeOffset = 19800); // Fixed UTC offset in seconds until setTimeZone()
   ~AlarmScheduler();
+  void setStorage(AlarmStorage &backend); // Call before begin()
   void begin(uint8_t rstPin, uint8_t datPin, uint8_t clkPin);
-  void registerZone(uint8_t id, void (*zone)(int id, String _action, JsonObject &zoneData));
-  void processJson(String &json);
-  void checkAlarms();
+  void registerZone(uint8_t id, ZoneCallback zone); // Also takes the original void (*)(int, String, JsonObject &)
+  void registerZone(uint8_t id, ZoneCallback::Function zone, void *context) { registerZone(id, ZoneCallback(zone, context)); }
+  // Targets sharing a zone's schedule, for one alarm id or all of them. Change
+  // subscriptions before startZoneWorkers(), which read them without the lock.
+  bool subscribe(uint8_t zone, uint16_t target, TargetFunction fn, void *context = nullptr, uint32_t alarmId = SUBSCRIBE_ALL_ALARMS);
+  size_t unsubscribe(uint8_t zone, uint16_t target, TargetFunction fn, void *context = nullptr);
+  CommandStatus processJson(String &json);                               // Replies on Serial
+  CommandStatus processJson(const char *json, size_t length, Print &out); // Any Print, written under the request lock; sockets go through a BufferSink
+  CommandStatus processJson(const char *json, size_t length);            // No reply, for internal callers
+  unsigned long checkAlarms();                          // Returns ms until the next possible trigger
+  unsigned long waitAndDispatch(unsigned long timeoutMs); // Blocks until due, timeout or mutation
+  // Every fire of the current alarms in [fromUtc, toUtc), in order, under the
+  // checkAlarms() rules; jumps from event to event. Zones need no callback.
+  // Returns the number of fires, not counting suppressed ones, which are only
+  // reported if asked for. Also {"command":"simulate"}
+  size_t simulate(time_t fromUtc, time_t toUtc, SimulationFunction fn, void *context = nullptr, uint8_t zoneMask = 0x0F,
+                  bool withSuppressed = false);
+  // Conflicts, masked, redundant and idle alarms and the time each action is
+  // in effect over [fromUtc, toUtc), from a simulate() run. Also {"command":"analyze"}
+  void analyze(ScheduleAnalysis &analysis, time_t fromUtc, time_t toUtc, uint8_t zoneMask = 0x0F);
+  // The alarm whose action a zone (1–4) should be showing at 'atUtc' (0 = now):
+  // its latest fire at or before then. false if it never fired. Consumed
+  // one-time alarms are gone and no longer count. Also {"command":"state"}
+  bool desiredState(uint8_t zone, SimulatedFire &fire, time_t atUtc = 0);
+  // Re-sends each zone's desired state to its callback on the next check, so
+  // outputs converge after a reboot or time step without waiting for an edge.
+  // Replays go through the normal dispatch and are recorded like fires.
+  void replayState(uint8_t zoneMask = 0x0F);
+  void setStateReplay(bool enabled) { stateReplay = enabled; } // Replay after begin(), set and NTP syncs
   String printTime();
   bool isTimeSet();
   bool syncWithNTP();
-  void updateOffsetValue(unsigned long offset);
-  bool saveAlarmsToSpiffs();
+  void updateOffsetValue(unsigned long offset); // Fixed offset, no DST
+  bool setTimeZone(const char *posixTz);        // e.g. "CET-1CEST,M3.5.0,M10.5.0/3"
+  time_t localTime();                           // Current wall-clock time
+  bool saveAlarmsToSpiffs(); // Same as flush()
   bool loadAlarmsFromSpiffs();
+  bool flush();                                // Write pending changes now (e.g. before shutdown)
+  bool loadAlarmDetails();                     // Finish a staged boot now; called on demand
+  size_t pendingBytes() const { return pendingByteCount; }
+  uint32_t heapAllocations() const { return CountingAllocator::allocations; } // JSON pool allocations so far
+  const SchedulerStats &stats() const { return statistics; } // Also {"command":"stats"}
+  void resetStats() { statistics.reset(); }
+  void setCallbackBudget(uint32_t us) { zoneResources.budgetUs = us; } // Overruns are logged and counted, 0 = off
+  bool startZoneWorkers(uint32_t stackSize = ZONE_WORKER_STACK, UBaseType_t priority = 1); // One task and queue per zone
+  void setHistorySpill(bool enabled) { historySpill = enabled; } // Call before begin(); also {"command":"history"}
+  void setPersistWindow(unsigned long ms) { persistWindowMs = ms; } // Coalescing window
+  void setIoChunk(size_t bytes) { ioChunk = bytes ? bytes : STORAGE_CHUNK; } // Flash bytes per slice before yielding
 
   bool saveZoneDataToSpiffs();
-  bool loadZoneDataForAlarm(uint8_t zoneId, uint8_t alarmId, JsonObject &zoneData);
-  bool deleteZoneDataFromSpiffs(uint8_t zoneId, uint8_t alarmId);
+  bool loadZoneDataForAlarm(uint8_t zoneId, uint32_t alarmId, JsonObject &zoneData);
+  bool deleteZoneDataFromSpiffs(uint8_t zoneId, uint32_t alarmId);
 };
 
 #endif
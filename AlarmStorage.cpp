@@ -0,0 +1,492 @@
+#include "AlarmStorage.h"
+#include "AlarmLog.h"
+
+#define RING_TOMBSTONE 0x0001 // Record marks the key as removed
+
+// Helper: Backends without directories store "/alarms.json" as "alarms.json"
+static const char *flatKey(const char *key)
+{
+  return key[0] == '/' ? key + 1 : key;
+}
+
+static uint32_t align4(uint32_t n)
+{
+  return (n + 3) & ~3UL;
+}
+
+// AlarmStorage
+bool AlarmStorage::write(const char *key, const String &value)
+{
+  return write(key, (const uint8_t *)value.c_str(), value.length());
+}
+
+DeserializationError AlarmStorage::readJson(const char *key, JsonDocument &doc)
+{
+  size_t len = size(key);
+  if (len == 0)
+    return DeserializationError::EmptyInput;
+  uint8_t *buffer = (uint8_t *)malloc(len);
+  if (!buffer)
+    return DeserializationError::NoMemory;
+  DeserializationError error = readJson(key, doc, buffer, len);
+  free(buffer);
+  return error;
+}
+
+DeserializationError AlarmStorage::readJson(const char *key, JsonDocument &doc, uint8_t *buffer, size_t len)
+{
+  size_t n = read(key, buffer, len);
+  if (n == 0)
+    return DeserializationError::EmptyInput; // Missing, corrupt or larger than the buffer
+  // const input makes ArduinoJson copy strings, so the buffer can be reused
+  return deserializeJson(doc, (const char *)buffer, n);
+}
+
+// StorageJob
+bool StorageJob::start(AlarmStorage &backend, const char *key, size_t length, Completion done, void *ctx)
+{
+  if (state == RUNNING || strlen(key) >= sizeof(keyBuffer))
+    return false;
+  strcpy(keyBuffer, key);
+  storage = &backend;
+  len = length;
+  completion = done;
+  context = ctx;
+  cursor.reset();
+  state = RUNNING;
+  return true;
+}
+
+bool StorageJob::startRead(AlarmStorage &backend, const char *key, uint8_t *destination, size_t capacity, Completion done, void *ctx)
+{
+  if (!start(backend, key, capacity, done, ctx))
+    return false;
+  buffer = destination;
+  data = nullptr;
+  writing = false;
+  return true;
+}
+
+bool StorageJob::startWrite(AlarmStorage &backend, const char *key, const uint8_t *source, size_t length, Completion done, void *ctx)
+{
+  if (!start(backend, key, length, done, ctx))
+    return false;
+  buffer = nullptr;
+  data = source;
+  writing = true;
+  return true;
+}
+
+StorageJob::Status StorageJob::step(size_t budget)
+{
+  if (state != RUNNING)
+    return state;
+  state = storage->step(*this, budget);
+  if (state != RUNNING && completion)
+    completion(context, *this);
+  return state;
+}
+
+void StorageJob::cancel()
+{
+  if (state != RUNNING)
+    return;
+  cursor.file.close();
+  state = FAILED;
+}
+
+StorageJob::Status AlarmStorage::step(StorageJob &job, size_t budget)
+{
+  if (job.writing)
+    return write(job.keyBuffer, job.data, job.len) ? StorageJob::DONE : StorageJob::FAILED;
+  size_t capacity = job.len;
+  job.len = read(job.keyBuffer, job.buffer, capacity);
+  if (job.len)
+    return StorageJob::DONE;
+  return size(job.keyBuffer) > capacity ? StorageJob::TOO_SMALL : StorageJob::FAILED;
+}
+
+// FsStorage
+bool FsStorage::write(const char *key, const uint8_t *data, size_t len)
+{
+  if (!records.write(key, data, len))
+    return false;
+  writtenBytes += len + sizeof(RecordStore::Header);
+  return true;
+}
+
+StorageJob::Status FsStorage::step(StorageJob &job, size_t budget)
+{
+  RecordStore::StepResult result = job.writing ? records.writeStep(job.keyBuffer, job.data, job.len, job.cursor, budget)
+                                               : records.readStep(job.keyBuffer, job.buffer, job.len, job.cursor, budget);
+  if (result == RecordStore::STEP_MORE)
+    return StorageJob::RUNNING;
+  if (result == RecordStore::STEP_TOO_SMALL)
+    return StorageJob::TOO_SMALL;
+  if (result == RecordStore::STEP_FAILED)
+    return StorageJob::FAILED;
+  if (job.writing)
+    writtenBytes += job.len + sizeof(RecordStore::Header);
+  else
+    job.len = job.cursor.offset;
+  return StorageJob::DONE;
+}
+
+// NvsStorage
+size_t NvsStorage::size(const char *key)
+{
+  const char *k = flatKey(key);
+  return prefs.isKey(k) ? prefs.getBytesLength(k) : 0;
+}
+
+size_t NvsStorage::read(const char *key, uint8_t *buffer, size_t len)
+{
+  const char *k = flatKey(key);
+  if (!prefs.isKey(k))
+    return 0;
+  return prefs.getBytes(k, buffer, len);
+}
+
+bool NvsStorage::write(const char *key, const uint8_t *data, size_t len)
+{
+  if (strlen(flatKey(key)) >= STORAGE_KEY_LEN)
+    return false;
+  if (prefs.putBytes(flatKey(key), data, len) != len)
+    return false;
+  writtenBytes += len;
+  return true;
+}
+
+bool NvsStorage::remove(const char *key)
+{
+  const char *k = flatKey(key);
+  return prefs.isKey(k) && prefs.remove(k);
+}
+
+// PartitionRingStorage
+uint32_t PartitionRingStorage::recordCrc(const RecordHeader &header, const uint8_t *data) const
+{
+  uint32_t crc = RecordStore::crc32(0, (const uint8_t *)&header, offsetof(RecordHeader, crc));
+  return data ? RecordStore::crc32(crc, data, header.length) : crc;
+}
+
+PartitionRingStorage::IndexEntry *PartitionRingStorage::find(const char *key, bool create)
+{
+  IndexEntry *freeEntry = nullptr;
+  for (int i = 0; i < RING_MAX_KEYS; i++)
+  {
+    if (index[i].key[0] == '\0')
+    {
+      if (!freeEntry)
+        freeEntry = &index[i];
+      continue;
+    }
+    if (strncmp(index[i].key, key, STORAGE_KEY_LEN) == 0)
+      return &index[i];
+  }
+  if (!create || !freeEntry)
+    return nullptr;
+  strncpy(freeEntry->key, key, STORAGE_KEY_LEN - 1);
+  freeEntry->key[STORAGE_KEY_LEN - 1] = '\0';
+  freeEntry->seq = 0;
+  return freeEntry;
+}
+
+uint32_t PartitionRingStorage::liveBytes() const
+{
+  uint32_t total = 0;
+  for (int i = 0; i < RING_MAX_KEYS; i++)
+  {
+    if (index[i].key[0] != '\0')
+      total += align4(sizeof(RecordHeader) + index[i].length);
+  }
+  return total;
+}
+
+uint32_t PartitionRingStorage::payloadCrc(const RecordHeader &header, uint32_t offset) const
+{
+  uint8_t chunk[64];
+  uint32_t crc = recordCrc(header, nullptr);
+  for (uint32_t done = 0; done < header.length;)
+  {
+    uint32_t n = header.length - done < sizeof(chunk) ? header.length - done : sizeof(chunk);
+    esp_partition_read(partition, offset + sizeof(RecordHeader) + done, chunk, n);
+    crc = RecordStore::crc32(crc, chunk, n);
+    done += n;
+  }
+  return crc;
+}
+
+uint32_t PartitionRingStorage::cleanTail(uint32_t sector) const
+{
+  // Offset just past the last programmed word; 0 = sector erased
+  uint32_t words[16];
+  for (uint32_t end = RING_SECTOR_SIZE; end > 0; end -= sizeof(words))
+  {
+    esp_partition_read(partition, sector * RING_SECTOR_SIZE + end - sizeof(words), words, sizeof(words));
+    for (int i = 15; i >= 0; i--)
+    {
+      if (words[i] != 0xFFFFFFFF)
+        return end - sizeof(words) + (i + 1) * 4;
+    }
+  }
+  return 0;
+}
+
+bool PartitionRingStorage::begin()
+{
+  if (!lock)
+    lock = xSemaphoreCreateMutex();
+  xSemaphoreTake(lock, portMAX_DELAY);
+  bool ok = scan();
+  xSemaphoreGive(lock);
+  return ok;
+}
+
+bool PartitionRingStorage::scan()
+{
+  full = false;
+  partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+  if (!partition || partition->size < 3 * RING_SECTOR_SIZE)
+  {
+    partition = nullptr;
+    return false;
+  }
+  sectorCount = partition->size / RING_SECTOR_SIZE;
+  memset(index, 0, sizeof(index));
+  seq = 0;
+  headSector = 0;
+  headPos = 0;
+
+  // Rebuild the index: the newest sequence number per key wins, and the
+  // newest record overall marks the append sector
+  bool any = false;
+  for (uint32_t sector = 0; sector < sectorCount; sector++)
+  {
+    uint32_t base = sector * RING_SECTOR_SIZE;
+    uint32_t clean = cleanTail(sector);
+    uint32_t pos = 0;
+    while (pos + sizeof(RecordHeader) <= clean)
+    {
+      RecordHeader header;
+      esp_partition_read(partition, base + pos, &header, sizeof(header));
+      if (header.magic != RECORD_MAGIC || header.length > clean - pos - sizeof(RecordHeader) ||
+          payloadCrc(header, base + pos) != header.crc)
+      {
+        pos += 4; // Torn append; resynchronise on the next aligned word
+        continue;
+      }
+      header.key[STORAGE_KEY_LEN - 1] = '\0';
+      IndexEntry *entry = find(header.key, true);
+      if (entry && (entry->seq == 0 || (int32_t)(header.seq - entry->seq) > 0))
+      {
+        entry->offset = base + pos;
+        entry->length = header.length;
+        entry->flags = header.flags;
+        entry->seq = header.seq;
+      }
+      if (!any || (int32_t)(header.seq - seq) > 0)
+      {
+        any = true;
+        seq = header.seq;
+        headSector = sector;
+      }
+      pos += align4(sizeof(RecordHeader) + header.length);
+    }
+  }
+  // Appends continue after the last programmed word, past any torn record
+  headPos = cleanTail(headSector);
+
+  // Live data must leave the head and the erased sector free; a larger
+  // set cannot be reclaimed, so the ring keeps serving it read-only
+  if (liveBytes() > (sectorCount - 2) * RING_SECTOR_SIZE)
+  {
+    ALARM_LOGE("Ring storage: %lu live bytes exceed the partition, read-only", (unsigned long)liveBytes());
+    full = true;
+    return true;
+  }
+
+  // Restore the invariant that the sector after the head is erased, e.g.
+  // after a reset in the middle of a reclaim
+  uint32_t nextSector = (headSector + 1) % sectorCount;
+  if (cleanTail(nextSector) != 0 && !reclaim(nextSector))
+  {
+    ALARM_LOGE("Ring storage: no room to reclaim sector %lu, read-only", (unsigned long)nextSector);
+    full = true;
+  }
+  return true;
+}
+
+bool PartitionRingStorage::copyRecord(const IndexEntry &entry)
+{
+  RecordHeader header;
+  esp_partition_read(partition, entry.offset, &header, sizeof(header));
+  uint32_t total = align4(sizeof(RecordHeader) + header.length);
+  if (headPos + total > RING_SECTOR_SIZE)
+    return false;
+
+  // Relocated copies get a fresh sequence number so the newest record
+  // always marks the physical append position
+  header.seq = ++seq;
+  header.crc = payloadCrc(header, entry.offset);
+
+  uint32_t target = headSector * RING_SECTOR_SIZE + headPos;
+  esp_partition_write(partition, target, &header, sizeof(header));
+  uint8_t chunk[64];
+  for (uint32_t done = 0; done < header.length;)
+  {
+    uint32_t n = header.length - done < sizeof(chunk) ? header.length - done : sizeof(chunk);
+    esp_partition_read(partition, entry.offset + sizeof(RecordHeader) + done, chunk, n);
+    esp_partition_write(partition, target + sizeof(RecordHeader) + done, chunk, n);
+    done += n;
+  }
+  headPos += total;
+  writtenBytes += total;
+
+  IndexEntry *live = find(entry.key, false);
+  if (live)
+  {
+    live->offset = target;
+    live->seq = header.seq;
+  }
+  return true;
+}
+
+bool PartitionRingStorage::reclaim(uint32_t sector)
+{
+  for (int i = 0; i < RING_MAX_KEYS; i++)
+  {
+    if (index[i].key[0] == '\0' || index[i].offset / RING_SECTOR_SIZE != sector)
+      continue;
+    // The reclaimed sector holds the oldest records, so older versions of a
+    // deleted key go with it; its tombstone can then leave the index
+    if (index[i].flags & RING_TOMBSTONE)
+    {
+      memset(&index[i], 0, sizeof(index[i]));
+      continue;
+    }
+    if (!copyRecord(index[i]))
+      return false;
+  }
+  if (esp_partition_erase_range(partition, sector * RING_SECTOR_SIZE, RING_SECTOR_SIZE) != ESP_OK)
+    return false;
+  erasedSectors++;
+  return true;
+}
+
+bool PartitionRingStorage::advance()
+{
+  // The next sector is erased by invariant; prepare the one after it
+  headSector = (headSector + 1) % sectorCount;
+  headPos = 0;
+  if (reclaim((headSector + 1) % sectorCount))
+    return true;
+  // The sector is now partly copied and still holds the rest, so both stay
+  // readable; appending on would later land on it unerased
+  ALARM_LOGE("Ring storage: no room to reclaim, read-only");
+  full = true;
+  return false;
+}
+
+bool PartitionRingStorage::append(const char *key, const uint8_t *data, uint16_t len, uint16_t flags)
+{
+  if (full)
+    return false;
+  uint32_t total = align4(sizeof(RecordHeader) + len);
+  IndexEntry *entry = find(key, false);
+  uint32_t replaced = entry ? align4(sizeof(RecordHeader) + entry->length) : 0;
+  if (liveBytes() - replaced + total > (sectorCount - 2) * RING_SECTOR_SIZE)
+    return false; // Live data would no longer fit
+  for (uint32_t guard = 0; headPos + total > RING_SECTOR_SIZE; guard++)
+  {
+    if (guard >= sectorCount || !advance())
+      return false;
+  }
+
+  // Looked up again: a reclaim may have dropped the key's tombstone
+  entry = find(key, true);
+  if (!entry)
+    return false;
+
+  RecordHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = RECORD_MAGIC;
+  header.seq = ++seq;
+  strncpy(header.key, key, STORAGE_KEY_LEN - 1);
+  header.length = len;
+  header.flags = flags;
+  header.crc = recordCrc(header, data);
+
+  // Header first: a torn payload then fails its CRC instead of looking erased
+  uint32_t target = headSector * RING_SECTOR_SIZE + headPos;
+  if (esp_partition_write(partition, target, &header, sizeof(header)) != ESP_OK ||
+      (len && esp_partition_write(partition, target + sizeof(header), data, len) != ESP_OK))
+  {
+    headPos += total; // Leave the damaged record behind; a later scan skips it
+    return false;
+  }
+  headPos += total;
+  writtenBytes += total;
+
+  entry->offset = target;
+  entry->length = len;
+  entry->flags = flags;
+  entry->seq = header.seq;
+  return true;
+}
+
+size_t PartitionRingStorage::size(const char *key)
+{
+  if (!lock)
+    return 0;
+  xSemaphoreTake(lock, portMAX_DELAY);
+  IndexEntry *entry = partition ? find(flatKey(key), false) : nullptr;
+  size_t length = (entry && !(entry->flags & RING_TOMBSTONE)) ? entry->length : 0;
+  xSemaphoreGive(lock);
+  return length;
+}
+
+size_t PartitionRingStorage::read(const char *key, uint8_t *buffer, size_t len)
+{
+  if (!lock)
+    return 0;
+  xSemaphoreTake(lock, portMAX_DELAY);
+  size_t length = 0;
+  IndexEntry *entry = partition ? find(flatKey(key), false) : nullptr;
+  if (entry && !(entry->flags & RING_TOMBSTONE) && entry->length <= len)
+  {
+    // Under the lock: a concurrent reclaim would move the record
+    RecordHeader header;
+    esp_partition_read(partition, entry->offset, &header, sizeof(header));
+    esp_partition_read(partition, entry->offset + sizeof(header), buffer, entry->length);
+    if (recordCrc(header, buffer) == header.crc)
+      length = entry->length;
+  }
+  xSemaphoreGive(lock);
+  return length;
+}
+
+bool PartitionRingStorage::write(const char *key, const uint8_t *data, size_t len)
+{
+  const char *k = flatKey(key);
+  if (!lock || strlen(k) >= STORAGE_KEY_LEN || len > maxValueSize())
+    return false;
+  xSemaphoreTake(lock, portMAX_DELAY);
+  bool ok = partition && append(k, data, len, 0);
+  xSemaphoreGive(lock);
+  return ok;
+}
+
+bool PartitionRingStorage::remove(const char *key)
+{
+  const char *k = flatKey(key);
+  if (!lock)
+    return false;
+  xSemaphoreTake(lock, portMAX_DELAY);
+  IndexEntry *entry = partition ? find(k, false) : nullptr;
+  // Tombstones stay indexed until their sector is reclaimed, so older
+  // versions cannot resurface after a scan
+  bool ok = entry && !(entry->flags & RING_TOMBSTONE) && append(k, nullptr, 0, RING_TOMBSTONE);
+  xSemaphoreGive(lock);
+  return ok;
+}
@@ -0,0 +1,208 @@
+#ifndef ALARM_STORAGE_H
+#define ALARM_STORAGE_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <SPIFFS.h>
+#include <LittleFS.h>
+#include <Preferences.h>
+#include <esp_partition.h>
+#include "RecordStore.h"
+
+#define STORAGE_KEY_LEN 16      // Longest key incl. terminator (NVS limit)
+#define RING_SECTOR_SIZE 4096   // Flash erase unit
+#define RING_MAX_KEYS 64        // Distinct keys indexed by the ring backend
+#define STORAGE_CHUNK 512       // Default bytes moved per StorageJob step
+
+class AlarmStorage;
+
+// Resumable read or write of one key. Each step() moves about 'budget'
+// bytes and returns, so a caller can interleave flash work with its own;
+// the completion runs once the job ends. Backends without incremental I/O
+// finish in the first step. The buffer must stay valid until then.
+class StorageJob
+{
+public:
+  enum Status
+  {
+    IDLE,
+    RUNNING,
+    DONE,
+    FAILED,
+    TOO_SMALL // The value exceeds the read buffer; size() gives its length
+  };
+  typedef void (*Completion)(void *context, StorageJob &job);
+
+  StorageJob() : storage(nullptr), state(IDLE) {}
+  bool startRead(AlarmStorage &storage, const char *key, uint8_t *buffer, size_t len, Completion done = nullptr, void *context = nullptr);
+  bool startWrite(AlarmStorage &storage, const char *key, const uint8_t *data, size_t len, Completion done = nullptr, void *context = nullptr);
+  Status step(size_t budget = STORAGE_CHUNK);
+  Status status() const { return state; }
+  bool busy() const { return state == RUNNING; }
+  size_t length() const { return len; } // Bytes read once DONE, or bytes to write
+  const char *key() const { return keyBuffer; }
+  void cancel(); // An unfinished write leaves the previous value in place
+
+private:
+  friend class AlarmStorage;
+  friend class FsStorage;
+  AlarmStorage *storage;
+  char keyBuffer[STORAGE_KEY_LEN];
+  uint8_t *buffer;      // Read destination
+  const uint8_t *data;  // Write source
+  size_t len;
+  bool writing;
+  Status state;
+  Completion completion;
+  void *context;
+  RecordStore::Cursor cursor; // Progress of FsStorage jobs
+  bool start(AlarmStorage &storage, const char *key, size_t len, Completion done, void *context);
+};
+
+// Key/value persistence used by the scheduler. Keys are path-like
+// ("/alarms.json"); backends without directories drop the leading '/'.
+// write() replaces a value atomically: after a power loss either the old or
+// the new value is read back, never a mix.
+class AlarmStorage
+{
+public:
+  virtual ~AlarmStorage() {}
+  virtual bool begin() = 0;                                              // Mount/scan the medium
+  virtual const char *name() const = 0;
+  virtual size_t size(const char *key) = 0;                              // Upper bound of the value, 0 = missing
+  virtual size_t read(const char *key, uint8_t *buffer, size_t len) = 0; // Verified bytes read, 0 = missing/corrupt
+  virtual bool write(const char *key, const uint8_t *data, size_t len) = 0;
+  virtual bool remove(const char *key) = 0;
+  virtual void recover(const char *key) {} // Boot-time cleanup of an interrupted write
+  virtual StorageJob::Status step(StorageJob &job, size_t budget); // Whole operation at once unless overridden
+  virtual size_t maxValueSize() const { return SIZE_MAX; }          // Longest value write() accepts
+
+  bool write(const char *key, const String &value);
+  DeserializationError readJson(const char *key, JsonDocument &doc);                                 // Heap buffer sized to the value
+  DeserializationError readJson(const char *key, JsonDocument &doc, uint8_t *buffer, size_t len); // Caller's buffer, no heap
+  uint32_t bytesWritten() const { return writtenBytes; } // Wear: payload + metadata bytes programmed
+  uint32_t eraseCount() const { return erasedSectors; }  // Wear: sectors erased (ring backend only)
+
+protected:
+  uint32_t writtenBytes = 0;
+  uint32_t erasedSectors = 0;
+};
+
+// Files on a mounted fs::FS through RecordStore's A/B slots
+class FsStorage : public AlarmStorage
+{
+public:
+  FsStorage(fs::FS &fs) : records(fs) {}
+  bool begin() override { return true; } // Caller mounts the filesystem
+  const char *name() const override { return "fs"; }
+  size_t size(const char *key) override { return records.size(key); }
+  size_t read(const char *key, uint8_t *buffer, size_t len) override { return records.read(key, buffer, len); }
+  bool write(const char *key, const uint8_t *data, size_t len) override;
+  bool remove(const char *key) override { return records.remove(key); }
+  void recover(const char *key) override { records.recover(key); }
+  StorageJob::Status step(StorageJob &job, size_t budget) override;
+  using AlarmStorage::write;
+
+protected:
+  RecordStore records;
+};
+
+class SpiffsStorage : public FsStorage
+{
+public:
+  SpiffsStorage() : FsStorage(SPIFFS) {}
+  bool begin() override { return SPIFFS.begin(true); } // Format on failure
+  const char *name() const override { return "spiffs"; }
+};
+
+class LittleFsStorage : public FsStorage
+{
+public:
+  // The core mounts LittleFS on the "spiffs" partition unless told otherwise
+  LittleFsStorage(const char *partitionLabel = "spiffs") : FsStorage(LittleFS), partitionLabel(partitionLabel) {}
+  bool begin() override { return LittleFS.begin(true, "/littlefs", 10, partitionLabel); } // Format on failure
+  const char *name() const override { return "littlefs"; }
+
+private:
+  const char *partitionLabel;
+};
+
+// One NVS blob per key; NVS commits each entry atomically
+class NvsStorage : public AlarmStorage
+{
+public:
+  NvsStorage(const char *nvsNamespace = "alarmsched") : nvsNamespace(nvsNamespace) {}
+  ~NvsStorage() { prefs.end(); }
+  bool begin() override { return prefs.begin(nvsNamespace, false); }
+  const char *name() const override { return "nvs"; }
+  size_t size(const char *key) override;
+  size_t read(const char *key, uint8_t *buffer, size_t len) override;
+  bool write(const char *key, const uint8_t *data, size_t len) override;
+  bool remove(const char *key) override;
+  using AlarmStorage::write;
+
+private:
+  const char *nvsNamespace;
+  Preferences prefs;
+};
+
+// Log-structured ring of records on a raw data partition. Every write
+// appends a new version; the sector after the head is always kept erased by
+// relocating its live records, so wear is spread evenly over the partition.
+// Values are limited to one sector minus the record header.
+class PartitionRingStorage : public AlarmStorage
+{
+public:
+  PartitionRingStorage(const char *label = "alarms") : label(label), partition(nullptr), lock(nullptr), full(false) {}
+  bool begin() override; // Scans every record once to rebuild the index
+  bool readOnly() const { return full; } // Live data outgrew the ring; writes fail
+  const char *name() const override { return "ring"; }
+  size_t size(const char *key) override;
+  size_t read(const char *key, uint8_t *buffer, size_t len) override;
+  bool write(const char *key, const uint8_t *data, size_t len) override;
+  bool remove(const char *key) override;
+  size_t maxValueSize() const override { return RING_SECTOR_SIZE - sizeof(RecordHeader); }
+  using AlarmStorage::write;
+
+private:
+  struct RecordHeader
+  {
+    uint32_t magic;             // RECORD_MAGIC
+    uint32_t seq;               // Global write counter
+    char key[STORAGE_KEY_LEN];
+    uint16_t length;            // Payload bytes
+    uint16_t flags;             // RING_TOMBSTONE
+    uint32_t crc;               // CRC32 of the fields above and the payload
+  };
+  struct IndexEntry
+  {
+    char key[STORAGE_KEY_LEN]; // Empty = unused
+    uint32_t offset;           // Record header offset in the partition
+    uint16_t length;
+    uint16_t flags;
+    uint32_t seq;
+  };
+
+  const char *label;
+  const esp_partition_t *partition;
+  IndexEntry index[RING_MAX_KEYS];
+  uint32_t sectorCount;
+  uint32_t headSector; // Sector receiving appends
+  uint32_t headPos;    // Next append offset within headSector
+  uint32_t seq;
+  SemaphoreHandle_t lock; // Guards the index and the head; callers run on several tasks
+  bool full;              // A reclaim ran out of room; only reads are served
+
+  bool scan(); // begin() under the lock
+  IndexEntry *find(const char *key, bool create);
+  uint32_t liveBytes() const; // Flash taken by the newest record of every key
+  bool append(const char *key, const uint8_t *data, uint16_t len, uint16_t flags);
+  bool advance();
+  bool reclaim(uint32_t sector);
+  bool copyRecord(const IndexEntry &entry);
+  uint32_t recordCrc(const RecordHeader &header, const uint8_t *data) const;
+  uint32_t payloadCrc(const RecordHeader &header, uint32_t offset) const; // CRC of a stored record
+  uint32_t cleanTail(uint32_t sector) const;
+};
+
+#endif
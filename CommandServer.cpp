@@ -0,0 +1,404 @@
+#include "CommandServer.h"
+#include "AlarmScheduler.h"
+#include <mbedtls/sha1.h>
+#include <mbedtls/base64.h>
+
+static const char WEBSOCKET_GUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+// Writes a reply in framed pieces
+class ReplyWriter : public Print
+{
+public:
+  enum Framing : uint8_t
+  {
+    RAW,
+    HTTP_CHUNKED,
+    WEBSOCKET
+  };
+  ReplyWriter(Client &client, Framing framing) : client(client), framing(framing), used(0), fragments(0) {}
+  size_t write(uint8_t c) override
+  {
+    if (used == sizeof(buffer))
+      emit(false);
+    buffer[used++] = c;
+    return 1;
+  }
+  size_t write(const uint8_t *data, size_t len) override
+  {
+    for (size_t done = 0; done < len;)
+    {
+      if (used == sizeof(buffer))
+        emit(false);
+      size_t n = sizeof(buffer) - used;
+      if (n > len - done)
+        n = len - done;
+      memcpy(buffer + used, data + done, n);
+      used += n;
+      done += n;
+    }
+    return len;
+  }
+  void finish() { emit(true); }
+
+private:
+  Client &client;
+  Framing framing;
+  uint16_t used;
+  uint16_t fragments;
+  uint8_t buffer[COMMAND_CHUNK];
+
+  void emit(bool last)
+  {
+    if (framing == HTTP_CHUNKED)
+    {
+      if (used)
+      {
+        client.printf("%X\r\n", used);
+        client.write(buffer, used);
+        client.write((const uint8_t *)"\r\n", 2);
+      }
+      if (last)
+        client.write((const uint8_t *)"0\r\n\r\n", 5);
+    }
+    else if (framing == WEBSOCKET)
+    {
+      // A text message split into fragments; the last one may be empty
+      uint8_t header[4];
+      size_t headerLen = 2;
+      header[0] = (last ? 0x80 : 0x00) | (fragments ? 0x0 : 0x1);
+      if (used < 126)
+      {
+        header[1] = used;
+      }
+      else
+      {
+        header[1] = 126;
+        header[2] = used >> 8;
+        header[3] = used & 0xFF;
+        headerLen = 4;
+      }
+      client.write(header, headerLen);
+      client.write(buffer, used);
+      fragments++;
+    }
+    else if (used)
+    {
+      client.write(buffer, used);
+    }
+    used = 0;
+  }
+};
+
+void CommandSession::attach(Client *newClient, char *txBuffer)
+{
+  client = newClient;
+  tx = txBuffer;
+  mode = MODE_IDLE;
+  closing = false;
+  used = 0;
+  lastMs = millis();
+}
+
+void CommandSession::close()
+{
+  if (client)
+    client->stop();
+  client = nullptr;
+  used = 0;
+}
+
+void CommandSession::poll(AlarmScheduler &scheduler)
+{
+  if (!client)
+    return;
+  if (!client->connected() && !client->available())
+  {
+    close();
+    return;
+  }
+
+  int available = client->available();
+  if (available > 0 && used < COMMAND_RX_MAX)
+  {
+    size_t room = COMMAND_RX_MAX - used;
+    int n = client->read((uint8_t *)rx + used, (size_t)available < room ? available : room);
+    if (n > 0)
+    {
+      used += n;
+      lastMs = millis();
+    }
+  }
+
+  for (int i = 0; i < COMMAND_BURST && used && !closing; i++)
+  {
+    rx[used] = '\0';
+    if (mode == MODE_IDLE)
+      mode = rx[0] == '{' ? MODE_LINES : MODE_HTTP;
+    size_t consumed = mode == MODE_HTTP ? httpRequest(scheduler) : mode == MODE_WEBSOCKET ? websocketFrame(scheduler)
+                                                                                          : lineRequest(scheduler);
+    if (consumed == 0)
+      break;
+    memmove(rx, rx + consumed, used - consumed);
+    used -= consumed;
+  }
+
+  if (closing || millis() - lastMs > COMMAND_IDLE_MS)
+    close();
+}
+
+// Case-insensitive lookup in the header block, value trimmed
+bool CommandSession::header(size_t headerLen, const char *name, char *value, size_t len) const
+{
+  size_t nameLen = strlen(name);
+  const char *line = (const char *)memchr(rx, '\n', headerLen); // Skip the request line
+  while (line && line + 1 < rx + headerLen)
+  {
+    line++;
+    const char *end = (const char *)memchr(line, '\n', rx + headerLen - line);
+    if (!end)
+      break;
+    if ((size_t)(end - line) > nameLen && strncasecmp(line, name, nameLen) == 0 && line[nameLen] == ':')
+    {
+      const char *start = line + nameLen + 1;
+      while (start < end && *start == ' ')
+        start++;
+      const char *stop = end;
+      while (stop > start && (stop[-1] == '\r' || stop[-1] == ' '))
+        stop--;
+      size_t n = stop - start;
+      if (n >= len)
+        n = len - 1;
+      memcpy(value, start, n);
+      value[n] = '\0';
+      return true;
+    }
+    line = end;
+  }
+  return false;
+}
+
+void CommandSession::httpStatus(int code, const char *reason)
+{
+  client->printf("HTTP/1.1 %d %s\r\nContent-Length: 0\r\n%s\r\n", code, reason, closing ? "Connection: close\r\n" : "");
+}
+
+size_t CommandSession::httpRequest(AlarmScheduler &scheduler)
+{
+  const char *end = strstr(rx, "\r\n\r\n");
+  if (!end)
+  {
+    if (used == COMMAND_RX_MAX)
+    {
+      closing = true;
+      httpStatus(431, "Request Header Fields Too Large");
+      return used;
+    }
+    return 0;
+  }
+  size_t headerLen = end + 4 - rx;
+
+  char method[8] = "", path[32] = "", version[10] = "";
+  sscanf(rx, "%7s %31s %9s", method, path, version);
+  char value[40];
+  size_t bodyLen = header(headerLen, "Content-Length", value, sizeof(value)) ? strtoul(value, nullptr, 10) : 0;
+  if (strcmp(version, "HTTP/1.0") == 0 || (header(headerLen, "Connection", value, sizeof(value)) && strcasecmp(value, "close") == 0))
+    closing = true;
+  if (bodyLen > COMMAND_RX_MAX - headerLen)
+  {
+    closing = true;
+    httpStatus(413, "Payload Too Large");
+    return used;
+  }
+  if (used < headerLen + bodyLen)
+    return 0;
+
+  if (strcmp(method, "GET") == 0 && strcmp(path, "/ws") == 0 &&
+      header(headerLen, "Upgrade", value, sizeof(value)) && strcasecmp(value, "websocket") == 0 &&
+      header(headerLen, "Sec-WebSocket-Key", value, sizeof(value)))
+  {
+    // Accept = base64(SHA-1(key + GUID))
+    char keyGuid[sizeof(value) + sizeof(WEBSOCKET_GUID)];
+    snprintf(keyGuid, sizeof(keyGuid), "%s%s", value, WEBSOCKET_GUID);
+    unsigned char digest[20];
+    unsigned char accept[32];
+    size_t acceptLen = 0;
+    mbedtls_sha1((const unsigned char *)keyGuid, strlen(keyGuid), digest);
+    mbedtls_base64_encode(accept, sizeof(accept) - 1, &acceptLen, digest, sizeof(digest));
+    accept[acceptLen] = '\0';
+    client->printf("HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                   "Sec-WebSocket-Accept: %s\r\n\r\n",
+                   (const char *)accept);
+    closing = false;
+    mode = MODE_WEBSOCKET;
+    return headerLen;
+  }
+  if (strcmp(path, "/command") != 0)
+  {
+    httpStatus(404, "Not Found");
+    return headerLen + bodyLen;
+  }
+  if (strcmp(method, "POST") != 0)
+  {
+    httpStatus(405, "Method Not Allowed");
+    return headerLen + bodyLen;
+  }
+
+  answer(scheduler, rx + headerLen, bodyLen, ReplyWriter::HTTP_CHUNKED);
+  return headerLen + bodyLen;
+}
+
+void CommandSession::answer(AlarmScheduler &scheduler, const char *json, size_t len, uint8_t framing)
+{
+  // processJson() holds the request lock; the socket is written after it
+  BufferSink reply(tx, COMMAND_TX_MAX);
+  scheduler.processJson(json, len, reply);
+  size_t replyBytes = reply.length();
+  if (reply.overflowed())
+    replyBytes = snprintf(tx, COMMAND_TX_MAX, "{\"status\":\"error\",\"message\":\"Reply too large for COMMAND_TX_MAX\"}\r\n");
+
+  if (framing == ReplyWriter::HTTP_CHUNKED)
+    client->printf("HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nTransfer-Encoding: chunked\r\n%s\r\n",
+                   closing ? "Connection: close\r\n" : "");
+  ReplyWriter writer(*client, (ReplyWriter::Framing)framing);
+  writer.write((const uint8_t *)tx, replyBytes);
+  writer.finish();
+}
+
+void CommandSession::websocketClose(uint16_t code)
+{
+  uint8_t frame[4] = {0x88, 2, (uint8_t)(code >> 8), (uint8_t)(code & 0xFF)};
+  client->write(frame, sizeof(frame));
+  closing = true;
+}
+
+size_t CommandSession::websocketFrame(AlarmScheduler &scheduler)
+{
+  if (used < 2)
+    return 0;
+  uint8_t *frame = (uint8_t *)rx;
+  bool fin = frame[0] & 0x80;
+  uint8_t opcode = frame[0] & 0x0F;
+  size_t len = frame[1] & 0x7F;
+  size_t pos = 2;
+  if (!(frame[1] & 0x80))
+  {
+    websocketClose(1002); // Client frames must be masked
+    return used;
+  }
+  if (len == 126)
+  {
+    if (used < 4)
+      return 0;
+    len = (frame[2] << 8) | frame[3];
+    pos = 4;
+  }
+  if (len == 127 || pos + 4 + len > COMMAND_RX_MAX || (opcode == 0x1 && !fin) || opcode == 0x0)
+  {
+    websocketClose(1009); // Commands are single text frames up to the receive buffer
+    return used;
+  }
+  if (used < pos + 4 + len)
+    return 0;
+
+  uint8_t *mask = frame + pos;
+  uint8_t *payload = mask + 4;
+  for (size_t i = 0; i < len; i++)
+    payload[i] ^= mask[i & 3];
+
+  if (opcode == 0x1)
+  {
+    answer(scheduler, (const char *)payload, len, ReplyWriter::WEBSOCKET);
+  }
+  else if (opcode == 0x8)
+  {
+    websocketClose(1000);
+  }
+  else if (opcode == 0x9 && len <= 125)
+  {
+    uint8_t pong[2] = {0x8A, (uint8_t)len};
+    client->write(pong, 2);
+    client->write(payload, len);
+  }
+  else if (opcode != 0xA)
+  {
+    websocketClose(1003);
+  }
+  return pos + 4 + len;
+}
+
+size_t CommandSession::lineRequest(AlarmScheduler &scheduler)
+{
+  const char *newline = (const char *)memchr(rx, '\n', used);
+  if (!newline)
+  {
+    if (used == COMMAND_RX_MAX)
+      closing = true; // A line longer than the buffer cannot be a command
+    return 0;
+  }
+  size_t len = newline - rx;
+  if (len && rx[len - 1] == '\r')
+    len--;
+  if (len)
+  {
+    answer(scheduler, rx, len, ReplyWriter::RAW);
+  }
+  return newline - rx + 1;
+}
+
+CommandServer::CommandServer(AlarmScheduler &scheduler, uint16_t port) : scheduler(scheduler), server(port, COMMAND_MAX_CLIENTS), task(nullptr) {}
+
+void CommandServer::begin()
+{
+  server.begin();
+  server.setNoDelay(true);
+}
+
+void CommandServer::poll()
+{
+  while (server.hasClient())
+  {
+    int slot = -1;
+    for (int i = 0; i < COMMAND_MAX_CLIENTS && slot < 0; i++)
+      if (!sessions[i].active())
+        slot = i;
+    if (slot < 0)
+    {
+      WiFiClient extra = server.available();
+      extra.print("HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+      extra.stop();
+      ALARM_LOGW("Command server full, connection refused");
+      continue;
+    }
+    sockets[slot] = server.available();
+    sessions[slot].attach(&sockets[slot], tx);
+  }
+
+  for (int i = 0; i < COMMAND_MAX_CLIENTS; i++)
+    sessions[i].poll(scheduler);
+}
+
+uint8_t CommandServer::clients() const
+{
+  uint8_t n = 0;
+  for (int i = 0; i < COMMAND_MAX_CLIENTS; i++)
+    if (sessions[i].active())
+      n++;
+  return n;
+}
+
+bool CommandServer::startTask(uint32_t stackSize, UBaseType_t priority)
+{
+  if (task)
+    return true;
+  return xTaskCreate(taskEntry, "alarm_cmd", stackSize, this, priority, &task) == pdPASS;
+}
+
+void CommandServer::taskEntry(void *arg)
+{
+  CommandServer *self = static_cast<CommandServer *>(arg);
+  for (;;)
+  {
+    self->poll();
+    vTaskDelay(pdMS_TO_TICKS(5));
+  }
+}
@@ -0,0 +1,81 @@
+#ifndef COMMAND_SERVER_H
+#define COMMAND_SERVER_H
+
+#include <Arduino.h>
+#include <WiFi.h>
+
+#define COMMAND_MAX_CLIENTS 4 // Concurrent connections; more are answered 503 and closed
+#define COMMAND_RX_MAX 1536   // Buffered bytes per connection: headers and body, or one frame
+#define COMMAND_TX_MAX 16384  // Largest reply; a longer one is replaced by an error
+#define COMMAND_CHUNK 256     // Reply bytes per HTTP chunk or WebSocket fragment
+#define COMMAND_IDLE_MS 30000 // Idle connections are closed
+#define COMMAND_BURST 4       // Pipelined requests answered per connection per poll
+
+class AlarmScheduler;
+
+// One connection. Bytes are buffered until a whole request is present and
+// requests are answered in arrival order, so a client may pipeline them.
+// The first bytes pick the framing:
+//   POST /command     HTTP/1.1 keep-alive, the body is one command
+//   GET /ws (Upgrade) WebSocket, one command per text message
+//   '{'               newline-delimited JSON, like the Serial console
+// A reply is built in the server's transmit buffer and only then written
+// out in COMMAND_CHUNK pieces, so a slow client never holds the
+// scheduler's request lock. Works on any Client.
+class CommandSession
+{
+public:
+  CommandSession() : client(nullptr), tx(nullptr), mode(MODE_IDLE), closing(false), used(0), lastMs(0) {}
+  void attach(Client *client, char *tx); // tx: COMMAND_TX_MAX bytes, shared by sessions polled in turn
+  bool active() const { return client != nullptr; }
+  void poll(AlarmScheduler &scheduler); // Reads what is available and answers complete requests
+  void close();
+
+private:
+  enum Mode : uint8_t
+  {
+    MODE_IDLE,
+    MODE_HTTP,
+    MODE_WEBSOCKET,
+    MODE_LINES
+  };
+  Client *client;
+  char *tx;
+  Mode mode;
+  bool closing; // Close once the current replies are written
+  uint16_t used;
+  uint32_t lastMs; // millis() of the last received byte
+  char rx[COMMAND_RX_MAX + 1];
+  size_t httpRequest(AlarmScheduler &scheduler); // Each returns bytes consumed, 0 = incomplete
+  size_t websocketFrame(AlarmScheduler &scheduler);
+  size_t lineRequest(AlarmScheduler &scheduler);
+  void answer(AlarmScheduler &scheduler, const char *json, size_t len, uint8_t framing); // Runs a command, then sends the reply
+  bool header(size_t headerLen, const char *name, char *value, size_t len) const;
+  void httpStatus(int code, const char *reason);
+  void websocketClose(uint16_t code);
+};
+
+// Listens on a WiFiServer and serves up to COMMAND_MAX_CLIENTS sessions.
+// poll() never waits for a client; call it from loop() or let startTask()
+// run it. Memory is fixed: one receive buffer per session and one
+// transmit buffer.
+class CommandServer
+{
+public:
+  CommandServer(AlarmScheduler &scheduler, uint16_t port = 80);
+  void begin();
+  void poll();
+  bool startTask(uint32_t stackSize = 6144, UBaseType_t priority = 1); // Polls every few ms on its own task
+  uint8_t clients() const;
+
+private:
+  AlarmScheduler &scheduler;
+  WiFiServer server;
+  WiFiClient sockets[COMMAND_MAX_CLIENTS];
+  CommandSession sessions[COMMAND_MAX_CLIENTS];
+  char tx[COMMAND_TX_MAX];
+  TaskHandle_t task;
+  static void taskEntry(void *arg);
+};
+
+#endif
@@ -0,0 +1,222 @@
+#include "EventHistory.h"
+
+EventHistory::EventHistory() : head(0), count(0), nextSeq(0), sortedSeq(0), storage(nullptr), spilledSeq(0), nextBlockSeq(0)
+{
+  memset(blocks, 0, sizeof(blocks));
+  memset(&packed, 0, sizeof(packed));
+}
+
+void EventHistory::blockKey(uint32_t blockSeq, char *key, size_t len)
+{
+  snprintf(key, len, "/h%u", (unsigned)(blockSeq % HISTORY_FLASH_BLOCKS));
+}
+
+// Reads a block into readBuffer and returns its event count, 0 = missing/invalid
+size_t EventHistory::loadBlock(uint32_t blockSeq)
+{
+  char key[8];
+  blockKey(blockSeq, key, sizeof(key));
+  size_t len = storage->read(key, readBuffer, sizeof(readBuffer));
+  if (len < sizeof(BlockHeader))
+    return 0;
+  BlockHeader header;
+  memcpy(&header, readBuffer, sizeof(header));
+  if (header.count == 0 || header.count > HISTORY_BLOCK_EVENTS || header.eventSize != sizeof(HistoryEvent) ||
+      len != sizeof(BlockHeader) + header.count * sizeof(HistoryEvent))
+    return 0;
+  return header.count;
+}
+
+void EventHistory::begin(AlarmStorage *backend)
+{
+  storage = backend;
+  if (!storage)
+    return;
+
+  // One read per block slot; continue numbering after the newest one
+  for (uint32_t k = 0; k < HISTORY_FLASH_BLOCKS; k++)
+  {
+    size_t n = loadBlock(k);
+    if (n == 0)
+      continue;
+    BlockHeader header;
+    memcpy(&header, readBuffer, sizeof(header));
+    const HistoryEvent *events = (const HistoryEvent *)(readBuffer + sizeof(BlockHeader));
+    BlockIndex &entry = blocks[header.blockSeq % HISTORY_FLASH_BLOCKS];
+    entry.blockSeq = header.blockSeq;
+    entry.firstSeq = events[0].seq;
+    entry.count = n;
+    entry.minTime = entry.maxTime = events[0].time;
+    for (size_t i = 1; i < n; i++)
+    {
+      if (events[i].time < entry.minTime)
+        entry.minTime = events[i].time;
+      if (events[i].time > entry.maxTime)
+        entry.maxTime = events[i].time;
+    }
+    if (events[n - 1].seq >= nextSeq)
+      nextSeq = events[n - 1].seq + 1;
+    if (header.blockSeq >= nextBlockSeq)
+      nextBlockSeq = header.blockSeq + 1;
+  }
+  spilledSeq = sortedSeq = nextSeq;
+}
+
+void EventHistory::record(uint32_t time, uint8_t zone, uint32_t alarmId, const char *action, uint8_t lateness, uint32_t callbackUs)
+{
+  if (count && time < at(count - 1).time)
+    sortedSeq = nextSeq;
+  HistoryEvent &event = ring[head];
+  event.seq = nextSeq++;
+  event.time = time;
+  event.callbackUs = callbackUs;
+  event.alarmId = alarmId;
+  event.zone = zone;
+  event.lateness = lateness;
+  event.reserved = 0;
+  snprintf(event.action, sizeof(event.action), "%s", action);
+  head = (head + 1) % HISTORY_SIZE;
+  if (count < HISTORY_SIZE)
+    count++;
+}
+
+uint16_t EventHistory::lowerBound(uint32_t from, uint16_t first) const
+{
+  uint16_t lo = first, hi = count;
+  while (lo < hi)
+  {
+    uint16_t mid = (lo + hi) / 2;
+    if (at(mid).time < from)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+size_t EventHistory::query(uint32_t from, uint32_t to, uint8_t zone, HistoryEvent *out, size_t max, bool *more)
+{
+  size_t n = 0;
+  *more = false;
+  uint32_t ramFirst = count ? at(0).seq : nextSeq;
+
+  // Stored blocks older than the ring, in block order, skipping those outside the range
+  if (storage)
+  {
+    bool visited[HISTORY_FLASH_BLOCKS] = {false};
+    for (;;)
+    {
+      int next = -1;
+      for (int i = 0; i < HISTORY_FLASH_BLOCKS; i++)
+      {
+        const BlockIndex &b = blocks[i];
+        if (visited[i] || !b.count || b.firstSeq >= ramFirst || b.maxTime < from || b.minTime > to)
+          continue;
+        if (next < 0 || b.blockSeq < blocks[next].blockSeq)
+          next = i;
+      }
+      if (next < 0)
+        break;
+      visited[next] = true;
+      size_t stored = loadBlock(blocks[next].blockSeq);
+      const HistoryEvent *events = (const HistoryEvent *)(readBuffer + sizeof(BlockHeader));
+      for (size_t i = 0; i < stored; i++)
+      {
+        const HistoryEvent &event = events[i];
+        if (event.seq >= ramFirst || event.time < from || event.time > to || (zone && event.zone != zone))
+          continue;
+        if (n == max)
+        {
+          *more = true;
+          return n;
+        }
+        out[n++] = event;
+      }
+    }
+  }
+
+  // Events before a backwards clock step are scanned; the rest are binary-searched
+  uint16_t sorted = sortedSeq > ramFirst ? sortedSeq - ramFirst : 0;
+  for (uint16_t i = 0; i < count; i++)
+  {
+    if (i == sorted)
+      i = lowerBound(from, sorted);
+    if (i >= count)
+      break;
+    const HistoryEvent &event = at(i);
+    if (event.time > to)
+    {
+      if (i >= sorted)
+        break;
+      continue;
+    }
+    if (event.time < from || (zone && event.zone != zone))
+      continue;
+    if (n == max)
+    {
+      *more = true;
+      return n;
+    }
+    out[n++] = event;
+  }
+  return n;
+}
+
+bool EventHistory::spillDue() const
+{
+  return storage && nextSeq - spilledSeq >= HISTORY_BLOCK_EVENTS;
+}
+
+size_t EventHistory::packBlock(bool partial)
+{
+  if (!storage)
+    return 0;
+  // Events that left the ring before being spilled are lost to storage
+  uint32_t ramFirst = count ? at(0).seq : nextSeq;
+  if (spilledSeq < ramFirst)
+    spilledSeq = ramFirst;
+  uint32_t pending = nextSeq - spilledSeq;
+  if (pending == 0 || (!partial && pending < HISTORY_BLOCK_EVENTS))
+    return 0;
+  uint16_t n = pending < HISTORY_BLOCK_EVENTS ? pending : HISTORY_BLOCK_EVENTS;
+  // A partial block already stored with these events needs no rewrite
+  const BlockIndex &stored = blocks[nextBlockSeq % HISTORY_FLASH_BLOCKS];
+  if (stored.count == n && stored.blockSeq == nextBlockSeq && stored.firstSeq == spilledSeq)
+    return 0;
+
+  BlockHeader header = {nextBlockSeq, n, sizeof(HistoryEvent)};
+  memcpy(blockBuffer, &header, sizeof(header));
+  HistoryEvent *events = (HistoryEvent *)(blockBuffer + sizeof(BlockHeader));
+  uint16_t first = spilledSeq - ramFirst;
+  packed.blockSeq = nextBlockSeq;
+  packed.firstSeq = spilledSeq;
+  packed.count = n;
+  packed.minTime = packed.maxTime = at(first).time;
+  for (uint16_t i = 0; i < n; i++)
+  {
+    events[i] = at(first + i);
+    if (events[i].time < packed.minTime)
+      packed.minTime = events[i].time;
+    if (events[i].time > packed.maxTime)
+      packed.maxTime = events[i].time;
+  }
+  return sizeof(BlockHeader) + n * sizeof(HistoryEvent);
+}
+
+bool EventHistory::writeBlock(size_t len)
+{
+  char key[8];
+  blockKey(packed.blockSeq, key, sizeof(key));
+  return storage->write(key, blockBuffer, len);
+}
+
+bool EventHistory::commitBlock()
+{
+  // The oldest block's slot is reused; a partial block is rewritten until full
+  blocks[packed.blockSeq % HISTORY_FLASH_BLOCKS] = packed;
+  if (packed.count < HISTORY_BLOCK_EVENTS)
+    return false;
+  spilledSeq = packed.firstSeq + packed.count;
+  nextBlockSeq++;
+  return true;
+}
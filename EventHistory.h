@@ -0,0 +1,78 @@
+#ifndef EVENT_HISTORY_H
+#define EVENT_HISTORY_H
+
+#include <Arduino.h>
+#include "AlarmStorage.h"
+
+#define HISTORY_SIZE 64         // Fired events kept in RAM
+#define HISTORY_ACTION_LEN 24   // Action prefix kept per event, incl. terminator
+#define HISTORY_BLOCK_EVENTS 16 // Events per spilled block
+#define HISTORY_FLASH_BLOCKS 8  // Blocks kept in storage ("/h0".."/h7")
+#define HISTORY_QUERY_MAX 24    // Events per history response
+
+struct HistoryEvent
+{
+  uint32_t seq;        // Increasing; continues across reboots when spilled
+  uint32_t time;       // UTC of the dispatch
+  uint32_t callbackUs; // Zone callback duration
+  uint32_t alarmId;    // Stable alarm id; slots are reused
+  uint8_t zone;        // 1–4
+  uint8_t lateness;    // Seconds past the alarm's minute
+  uint16_t reserved;
+  char action[HISTORY_ACTION_LEN];
+};
+
+// Audit log of fired alarms. A RAM ring in firing order, optionally spilled
+// to storage in fixed binary blocks whose time span is indexed in RAM, so a
+// range query binary-searches the ring and reads only overlapping blocks.
+// Guarded by the scheduler's state lock, except writeBlock().
+class EventHistory
+{
+public:
+  EventHistory();
+  void begin(AlarmStorage *storage); // nullptr keeps the history in RAM; otherwise indexes stored blocks
+  void record(uint32_t time, uint8_t zone, uint32_t alarmId, const char *action, uint8_t lateness, uint32_t callbackUs);
+  size_t query(uint32_t from, uint32_t to, uint8_t zone, HistoryEvent *out, size_t max, bool *more); // Oldest first, zone 0 = all
+  uint16_t size() const { return count; }       // Events in RAM
+  uint32_t total() const { return nextSeq; }    // Events recorded so far
+
+  // Spilling, driven by the persist task under the flush lock
+  bool spillDue() const;          // A full block is waiting
+  size_t packBlock(bool partial); // Copy unspilled events into the block buffer, 0 = nothing to write
+  bool writeBlock(size_t len);    // Without the state lock
+  bool commitBlock();             // Index the written block; true if it was full
+
+private:
+  struct BlockHeader
+  {
+    uint32_t blockSeq;
+    uint16_t count;
+    uint16_t eventSize; // sizeof(HistoryEvent) when written; older layouts are skipped
+  };
+  struct BlockIndex
+  {
+    uint32_t blockSeq;
+    uint32_t firstSeq;
+    uint32_t minTime;
+    uint32_t maxTime;
+    uint16_t count; // 0 = slot unused
+  };
+  HistoryEvent ring[HISTORY_SIZE];
+  uint16_t head;       // Next write position
+  uint16_t count;
+  uint32_t nextSeq;
+  uint32_t sortedSeq;  // Events from this seq on are in time order (the clock may step back)
+  AlarmStorage *storage;
+  uint32_t spilledSeq; // First event not yet in a complete block
+  uint32_t nextBlockSeq;
+  BlockIndex blocks[HISTORY_FLASH_BLOCKS];
+  BlockIndex packed;   // Entry for the block in blockBuffer
+  uint8_t blockBuffer[sizeof(BlockHeader) + HISTORY_BLOCK_EVENTS * sizeof(HistoryEvent)]; // Packed for writing
+  uint8_t readBuffer[sizeof(BlockHeader) + HISTORY_BLOCK_EVENTS * sizeof(HistoryEvent)];  // Read by queries
+  const HistoryEvent &at(uint16_t i) const { return ring[(head + HISTORY_SIZE - count + i) % HISTORY_SIZE]; } // i-th oldest
+  uint16_t lowerBound(uint32_t from, uint16_t first) const;
+  size_t loadBlock(uint32_t blockSeq);
+  static void blockKey(uint32_t blockSeq, char *key, size_t len);
+};
+
+#endif
@@ -0,0 +1,43 @@
+#include <AlarmScheduler.h>
+#include <CommandServer.h>
+#include <MqttCommandClient.h>
+
+const char *ssid = "your_ssid";
+const char *password = "your_password";
+
+AlarmScheduler scheduler;
+CommandServer server(scheduler, 80); // HTTP POST /command, WebSocket /ws, or raw JSON lines
+WiFiClient mqttSocket;
+MqttCommandClient mqtt(scheduler, mqttSocket);
+
+void zone1Callback(void *context, int id, const char *action, JsonObject &zoneData) {
+  Serial.printf("Zone %d: %s\n", id, action);
+}
+
+void setup() {
+  Serial.begin(115200);
+  WiFi.begin(ssid, password);
+  while (WiFi.status() != WL_CONNECTED)
+    delay(500);
+  Serial.printf("Commands on http://%s/command\n", WiFi.localIP().toString().c_str());
+
+  scheduler.begin(16, 13, 14); // DS1302: RST=16, DAT=13, CLK=14
+  scheduler.registerZone(1, zone1Callback, nullptr);
+
+  // curl -d '{"command":"list"}' http://<ip>/command
+  server.begin();
+  server.startTask();
+
+  // mosquitto_pub -t alarms/cmd/phone -m '{"command":"time"}'; the reply arrives on alarms/reply/phone
+  mqtt.begin("192.168.1.10", 1883, "alarm-scheduler", "alarms");
+  mqtt.startTask();
+}
+
+void loop() {
+  // The Serial console keeps working alongside the network front-ends
+  if (Serial.available()) {
+    String json = Serial.readStringUntil('\n');
+    scheduler.processJson(json);
+  }
+  scheduler.waitAndDispatch(1000);
+}
@@ -0,0 +1,48 @@
+#include <AlarmScheduler.h>
+
+AlarmScheduler scheduler;
+
+// Each zone drives its own valve object; no globals or lookup tables in the handler
+class Valve {
+public:
+  Valve(uint8_t pin) : pin(pin) {}
+  void begin() {
+    pinMode(pin, OUTPUT);
+    digitalWrite(pin, LOW);
+  }
+  void onAlarm(int id, const char *action, JsonObject &zoneData) {
+    bool open = strcmp(action, "ON") == 0;
+    digitalWrite(pin, open ? HIGH : LOW);
+    Serial.printf("Zone %d valve on GPIO %u %s\n", id, pin, open ? "opened" : "closed");
+  }
+
+private:
+  uint8_t pin;
+};
+
+Valve valves[2] = {Valve(5), Valve(18)};
+int fireCount = 0;
+
+// Context-pointer form for plain C-style handlers
+void countFires(void *context, int id, const char *action, JsonObject &zoneData) {
+  (*static_cast<int *>(context))++;
+}
+
+void setup() {
+  Serial.begin(115200);
+  for (Valve &valve : valves)
+    valve.begin();
+  scheduler.begin(16, 13, 14); // DS1302: RST=16, DAT=13, CLK=14
+  scheduler.registerZone(1, ZoneCallback::method<Valve, &Valve::onAlarm>(&valves[0]));
+  scheduler.registerZone(2, ZoneCallback::method<Valve, &Valve::onAlarm>(&valves[1]));
+  scheduler.registerZone(3, countFires, &fireCount);
+  Serial.println("Object Callbacks Example Started");
+}
+
+void loop() {
+  if (Serial.available()) {
+    String json = Serial.readStringUntil('\n');
+    scheduler.processJson(json);
+  }
+  scheduler.checkAlarms();
+}
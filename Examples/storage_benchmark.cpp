@@ -0,0 +1,72 @@
+#include <AlarmScheduler.h>
+
+// Times the scheduler's storage access pattern on each backend: one
+// alarms.json rewrite per flush and one zone_data read per fired alarm.
+// It only writes keys and partitions of its own, so a device's schedule
+// survives. LittleFS and the ring backend need partitions labelled
+// "benchfs" and "benchring" in the partition table (the ring needs at
+// least 3 sectors), e.g.
+//   benchfs,   data, spiffs, , 0x20000,
+//   benchring, data, 0x99,   , 0x10000,
+// LittleFS formats "benchfs" if it does not mount; nothing else is formatted.
+
+SpiffsStorage spiffsStorage;
+LittleFsStorage littleFsStorage("benchfs");
+NvsStorage nvsStorage("alarmbench");
+PartitionRingStorage ringStorage("benchring");
+
+const int FLUSHES = 50;
+const int FIRES = 200;
+const char *ALARMS_KEY = "/bench_a.json";
+const char *ZONE_DATA_KEY = "/bench_z.json";
+
+String makePayload(size_t len) {
+  String s = "{\"zone_data\":[{\"zone_id\":1,\"alarm_id\":0,\"data\":\"";
+  while (s.length() < len - 4)
+    s += 'x';
+  s += "\"}]}";
+  return s;
+}
+
+void benchmark(AlarmStorage &storage) {
+  if (!storage.begin()) {
+    Serial.println(String(storage.name()) + ": begin failed, skipped");
+    return;
+  }
+  String alarms = makePayload(2048);  // ~40 alarms
+  String zoneData = makePayload(256); // One alarm's payload
+  uint32_t bytesBefore = storage.bytesWritten();
+  uint32_t erasesBefore = storage.eraseCount();
+
+  unsigned long start = micros();
+  for (int i = 0; i < FLUSHES; i++)
+    storage.write(ALARMS_KEY, alarms);
+  unsigned long writeUs = (micros() - start) / FLUSHES;
+
+  storage.write(ZONE_DATA_KEY, zoneData);
+  DynamicJsonDocument doc(1024);
+  start = micros();
+  for (int i = 0; i < FIRES; i++)
+    storage.readJson(ZONE_DATA_KEY, doc);
+  unsigned long readUs = (micros() - start) / FIRES;
+
+  Serial.printf("%-8s write %6lu us  read %6lu us  programmed %7u B  erased %4u sectors\n",
+                storage.name(), writeUs, readUs,
+                storage.bytesWritten() - bytesBefore, storage.eraseCount() - erasesBefore);
+  storage.remove(ALARMS_KEY);
+  storage.remove(ZONE_DATA_KEY);
+}
+
+void setup() {
+  Serial.begin(115200);
+  delay(1000);
+  Serial.println("Storage benchmark: " + String(FLUSHES) + " flushes, " + String(FIRES) + " fires");
+  benchmark(spiffsStorage);
+  Serial.println("Warning: the \"benchfs\" partition is formatted if it holds no LittleFS");
+  benchmark(littleFsStorage);
+  benchmark(nvsStorage);
+  benchmark(ringStorage);
+}
+
+void loop() {
+}
@@ -0,0 +1,292 @@
+#include "MqttCommandClient.h"
+#include "AlarmScheduler.h"
+
+#define MQTT_CONNECT 0x10
+#define MQTT_CONNACK 0x2
+#define MQTT_PUBLISH 0x3
+#define MQTT_PUBACK 0x40
+#define MQTT_SUBSCRIBE 0x82
+#define MQTT_SUBACK 0x9
+#define MQTT_PINGREQ 0xC0
+#define MQTT_DISCONNECT 0xE0
+#define MQTT_CONNACK_TIMEOUT_MS 10000
+
+MqttCommandClient::MqttCommandClient(AlarmScheduler &scheduler, Client &client)
+    : scheduler(scheduler), client(client), host(nullptr), port(1883), clientId(nullptr), prefix(nullptr), user(nullptr), password(nullptr),
+      state(STATE_OFFLINE), lastAttemptMs(0), lastSendMs(0), lastReceiveMs(0), skip(0), droppedCommands(0), used(0), nextPacketId(1), task(nullptr) {}
+
+void MqttCommandClient::begin(const char *newHost, uint16_t newPort, const char *newClientId, const char *newPrefix,
+                              const char *newUser, const char *newPassword)
+{
+  host = newHost;
+  port = newPort;
+  clientId = newClientId;
+  prefix = newPrefix;
+  user = newUser;
+  password = newPassword;
+  lastAttemptMs = millis() - MQTT_RETRY_MS; // First poll() connects
+}
+
+size_t MqttCommandClient::putString(uint8_t *out, const char *s, size_t len)
+{
+  out[0] = len >> 8;
+  out[1] = len & 0xFF;
+  memcpy(out + 2, s, len);
+  return len + 2;
+}
+
+void MqttCommandClient::send(uint8_t type, const uint8_t *body, size_t len)
+{
+  uint8_t header[5];
+  size_t n = 0;
+  header[n++] = type;
+  size_t remaining = len; // Variable-length encoding, 7 bits per byte
+  do
+  {
+    uint8_t digit = remaining % 128;
+    remaining /= 128;
+    header[n++] = digit | (remaining ? 0x80 : 0);
+  } while (remaining);
+  client.write(header, n);
+  if (len)
+    client.write(body, len);
+  lastSendMs = millis();
+}
+
+bool MqttCommandClient::connect()
+{
+  size_t idLen = strlen(clientId), userLen = user ? strlen(user) : 0, passLen = password ? strlen(password) : 0;
+  if (12 + idLen + 2 + userLen + 2 + passLen > sizeof(tx) || strlen(prefix) + 8 > MQTT_TOPIC_MAX)
+    return false;
+  if (!client.connect(host, port))
+    return false;
+
+  static const uint8_t protocol[] = {0, 4, 'M', 'Q', 'T', 'T', 4};
+  size_t n = 0;
+  memcpy(tx, protocol, sizeof(protocol));
+  n += sizeof(protocol);
+  tx[n++] = 0x02 | (user ? 0x80 : 0) | (password ? 0x40 : 0); // Clean session
+  tx[n++] = 0;
+  tx[n++] = MQTT_KEEPALIVE_S;
+  n += putString(tx + n, clientId, idLen);
+  if (user)
+    n += putString(tx + n, user, userLen);
+  if (password)
+    n += putString(tx + n, password, passLen);
+  send(MQTT_CONNECT, tx, n);
+  state = STATE_CONNECTING;
+  used = 0;
+  skip = 0;
+  lastReceiveMs = millis();
+  return true;
+}
+
+void MqttCommandClient::disconnect()
+{
+  if (state == STATE_READY && client.connected())
+    send(MQTT_DISCONNECT, nullptr, 0);
+  client.stop();
+  state = STATE_OFFLINE;
+  used = 0;
+  skip = 0;
+}
+
+void MqttCommandClient::poll()
+{
+  uint32_t nowMs = millis();
+  if (state != STATE_OFFLINE && !client.connected())
+  {
+    ALARM_LOGW("MQTT connection lost");
+    disconnect();
+  }
+  if (state == STATE_OFFLINE)
+  {
+    if (!host || nowMs - lastAttemptMs < MQTT_RETRY_MS)
+      return;
+    lastAttemptMs = nowMs;
+    if (!connect())
+    {
+      client.stop();
+      ALARM_LOGW("MQTT connect to %s:%u failed", host, port);
+    }
+    return;
+  }
+
+  int available = client.available();
+  if (available > 0 && skip)
+  {
+    // Discard the rest of an oversized packet through the empty receive buffer
+    size_t n = client.read(rx, skip < sizeof(rx) ? skip : sizeof(rx));
+    skip -= n;
+    lastReceiveMs = nowMs;
+  }
+  else if (available > 0 && used < sizeof(rx))
+  {
+    size_t room = sizeof(rx) - used;
+    int n = client.read(rx + used, (size_t)available < room ? available : room);
+    if (n > 0)
+    {
+      used += n;
+      lastReceiveMs = nowMs;
+    }
+  }
+
+  while (used && state != STATE_OFFLINE)
+  {
+    size_t n = handlePacket();
+    if (n == 0)
+      break;
+    memmove(rx, rx + n, used - n);
+    used -= n;
+  }
+
+  if (state == STATE_CONNECTING && nowMs - lastAttemptMs > MQTT_CONNACK_TIMEOUT_MS)
+  {
+    ALARM_LOGW("MQTT broker did not answer CONNECT");
+    disconnect();
+  }
+  else if (state == STATE_READY)
+  {
+    if (nowMs - lastSendMs > MQTT_KEEPALIVE_S * 500UL)
+      send(MQTT_PINGREQ, nullptr, 0);
+    if (nowMs - lastReceiveMs > MQTT_KEEPALIVE_S * 1500UL)
+    {
+      ALARM_LOGW("MQTT broker silent, reconnecting");
+      disconnect();
+    }
+  }
+}
+
+size_t MqttCommandClient::handlePacket()
+{
+  if (used < 2)
+    return 0;
+  size_t len = 0, pos = 1, mult = 1;
+  uint8_t digit;
+  do
+  {
+    if (pos >= used)
+      return 0;
+    if (pos > 4)
+    {
+      disconnect(); // Malformed remaining length
+      return 0;
+    }
+    digit = rx[pos++];
+    len += (digit & 0x7F) * mult;
+    mult *= 128;
+  } while (digit & 0x80);
+
+  size_t total = pos + len;
+  if (total > sizeof(rx))
+  {
+    skip = total - used;
+    droppedCommands++;
+    ALARM_LOGW("MQTT packet of %u bytes dropped", (unsigned)total);
+    return used;
+  }
+  if (used < total)
+    return 0;
+
+  const uint8_t *body = rx + pos;
+  switch (rx[0] >> 4)
+  {
+  case MQTT_CONNACK:
+    if (len >= 2 && body[1] == 0)
+    {
+      char topic[MQTT_TOPIC_MAX];
+      int topicLen = snprintf(topic, sizeof(topic), "%s/cmd/#", prefix);
+      size_t n = 0;
+      tx[n++] = nextPacketId >> 8;
+      tx[n++] = nextPacketId & 0xFF;
+      nextPacketId++;
+      n += putString(tx + n, topic, topicLen);
+      tx[n++] = 0; // QoS 0
+      send(MQTT_SUBSCRIBE, tx, n);
+      state = STATE_READY;
+      ALARM_LOGI("MQTT connected to %s:%u", host, port);
+    }
+    else
+    {
+      ALARM_LOGE("MQTT broker refused connection (code %u)", len >= 2 ? body[1] : 0);
+      disconnect();
+      return 0;
+    }
+    break;
+  case MQTT_PUBLISH:
+    handlePublish(rx[0] & 0x0F, body, len);
+    break;
+  case MQTT_SUBACK:
+    if (len >= 3 && body[2] == 0x80)
+      ALARM_LOGE("MQTT subscription refused");
+    break;
+  default: // PINGRESP and anything unexpected
+    break;
+  }
+  return total;
+}
+
+void MqttCommandClient::handlePublish(uint8_t flags, const uint8_t *body, size_t len)
+{
+  if (len < 2)
+    return;
+  size_t topicLen = (body[0] << 8) | body[1];
+  size_t offset = 2 + topicLen;
+  if (offset > len)
+    return;
+  const char *topic = (const char *)body + 2;
+  uint8_t qos = (flags >> 1) & 3;
+  if (qos)
+  {
+    if (offset + 2 > len)
+      return;
+    if (qos == 1)
+      send(MQTT_PUBACK, body + offset, 2); // Brokers may upgrade; QoS 2 is never requested
+    offset += 2;
+  }
+
+  // "<prefix>/cmd" or "<prefix>/cmd/<tag>"; the tag is carried over to the reply topic
+  size_t prefixLen = strlen(prefix);
+  if (topicLen < prefixLen + 4 || memcmp(topic, prefix, prefixLen) != 0 || memcmp(topic + prefixLen, "/cmd", 4) != 0)
+    return;
+  const char *tag = topic + prefixLen + 4;
+  size_t tagLen = topicLen - prefixLen - 4;
+  if (tagLen && tag[0] != '/')
+    return;
+  char replyTopic[MQTT_TOPIC_MAX];
+  int replyLen = snprintf(replyTopic, sizeof(replyTopic), "%s/reply%.*s", prefix, (int)tagLen, tag);
+  if (replyLen < 0 || (size_t)replyLen >= sizeof(replyTopic))
+  {
+    droppedCommands++;
+    return;
+  }
+
+  // The reply is built in tx behind its topic and sent as one PUBLISH
+  size_t head = putString(tx, replyTopic, replyLen);
+  BufferSink reply((char *)tx + head, sizeof(tx) - head);
+  scheduler.processJson((const char *)body + offset, len - offset, reply);
+  size_t replyBytes = reply.length();
+  if (reply.overflowed())
+  {
+    droppedCommands++;
+    replyBytes = snprintf((char *)tx + head, sizeof(tx) - head, "{\"status\":\"error\",\"message\":\"Reply too large for MQTT\"}\r\n");
+  }
+  send(MQTT_PUBLISH << 4, tx, head + replyBytes);
+}
+
+bool MqttCommandClient::startTask(uint32_t stackSize, UBaseType_t priority)
+{
+  if (task)
+    return true;
+  return xTaskCreate(taskEntry, "alarm_mqtt", stackSize, this, priority, &task) == pdPASS;
+}
+
+void MqttCommandClient::taskEntry(void *arg)
+{
+  MqttCommandClient *self = static_cast<MqttCommandClient *>(arg);
+  for (;;)
+  {
+    self->poll();
+    vTaskDelay(pdMS_TO_TICKS(10));
+  }
+}
@@ -0,0 +1,68 @@
+#ifndef MQTT_COMMAND_CLIENT_H
+#define MQTT_COMMAND_CLIENT_H
+
+#include <Arduino.h>
+#include <Client.h>
+
+#define MQTT_RX_MAX 1536     // Largest command packet; bigger ones are dropped
+#define MQTT_TX_MAX 2048     // Largest reply; a longer one is replaced by an error
+#define MQTT_TOPIC_MAX 64    // Reply topic incl. terminator
+#define MQTT_KEEPALIVE_S 30
+#define MQTT_RETRY_MS 5000   // Between connection attempts
+
+class AlarmScheduler;
+
+// Commands over MQTT 3.1.1 at QoS 0, without an external MQTT library.
+// Subscribes to "<prefix>/cmd/#"; a command published to
+// "<prefix>/cmd/<tag>" is answered on "<prefix>/reply/<tag>", so concurrent
+// clients pick their own tag. Commands arriving back to back are answered in
+// order. Reconnects on its own. The client may be a WiFiClient, a TLS
+// client, or a loopback client against a local broker in a host test.
+// host, clientId, prefix, user and password must outlive the object.
+class MqttCommandClient
+{
+public:
+  MqttCommandClient(AlarmScheduler &scheduler, Client &client);
+  void begin(const char *host, uint16_t port, const char *clientId, const char *prefix = "alarms",
+             const char *user = nullptr, const char *password = nullptr);
+  void poll();                                                         // Connects, reads and answers; call from loop()
+  bool startTask(uint32_t stackSize = 6144, UBaseType_t priority = 1); // Or poll on its own task
+  bool connected() const { return state == STATE_READY; }
+  uint32_t dropped() const { return droppedCommands; } // Too large to receive or to answer
+
+private:
+  enum State : uint8_t
+  {
+    STATE_OFFLINE,
+    STATE_CONNECTING, // CONNECT sent, waiting for CONNACK
+    STATE_READY
+  };
+  AlarmScheduler &scheduler;
+  Client &client;
+  const char *host;
+  uint16_t port;
+  const char *clientId;
+  const char *prefix;
+  const char *user;
+  const char *password;
+  State state;
+  uint32_t lastAttemptMs;
+  uint32_t lastSendMs;
+  uint32_t lastReceiveMs;
+  uint32_t skip; // Bytes left of an oversized packet being discarded
+  uint32_t droppedCommands;
+  uint16_t used;
+  uint16_t nextPacketId;
+  TaskHandle_t task;
+  uint8_t rx[MQTT_RX_MAX];
+  uint8_t tx[MQTT_TX_MAX];
+  bool connect();
+  void disconnect();
+  size_t handlePacket(); // Bytes consumed, 0 = incomplete
+  void handlePublish(uint8_t flags, const uint8_t *body, size_t len);
+  void send(uint8_t type, const uint8_t *body, size_t len);
+  static size_t putString(uint8_t *out, const char *s, size_t len);
+  static void taskEntry(void *arg);
+};
+
+#endif
@@ -0,0 +1,77 @@
+#include "PayloadPool.h"
+
+PayloadPool::PayloadPool() : tail(0)
+{
+  for (int i = 0; i < PAYLOAD_POOL_ENTRIES; i++)
+    entries[i].live = false;
+}
+
+void PayloadPool::compact()
+{
+  // Slide live entries down in offset order; each move only goes backwards
+  bool moved[PAYLOAD_POOL_ENTRIES] = {false};
+  uint16_t write = 0;
+  for (;;)
+  {
+    int next = -1;
+    for (int i = 0; i < PAYLOAD_POOL_ENTRIES; i++)
+    {
+      if (entries[i].live && !moved[i] && (next < 0 || entries[i].offset < entries[next].offset))
+        next = i;
+    }
+    if (next < 0)
+      break;
+    Entry &entry = entries[next];
+    memmove(data + write, data + entry.offset, entry.length + 1);
+    entry.offset = write;
+    write += entry.length + 1;
+    moved[next] = true;
+  }
+  tail = write;
+}
+
+char *PayloadPool::reserve(uint16_t len, uint8_t *handle)
+{
+  int slot = -1;
+  for (int i = 0; i < PAYLOAD_POOL_ENTRIES && slot < 0; i++)
+  {
+    if (!entries[i].live)
+      slot = i;
+  }
+  if (slot < 0)
+    return nullptr;
+  if ((uint32_t)tail + len + 1 > PAYLOAD_POOL_SIZE)
+    compact();
+  if ((uint32_t)tail + len + 1 > PAYLOAD_POOL_SIZE)
+    return nullptr;
+
+  entries[slot].offset = tail;
+  entries[slot].length = len;
+  entries[slot].live = true;
+  tail += len + 1;
+  data[entries[slot].offset + len] = '\0';
+  *handle = slot + 1;
+  return data + entries[slot].offset;
+}
+
+const char *PayloadPool::get(uint8_t handle, uint16_t *len) const
+{
+  if (handle == 0 || handle > PAYLOAD_POOL_ENTRIES || !entries[handle - 1].live)
+    return nullptr;
+  if (len)
+    *len = entries[handle - 1].length;
+  return data + entries[handle - 1].offset;
+}
+
+void PayloadPool::release(uint8_t handle)
+{
+  if (handle == 0 || handle > PAYLOAD_POOL_ENTRIES)
+    return;
+  entries[handle - 1].live = false;
+  for (int i = 0; i < PAYLOAD_POOL_ENTRIES; i++)
+  {
+    if (entries[i].live)
+      return;
+  }
+  tail = 0; // Empty again; start from the front without compacting
+}
@@ -0,0 +1,34 @@
+#ifndef PAYLOAD_POOL_H
+#define PAYLOAD_POOL_H
+
+#include <Arduino.h>
+
+#define PAYLOAD_POOL_SIZE 4096  // Bytes for unflushed zone_data across all zones
+#define PAYLOAD_POOL_ENTRIES 48 // One pending payload per alarm slot, plus queued worker fires
+
+// Fixed arena for variable-length payloads addressed by small handles
+// (0 = none). Released space is reclaimed by compacting the live entries
+// when the tail is reached, so the arena never touches the heap.
+class PayloadPool
+{
+public:
+  PayloadPool();
+  char *reserve(uint16_t len, uint8_t *handle);      // len bytes plus terminator, nullptr when full
+  const char *get(uint8_t handle, uint16_t *len) const;
+  void release(uint8_t handle);
+  uint16_t used() const { return tail; }
+
+private:
+  struct Entry
+  {
+    uint16_t offset;
+    uint16_t length; // Excluding the terminator
+    bool live;
+  };
+  char data[PAYLOAD_POOL_SIZE];
+  Entry entries[PAYLOAD_POOL_ENTRIES];
+  uint16_t tail; // First unused byte
+  void compact();
+};
+
+#endif
@@ -0,0 +1,395 @@
+#include "RecordStore.h"
+#include "AlarmLog.h"
+
+static const char *const SLOT_SUFFIX[2] = {".a", ".b"};
+
+RecordStore::RecordStore(fs::FS &fs) : fs(fs) {}
+
+uint32_t RecordStore::crc32(uint32_t crc, const uint8_t *data, size_t len)
+{
+  // Nibble-table CRC32 (IEEE), small enough to keep in flash
+  static const uint32_t table[16] = {
+      0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+      0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+  crc = ~crc;
+  while (len--)
+  {
+    crc ^= *data++;
+    crc = (crc >> 4) ^ table[crc & 0x0F];
+    crc = (crc >> 4) ^ table[crc & 0x0F];
+  }
+  return ~crc;
+}
+
+void RecordStore::slotPath(const char *name, const char *suffix, char *path) const
+{
+  snprintf(path, RECORD_PATH_LEN, "%s%s", name, suffix);
+}
+
+bool RecordStore::readHeader(const char *path, Header &header, bool verify)
+{
+  if (!fs.exists(path))
+    return false;
+  File file = fs.open(path, FILE_READ);
+  if (!file)
+    return false;
+  bool valid = file.read((uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+               header.magic == RECORD_MAGIC && header.length == file.size() - sizeof(header);
+  if (valid && verify)
+  {
+    // Verify the payload in small chunks
+    uint8_t buffer[128];
+    uint32_t crc = 0;
+    size_t remaining = header.length;
+    while (remaining > 0)
+    {
+      size_t n = file.read(buffer, remaining < sizeof(buffer) ? remaining : sizeof(buffer));
+      if (n == 0)
+        break;
+      crc = crc32(crc, buffer, n);
+      remaining -= n;
+    }
+    valid = remaining == 0 && crc == header.crc;
+  }
+  file.close();
+  return valid;
+}
+
+int RecordStore::newestUntried(const char *name, const Cursor &cursor, Header &header)
+{
+  int newest = -1;
+  char path[RECORD_PATH_LEN];
+  for (int i = 0; i < 2; i++)
+  {
+    Header candidate;
+    slotPath(name, SLOT_SUFFIX[i], path);
+    if ((cursor.tried & (1 << i)) || !readHeader(path, candidate, false))
+      continue;
+    if (newest < 0 || (int32_t)(candidate.seq - header.seq) > 0)
+    {
+      newest = i;
+      header = candidate;
+    }
+  }
+  return newest;
+}
+
+// Opens cursor.slot positioned at its payload
+bool RecordStore::openSlot(const char *name, Cursor &cursor)
+{
+  char path[RECORD_PATH_LEN];
+  slotPath(name, SLOT_SUFFIX[cursor.slot], path);
+  cursor.file = fs.open(path, FILE_READ);
+  if (!cursor.file)
+    return false;
+  cursor.file.seek(sizeof(Header));
+  cursor.offset = 0;
+  cursor.crc = 0;
+  return true;
+}
+
+enum
+{
+  READ_SELECT,
+  READ_SLOT,
+  READ_LEGACY,
+  WRITE_SELECT = 0,
+  WRITE_VERIFY,
+  WRITE_CRC,
+  WRITE_DATA,
+  WRITE_COMMIT
+};
+
+RecordStore::StepResult RecordStore::readStep(const char *name, uint8_t *buffer, size_t len, Cursor &cursor, size_t budget)
+{
+  switch (cursor.phase)
+  {
+  case READ_SELECT:
+  {
+    // Newest slot first; one failing its CRC falls back to the other. One
+    // too large for the buffer is reported, never passed over for an older copy
+    cursor.slot = newestUntried(name, cursor, cursor.header);
+    if (cursor.slot >= 0)
+    {
+      if (cursor.header.length > len)
+        return STEP_TOO_SMALL;
+      if (!openSlot(name, cursor))
+      {
+        cursor.tried |= 1 << cursor.slot;
+        return STEP_MORE;
+      }
+      cursor.phase = READ_SLOT;
+      return STEP_MORE;
+    }
+    // Plain file written by older versions, only when no slot exists at all
+    char path[RECORD_PATH_LEN];
+    for (int i = 0; i < 2; i++)
+    {
+      Header header;
+      slotPath(name, SLOT_SUFFIX[i], path);
+      if (readHeader(path, header, false))
+        return STEP_FAILED;
+    }
+    if (!fs.exists(name))
+      return STEP_FAILED;
+    cursor.file = fs.open(name, FILE_READ);
+    if (!cursor.file)
+      return STEP_FAILED;
+    if (cursor.file.size() > len)
+    {
+      cursor.file.close();
+      return STEP_TOO_SMALL;
+    }
+    cursor.offset = 0;
+    cursor.phase = READ_LEGACY;
+    return STEP_MORE;
+  }
+  case READ_SLOT:
+  {
+    size_t n = cursor.header.length - cursor.offset;
+    if (n > budget)
+      n = budget;
+    size_t got = n ? cursor.file.read(buffer + cursor.offset, n) : 0;
+    cursor.crc = crc32(cursor.crc, buffer + cursor.offset, got);
+    cursor.offset += got;
+    if (got == n && cursor.offset < cursor.header.length)
+      return STEP_MORE;
+    cursor.file.close();
+    if (got == n && cursor.crc == cursor.header.crc)
+      return STEP_DONE;
+    char path[RECORD_PATH_LEN];
+    slotPath(name, SLOT_SUFFIX[cursor.slot], path);
+    ALARM_LOGW("Corrupt %s, falling back", path);
+    cursor.tried |= 1 << cursor.slot;
+    cursor.phase = READ_SELECT;
+    return STEP_MORE;
+  }
+  case READ_LEGACY:
+  {
+    size_t n = cursor.file.size() - cursor.offset;
+    if (n > budget)
+      n = budget;
+    size_t got = n ? cursor.file.read(buffer + cursor.offset, n) : 0;
+    cursor.offset += got;
+    if (got == n && cursor.offset < cursor.file.size())
+      return STEP_MORE;
+    cursor.file.close();
+    return got == n ? STEP_DONE : STEP_FAILED;
+  }
+  }
+  return STEP_FAILED;
+}
+
+RecordStore::StepResult RecordStore::writeStep(const char *name, const uint8_t *data, size_t len, Cursor &cursor, size_t budget)
+{
+  char path[RECORD_PATH_LEN];
+  switch (cursor.phase)
+  {
+  case WRITE_SELECT:
+    // Find the newest good copy; the write goes to the other slot
+    cursor.slot = newestUntried(name, cursor, cursor.header);
+    if (cursor.slot >= 0 && openSlot(name, cursor))
+    {
+      cursor.phase = WRITE_VERIFY;
+      return STEP_MORE;
+    }
+    if (cursor.slot >= 0)
+    {
+      cursor.tried |= 1 << cursor.slot;
+      return STEP_MORE;
+    }
+    cursor.slot = cursor.tried == 2 ? 1 : 0; // No good copy; replace a corrupt slot
+    cursor.header.seq = 0;
+    cursor.offset = 0;
+    cursor.crc = 0;
+    cursor.phase = WRITE_CRC;
+    return STEP_MORE;
+  case WRITE_VERIFY:
+  {
+    // Verify the payload in small chunks
+    uint8_t chunk[128];
+    size_t remaining = cursor.header.length - cursor.offset;
+    if (remaining > budget)
+      remaining = budget;
+    while (remaining > 0)
+    {
+      size_t n = cursor.file.read(chunk, remaining < sizeof(chunk) ? remaining : sizeof(chunk));
+      if (n == 0)
+        break;
+      cursor.crc = crc32(cursor.crc, chunk, n);
+      cursor.offset += n;
+      remaining -= n;
+    }
+    if (remaining == 0 && cursor.offset < cursor.header.length)
+      return STEP_MORE;
+    cursor.file.close();
+    if (remaining > 0 || cursor.crc != cursor.header.crc)
+    {
+      cursor.tried |= 1 << cursor.slot;
+      cursor.phase = WRITE_SELECT;
+      return STEP_MORE;
+    }
+    cursor.slot = 1 - cursor.slot; // Never overwrite the newest good copy
+    cursor.offset = 0;
+    cursor.crc = 0;
+    cursor.phase = WRITE_CRC;
+    return STEP_MORE;
+  }
+  case WRITE_CRC:
+  {
+    size_t n = len - cursor.offset;
+    if (n > budget)
+      n = budget;
+    cursor.crc = crc32(cursor.crc, data + cursor.offset, n);
+    cursor.offset += n;
+    if (cursor.offset < len)
+      return STEP_MORE;
+
+    Header header;
+    header.magic = RECORD_MAGIC;
+    header.seq = cursor.header.seq + 1;
+    header.length = len;
+    header.crc = cursor.crc;
+    slotPath(name, ".tmp", path);
+    cursor.file = fs.open(path, FILE_WRITE);
+    if (!cursor.file)
+      return STEP_FAILED;
+    if (cursor.file.write((const uint8_t *)&header, sizeof(header)) != sizeof(header))
+    {
+      cursor.file.close();
+      fs.remove(path);
+      return STEP_FAILED;
+    }
+    cursor.offset = 0;
+    cursor.phase = WRITE_DATA;
+    return STEP_MORE;
+  }
+  case WRITE_DATA:
+  {
+    size_t n = len - cursor.offset;
+    if (n > budget)
+      n = budget;
+    bool written = n == 0 || cursor.file.write(data + cursor.offset, n) == n;
+    cursor.offset += n;
+    if (written && cursor.offset < len)
+      return STEP_MORE;
+    cursor.file.close();
+    if (!written)
+    {
+      slotPath(name, ".tmp", path);
+      fs.remove(path);
+      return STEP_FAILED;
+    }
+    cursor.phase = WRITE_COMMIT;
+    return STEP_MORE;
+  }
+  case WRITE_COMMIT:
+  {
+    // SPIFFS cannot rename over an existing file; the other slot stays valid meanwhile
+    char tmpPath[RECORD_PATH_LEN];
+    slotPath(name, ".tmp", tmpPath);
+    slotPath(name, SLOT_SUFFIX[cursor.slot], path);
+    if (fs.exists(path))
+      fs.remove(path);
+    if (!fs.rename(tmpPath, path))
+      return STEP_FAILED;
+
+    // The legacy plain file is superseded once a slot exists
+    if (fs.exists(name))
+      fs.remove(name);
+    return STEP_DONE;
+  }
+  }
+  return STEP_FAILED;
+}
+
+bool RecordStore::write(const char *name, const uint8_t *data, size_t len)
+{
+  Cursor cursor;
+  cursor.reset();
+  StepResult result;
+  while ((result = writeStep(name, data, len, cursor, SIZE_MAX)) == STEP_MORE)
+    ;
+  return result == STEP_DONE;
+}
+
+bool RecordStore::write(const char *name, const String &payload)
+{
+  return write(name, (const uint8_t *)payload.c_str(), payload.length());
+}
+
+size_t RecordStore::size(const char *name)
+{
+  size_t len = 0;
+  bool found = false;
+  char path[RECORD_PATH_LEN];
+  for (int i = 0; i < 2; i++)
+  {
+    Header header;
+    slotPath(name, SLOT_SUFFIX[i], path);
+    if (readHeader(path, header, false))
+    {
+      found = true;
+      if (header.length > len)
+        len = header.length;
+    }
+  }
+  if (found || !fs.exists(name))
+    return len;
+
+  // Plain file written by older versions
+  File file = fs.open(name, FILE_READ);
+  len = file ? file.size() : 0;
+  file.close();
+  return len;
+}
+
+size_t RecordStore::read(const char *name, uint8_t *buffer, size_t len)
+{
+  Cursor cursor;
+  cursor.reset();
+  StepResult result;
+  while ((result = readStep(name, buffer, len, cursor, SIZE_MAX)) == STEP_MORE)
+    ;
+  return result == STEP_DONE ? cursor.offset : 0;
+}
+
+bool RecordStore::remove(const char *name)
+{
+  bool removed = false;
+  char path[RECORD_PATH_LEN];
+  for (int i = 0; i < 2; i++)
+  {
+    slotPath(name, SLOT_SUFFIX[i], path);
+    if (fs.exists(path))
+      removed |= fs.remove(path);
+  }
+  slotPath(name, ".tmp", path);
+  if (fs.exists(path))
+    fs.remove(path);
+  if (fs.exists(name))
+    removed |= fs.remove(name);
+  return removed;
+}
+
+void RecordStore::recover(const char *name)
+{
+  // A leftover temp file is a write that never reached its rename; the slots
+  // still hold the previous state, so it is simply discarded
+  char path[RECORD_PATH_LEN];
+  slotPath(name, ".tmp", path);
+  if (fs.exists(path))
+    fs.remove(path);
+
+  // Drop a slot that fails its CRC so the next write does not keep it around
+  for (int i = 0; i < 2; i++)
+  {
+    Header header;
+    slotPath(name, SLOT_SUFFIX[i], path);
+    if (fs.exists(path) && !readHeader(path, header, true))
+    {
+      ALARM_LOGW("Discarding corrupt %s", path);
+      fs.remove(path);
+    }
+  }
+}
@@ -0,0 +1,74 @@
+#ifndef RECORD_STORE_H
+#define RECORD_STORE_H
+
+#include <Arduino.h>
+#include <FS.h>
+
+#define RECORD_MAGIC 0x31525341UL // "ASR1"
+#define RECORD_PATH_LEN 40         // Longest slot path incl. suffix and terminator
+
+// Crash-consistent storage of whole files on an fs::FS. Each logical file
+// (e.g. "/alarms.json") lives in two slots, "<name>.a" and "<name>.b", each
+// prefixed by a header with a sequence number and CRC32. Writes go to
+// "<name>.tmp" and are renamed over the older slot, so a torn write never
+// touches the newest good copy. Reads pick the newest slot whose CRC checks.
+// readStep()/writeStep() do the same work resumably, a budget of bytes per
+// call; read() and write() simply run them to completion.
+class RecordStore
+{
+public:
+  struct Header
+  {
+    uint32_t magic;  // RECORD_MAGIC
+    uint32_t seq;    // Incremented per write, wrap-aware
+    uint32_t length; // Payload bytes following the header
+    uint32_t crc;    // CRC32 of the payload
+  };
+  enum StepResult
+  {
+    STEP_MORE,
+    STEP_DONE,
+    STEP_FAILED,
+    STEP_TOO_SMALL // The newest payload exceeds the buffer; size() tells how much is needed
+  };
+  // Progress of a resumable read or write; zero-initialize with reset() before the first step
+  struct Cursor
+  {
+    uint8_t phase;
+    int8_t slot;   // Slot being read or verified, then the write target
+    uint8_t tried; // Bit per slot that failed its CRC
+    size_t offset; // Bytes done in the current phase; read length once done
+    uint32_t crc;
+    Header header;
+    File file;
+    void reset()
+    {
+      phase = 0;
+      slot = -1;
+      tried = 0;
+      offset = 0;
+      crc = 0;
+      file = File();
+    }
+  };
+
+  RecordStore(fs::FS &fs);
+  bool write(const char *name, const uint8_t *data, size_t len);
+  bool write(const char *name, const String &payload);
+  size_t size(const char *name); // Largest candidate payload, 0 = missing
+  size_t read(const char *name, uint8_t *buffer, size_t len); // Newest payload whose CRC checks, 0 = none
+  bool remove(const char *name); // Both slots and any temp file
+  void recover(const char *name); // Boot-time cleanup of an interrupted write (two slot checks)
+  static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t len);
+  StepResult readStep(const char *name, uint8_t *buffer, size_t len, Cursor &cursor, size_t budget);
+  StepResult writeStep(const char *name, const uint8_t *data, size_t len, Cursor &cursor, size_t budget);
+
+private:
+  fs::FS &fs;
+  int newestUntried(const char *name, const Cursor &cursor, Header &header); // By header only
+  bool openSlot(const char *name, Cursor &cursor);
+  bool readHeader(const char *path, Header &header, bool verify);
+  void slotPath(const char *name, const char *suffix, char *path) const; // Paths stay off the heap
+};
+
+#endif
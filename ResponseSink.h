@@ -0,0 +1,80 @@
+#ifndef RESPONSE_SINK_H
+#define RESPONSE_SINK_H
+
+#include <Arduino.h>
+
+// Result of processJson(), independent of where the reply went
+enum CommandStatus : uint8_t
+{
+  COMMAND_OK,           // Executed; the reply carries the result
+  COMMAND_REJECTED,     // Parsed but refused: bad arguments or the operation failed
+  COMMAND_INVALID_JSON, // Not parseable
+  COMMAND_UNKNOWN       // No such command
+};
+
+// Serializes straight into a caller-owned buffer, e.g. a transmit buffer
+// behind a protocol header, without an intermediate String. Keeps the text
+// NUL-terminated and records whether the reply was cut off.
+class BufferSink : public Print
+{
+public:
+  BufferSink(char *buffer, size_t capacity) : buffer(buffer), capacity(capacity), used(0), overflow(false)
+  {
+    if (capacity)
+      buffer[0] = '\0';
+  }
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *data, size_t len) override
+  {
+    size_t room = capacity ? capacity - 1 - used : 0; // Room for the terminator
+    if (len > room)
+    {
+      overflow = true;
+      len = room;
+    }
+    memcpy(buffer + used, data, len);
+    used += len;
+    if (capacity)
+      buffer[used] = '\0';
+    return len;
+  }
+  const char *c_str() const { return buffer; }
+  size_t length() const { return used; }
+  bool overflowed() const { return overflow; }
+  void clear()
+  {
+    used = 0;
+    overflow = false;
+    if (capacity)
+      buffer[0] = '\0';
+  }
+
+private:
+  char *buffer;
+  size_t capacity;
+  size_t used;
+  bool overflow;
+};
+
+// Discards the reply; only its length is kept
+class NullSink : public Print
+{
+public:
+  NullSink() : count(0) {}
+  size_t write(uint8_t) override
+  {
+    count++;
+    return 1;
+  }
+  size_t write(const uint8_t *, size_t len) override
+  {
+    count += len;
+    return len;
+  }
+  size_t length() const { return count; }
+
+private:
+  size_t count;
+};
+
+#endif
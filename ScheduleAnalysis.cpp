@@ -0,0 +1,169 @@
+#include "ScheduleAnalysis.h"
+#include "AlarmScheduler.h"
+
+static const char *const ISSUE_NAMES[] = {"conflict", "shadowed", "suppressed", "redundant", "idle"};
+
+void ScheduleAnalysis::begin(time_t fromUtc, time_t toUtc)
+{
+  from = fromUtc;
+  to = toUtc;
+  memset(alarms, 0, sizeof(alarms));
+  memset(zones, 0, sizeof(zones));
+  for (int z = 0; z < 4; z++)
+    zones[z].since = from;
+}
+
+void ScheduleAnalysis::track(const SimulatedFire &alarm)
+{
+  AlarmFindings &findings = alarms[alarm.zone - 1][alarm.slot];
+  findings.id = alarm.alarmId;
+  findings.tracked = true;
+}
+
+bool ScheduleAnalysis::onFire(const SimulatedFire &fire, void *context)
+{
+  ScheduleAnalysis *self = static_cast<ScheduleAnalysis *>(context);
+  AlarmFindings &alarm = self->alarms[fire.zone - 1][fire.slot];
+  ZoneFindings &zone = self->zones[fire.zone - 1];
+  alarm.id = fire.alarmId;
+  alarm.fires++;
+  if (fire.suppressed)
+  {
+    alarm.suppressed++;
+    return true;
+  }
+
+  // Of several fires in one minute, only the last action stays in effect
+  if (zone.minuteAction && zone.minute == fire.utc && strcmp(zone.minuteAction, fire.action) != 0)
+  {
+    alarm.conflicts++;
+    self->alarms[fire.zone - 1][zone.minuteSlot].conflicts++;
+  }
+  zone.minute = fire.utc;
+  zone.minuteAction = fire.action;
+  zone.minuteSlot = fire.slot;
+
+  if (zone.action && strcmp(zone.action, fire.action) == 0)
+  {
+    alarm.redundant++;
+    return true;
+  }
+  self->addTime(zone, fire.utc);
+  zone.action = fire.action;
+  zone.since = fire.utc;
+  zone.changes++;
+  return true;
+}
+
+void ScheduleAnalysis::finish()
+{
+  for (int z = 0; z < 4; z++)
+    addTime(zones[z], to);
+}
+
+// Credits [since, until) to the action in effect
+void ScheduleAnalysis::addTime(ZoneFindings &zone, time_t until)
+{
+  uint32_t seconds = until - zone.since;
+  if (!zone.action)
+  {
+    zone.unknownS += seconds;
+    return;
+  }
+  for (int i = 0; i < ANALYSIS_STATES; i++)
+  {
+    if (!zone.states[i].action)
+      zone.states[i].action = zone.action;
+    if (strcmp(zone.states[i].action, zone.action) == 0)
+    {
+      zone.states[i].seconds += seconds;
+      return;
+    }
+  }
+  zone.otherS += seconds;
+}
+
+uint16_t ScheduleAnalysis::count(const AlarmFindings &alarm, Issue issue) const
+{
+  // A shadowed alarm is reported once, not also as suppressed or redundant
+  bool shadowed = alarm.fires && alarm.suppressed + alarm.redundant == alarm.fires;
+  switch (issue)
+  {
+  case ISSUE_CONFLICT:
+    return alarm.conflicts;
+  case ISSUE_SHADOWED:
+    return shadowed ? alarm.fires : 0;
+  case ISSUE_SUPPRESSED:
+    return shadowed ? 0 : alarm.suppressed;
+  case ISSUE_REDUNDANT:
+    return shadowed ? 0 : alarm.redundant;
+  case ISSUE_IDLE:
+    return alarm.tracked && !alarm.fires;
+  default:
+    return 0;
+  }
+}
+
+size_t ScheduleAnalysis::issues(uint8_t zoneMask) const
+{
+  size_t n = 0;
+  for (int z = 0; z < 4; z++)
+  {
+    for (int s = 0; s < 10 && (zoneMask & (1 << z)); s++)
+    {
+      for (int k = 0; k < ISSUE_KINDS; k++)
+        n += count(alarms[z][s], (Issue)k) ? 1 : 0;
+    }
+  }
+  return n;
+}
+
+size_t ScheduleAnalysis::issuesToJson(JsonArray arr, uint8_t zoneMask, size_t max) const
+{
+  size_t n = 0;
+  for (int z = 0; z < 4; z++)
+  {
+    for (int s = 0; s < 10 && (zoneMask & (1 << z)); s++)
+    {
+      for (int k = 0; k < ISSUE_KINDS; k++)
+      {
+        uint16_t c = count(alarms[z][s], (Issue)k);
+        if (!c || n == max)
+          continue;
+        JsonObject issue = arr.createNestedObject();
+        issue["zone_id"] = z + 1;
+        issue["alarm_id"] = alarms[z][s].id;
+        issue["issue"] = ISSUE_NAMES[k];
+        if (k != ISSUE_IDLE)
+          issue["count"] = c;
+        n++;
+      }
+    }
+  }
+  return n;
+}
+
+void ScheduleAnalysis::zonesToJson(JsonArray arr, uint8_t zoneMask) const
+{
+  for (int z = 0; z < 4; z++)
+  {
+    if (!(zoneMask & (1 << z)))
+      continue;
+    const ZoneFindings &zone = zones[z];
+    JsonObject obj = arr.createNestedObject();
+    obj["zone_id"] = z + 1;
+    obj["changes"] = zone.changes;
+    obj["unknown_s"] = zone.unknownS;
+    JsonArray states = obj.createNestedArray("states");
+    for (int i = 0; i < ANALYSIS_STATES && zone.states[i].action; i++)
+    {
+      JsonObject state = states.createNestedObject();
+      state["action"] = (char *)zone.states[i].action; // Copied, so the reply can outlive the alarms
+      state["seconds"] = zone.states[i].seconds;
+    }
+    if (zone.otherS)
+      obj["other_s"] = zone.otherS;
+    if (zone.action)
+      obj["final"] = (char *)zone.action;
+  }
+}
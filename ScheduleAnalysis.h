@@ -0,0 +1,82 @@
+#ifndef SCHEDULE_ANALYSIS_H
+#define SCHEDULE_ANALYSIS_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#define ANALYSIS_DAYS 366      // Default window; a year reaches every yearly alarm
+#define ANALYSIS_STATES 4      // Actions whose time in effect is summed per zone
+#define ANALYSIS_ISSUES_MAX 16 // Issues listed by the analyze command, next to the copied actions
+#define ANALYSIS_WARNINGS_MAX 8 // Issues listed in an add reply; they fit the request document
+#define ANALYSIS_WARNING_DAYS 8 // Window checked on add: every day-based alarm fires in it
+
+struct SimulatedFire;
+
+// Findings about the current alarms over a time window, fed by the events of
+// AlarmScheduler::simulate(). Every figure comes from the fire instants and
+// the intervals between them, never from stepping through minutes:
+//   conflict    alarms of one zone fire in the same minute with different
+//               actions (all alarms in a DST gap fire at its end)
+//   suppressed  a day-based fire masked by a date-based one in that minute
+//   redundant   a fire whose action is already in effect
+//   shadowed    an alarm that fires but never changes its zone's state
+//   idle        an active alarm that does not fire in the window
+// Per zone, the time each action is in effect is summed between fires.
+// Actions are referenced, not copied; call zonesToJson(), which copies them,
+// before the alarms change.
+class ScheduleAnalysis
+{
+public:
+  void begin(time_t fromUtc, time_t toUtc);
+  void track(const SimulatedFire &alarm); // Each active alarm, before the run
+  static bool onFire(const SimulatedFire &fire, void *context); // A SimulationFunction
+  void finish();
+  size_t issues(uint8_t zoneMask = 0x0F) const;
+  size_t issuesToJson(JsonArray arr, uint8_t zoneMask, size_t max) const; // Returns the number listed
+  void zonesToJson(JsonArray arr, uint8_t zoneMask) const;
+
+private:
+  enum Issue : uint8_t
+  {
+    ISSUE_CONFLICT,
+    ISSUE_SHADOWED,
+    ISSUE_SUPPRESSED,
+    ISSUE_REDUNDANT,
+    ISSUE_IDLE,
+    ISSUE_KINDS
+  };
+  struct AlarmFindings
+  {
+    uint32_t id;
+    bool tracked;
+    uint16_t fires; // Including suppressed ones
+    uint16_t conflicts;
+    uint16_t suppressed;
+    uint16_t redundant;
+  };
+  struct StateTime
+  {
+    const char *action;
+    uint32_t seconds;
+  };
+  struct ZoneFindings
+  {
+    const char *action;       // In effect since 'since', nullptr = not known yet
+    time_t since;
+    time_t minute;            // UTC minute of the previous fire
+    const char *minuteAction; // Its action, nullptr = no fire yet
+    uint8_t minuteSlot;
+    uint32_t changes;
+    uint32_t unknownS;        // Before the first fire
+    uint32_t otherS;          // Actions beyond ANALYSIS_STATES
+    StateTime states[ANALYSIS_STATES];
+  };
+  time_t from;
+  time_t to;
+  AlarmFindings alarms[4][10];
+  ZoneFindings zones[4];
+  void addTime(ZoneFindings &zone, time_t until);
+  uint16_t count(const AlarmFindings &alarm, Issue issue) const; // 0 = not affected
+};
+
+#endif
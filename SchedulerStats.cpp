@@ -0,0 +1,58 @@
+#include "SchedulerStats.h"
+
+void StatsHistogram::toJson(JsonObject obj, const char *unit) const
+{
+  obj["unit"] = unit;
+  obj["count"] = count;
+  obj["max"] = max;
+  obj["avg"] = count ? (uint32_t)(sum / count) : 0;
+  // Trailing empty buckets are omitted; bucket i counts values below 2^i
+  int last = STATS_BUCKETS - 1;
+  while (last > 0 && buckets[last] == 0)
+    last--;
+  JsonArray arr = obj.createNestedArray("log2");
+  for (int i = 0; i <= last; i++)
+    arr.add(buckets[i]);
+}
+
+void SchedulerStats::toJson(JsonObject obj) const
+{
+  checkUs.toJson(obj.createNestedObject("check"), "us");
+  latenessS.toJson(obj.createNestedObject("lateness"), "s");
+  callbackUs.toJson(obj.createNestedObject("callback"), "us");
+  obj["late_fires"] = lateFires;
+  JsonArray zoneFires = obj.createNestedArray("fires");
+  JsonArray zoneOverruns = obj.createNestedArray("overruns");
+  JsonArray zoneDropped = obj.createNestedArray("dropped");
+  for (int i = 0; i < 4; i++)
+  {
+    zoneFires.add(fires[i]);
+    zoneOverruns.add(overruns[i]);
+    zoneDropped.add(dropped[i]);
+  }
+
+  JsonObject persist = obj.createNestedObject("persist");
+  flushMs.toJson(persist.createNestedObject("flush"), "ms");
+  persist["flushes"] = flushes;
+  persist["failures"] = flushFailures;
+  persist["bytes"] = bytesPersisted;
+
+  JsonObject cmd = obj.createNestedObject("commands");
+  cmd["total"] = commands;
+  cmd["parse_failures"] = parseFailures;
+  cmd["unknown"] = unknownCommands;
+
+  JsonObject boot = obj.createNestedObject("boot");
+  boot["begin_ms"] = beginMs;
+  boot["first_dispatch_ms"] = firstDispatchMs;
+  boot["staged"] = stagedBoot;
+
+  JsonObject sync = obj.createNestedObject("sync");
+  sync["rtc"] = rtcSyncs;
+  sync["rtc_last"] = (uint32_t)lastRtcSync;
+  sync["rtc_drift_s"] = lastRtcDrift;
+  sync["ntp"] = ntpSyncs;
+  sync["ntp_failures"] = ntpFailures;
+  sync["ntp_last"] = (uint32_t)lastNtpSync;
+  sync["ntp_drift_s"] = lastNtpDrift;
+}
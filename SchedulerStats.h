@@ -0,0 +1,82 @@
+#ifndef SCHEDULER_STATS_H
+#define SCHEDULER_STATS_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#define STATS_BUCKETS 16         // Log2 histogram buckets
+#define STATS_LATE_THRESHOLD_S 2 // Fires this many seconds past their minute count as late
+
+// Log2 histogram: bucket 0 holds 0, bucket i holds [2^(i-1), 2^i), the
+// last bucket everything larger. Recording is a count-leading-zeros and
+// three adds, cheap enough for the dispatch path.
+struct StatsHistogram
+{
+  uint32_t buckets[STATS_BUCKETS];
+  uint32_t count;
+  uint32_t max;
+  uint64_t sum;
+
+  void record(uint32_t value)
+  {
+    int bucket = value ? 32 - __builtin_clz(value) : 0;
+    buckets[bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1]++;
+    count++;
+    sum += value;
+    if (value > max)
+      max = value;
+  }
+  void toJson(JsonObject obj, const char *unit) const;
+};
+
+// Runtime counters of the scheduler. Plain fields written by the task
+// that owns each activity; read them through AlarmScheduler::stats().
+struct SchedulerStats
+{
+  StatsHistogram checkUs;      // checkAlarms() duration
+  StatsHistogram latenessS;    // Dispatch time past the alarm's minute
+  StatsHistogram callbackUs;   // Zone callback duration
+  StatsHistogram flushMs;      // flush() duration
+  uint32_t fires[4];           // Per zone
+  uint32_t lateFires;          // latenessS >= STATS_LATE_THRESHOLD_S
+  uint32_t overruns[4];        // Per zone, callbacks over the budget
+  uint32_t dropped[4];         // Per zone, fires lost to a full worker queue or payload pool
+  uint32_t flushes;
+  uint32_t flushFailures;
+  uint32_t bytesPersisted;     // Payload bytes handed to the storage backend
+  uint32_t commands;
+  uint32_t parseFailures;      // Invalid JSON
+  uint32_t unknownCommands;
+  uint32_t rtcSyncs;           // Daily RTC reads into TimeLib
+  uint32_t ntpSyncs;
+  uint32_t ntpFailures;
+  time_t lastRtcSync;          // UTC, 0 = never
+  time_t lastNtpSync;          // UTC, 0 = never
+  int32_t lastRtcDrift;        // RTC minus TimeLib at the last RTC sync, seconds
+  int32_t lastNtpDrift;        // NTP minus TimeLib at the last NTP sync, seconds
+  uint32_t jsonPeak[4];        // Peak memoryUsage() of the request/response/payload/file pools
+  uint32_t bootStartMs;        // millis() when begin() started
+  uint32_t beginMs;            // begin() duration
+  uint32_t firstDispatchMs;    // From begin() to the first fire, 0 = none yet
+  bool stagedBoot;             // Started from the schedule index
+
+  void reset()
+  {
+    // Boot figures describe this run and survive a reset
+    uint32_t start = bootStartMs, begin = beginMs, first = firstDispatchMs;
+    bool staged = stagedBoot;
+    memset(this, 0, sizeof(*this));
+    bootStartMs = start;
+    beginMs = begin;
+    firstDispatchMs = first;
+    stagedBoot = staged;
+  }
+  void notePeak(int pool, size_t used)
+  {
+    if (used > jsonPeak[pool])
+      jsonPeak[pool] = used;
+  }
+  void toJson(JsonObject obj) const;
+};
+
+#endif
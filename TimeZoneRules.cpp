@@ -0,0 +1,333 @@
+#include "TimeZoneRules.h"
+
+// Helper: Days since 1970-01-01 for a proleptic Gregorian date
+static long daysFromCivil(int year, int month, int date)
+{
+  year -= month <= 2;
+  long era = (year >= 0 ? year : year - 399) / 400;
+  long yoe = year - era * 400;
+  long doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + date - 1;
+  long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+// Helper: Calendar year containing a day count since 1970-01-01
+static int yearFromDays(long days)
+{
+  days += 719468;
+  long era = (days >= 0 ? days : days - 146096) / 146097;
+  long doe = days - era * 146097;
+  long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  long mp = (5 * doy + 2) / 153;
+  return yoe + era * 400 + (mp >= 10);
+}
+
+static bool isLeapYear(int year)
+{
+  return (year % 4 == 0 && year % 100 != 0) || (year % 400 == 0);
+}
+
+static int daysInMonth(int year, int month)
+{
+  static const uint8_t lengths[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+  return (month == 2 && isLeapYear(year)) ? 29 : lengths[month - 1];
+}
+
+static int yearOf(time_t t)
+{
+  long days = t / 86400;
+  if (t < 0 && t % 86400)
+    days--;
+  return yearFromDays(days);
+}
+
+// Helper: Parse a zone abbreviation ("CET" or quoted "<+0530>")
+static bool parseName(const char *&p)
+{
+  if (*p == '<')
+  {
+    while (*p && *p != '>')
+      p++;
+    if (*p != '>')
+      return false;
+    p++;
+    return true;
+  }
+  const char *start = p;
+  while (isalpha((unsigned char)*p))
+    p++;
+  return p - start >= 3;
+}
+
+static bool parseNumber(const char *&p, long &value)
+{
+  if (!isdigit((unsigned char)*p))
+    return false;
+  value = 0;
+  while (isdigit((unsigned char)*p))
+    value = value * 10 + (*p++ - '0');
+  return true;
+}
+
+// Helper: Parse [+-]hh[:mm[:ss]] into seconds
+static bool parseHms(const char *&p, long &secs)
+{
+  int sign = 1;
+  if (*p == '+' || *p == '-')
+  {
+    if (*p == '-')
+      sign = -1;
+    p++;
+  }
+  long h, m = 0, s = 0;
+  if (!parseNumber(p, h))
+    return false;
+  if (*p == ':')
+  {
+    p++;
+    if (!parseNumber(p, m))
+      return false;
+    if (*p == ':')
+    {
+      p++;
+      if (!parseNumber(p, s))
+        return false;
+    }
+  }
+  if (h > 167 || m > 59 || s > 59)
+    return false;
+  secs = sign * (h * 3600 + m * 60 + s);
+  return true;
+}
+
+TimeZoneRules::TimeZoneRules(long utcOffset)
+{
+  portMUX_TYPE unlocked = portMUX_INITIALIZER_UNLOCKED;
+  tableLock = unlocked;
+  setFixedOffset(utcOffset);
+}
+
+void TimeZoneRules::setFixedOffset(long utcOffset)
+{
+  portENTER_CRITICAL(&tableLock);
+  stdOffset = utcOffset;
+  dstOffset = utcOffset;
+  hasDst = false;
+  tableCount = 0;
+  tableFirstYear = 0;
+  portEXIT_CRITICAL(&tableLock);
+
+  // POSIX offsets count west of Greenwich, so the sign is inverted
+  long west = -utcOffset;
+  long mag = west < 0 ? -west : west;
+  char sign = west < 0 ? '-' : '+';
+  if (mag % 60)
+    snprintf(spec, sizeof(spec), "<%c%02ld%02ld>%c%ld:%02ld:%02ld", utcOffset < 0 ? '-' : '+',
+             mag / 3600, mag / 60 % 60, sign, mag / 3600, mag / 60 % 60, mag % 60);
+  else
+    snprintf(spec, sizeof(spec), "<%c%02ld%02ld>%c%ld:%02ld", utcOffset < 0 ? '-' : '+',
+             mag / 3600, mag / 60 % 60, sign, mag / 3600, mag / 60 % 60);
+}
+
+bool TimeZoneRules::setPosix(const char *tz)
+{
+  if (!tz || strlen(tz) >= sizeof(spec))
+    return false;
+
+  // Parse helper for "Mm.w.d", "Jn" or "n" followed by an optional "/time"
+  auto parseRule = [](const char *&p, Rule &rule) -> bool
+  {
+    long a, b, c;
+    rule.time = 7200; // 02:00 local when omitted
+    if (*p == 'M')
+    {
+      p++;
+      if (!parseNumber(p, a) || *p++ != '.' || !parseNumber(p, b) || *p++ != '.' || !parseNumber(p, c))
+        return false;
+      if (a < 1 || a > 12 || b < 1 || b > 5 || c > 6)
+        return false;
+      rule.type = 'M';
+      rule.month = a;
+      rule.week = b;
+      rule.wday = c;
+    }
+    else if (*p == 'J')
+    {
+      p++;
+      if (!parseNumber(p, a) || a < 1 || a > 365)
+        return false;
+      rule.type = 'J';
+      rule.day = a;
+    }
+    else
+    {
+      if (!parseNumber(p, a) || a > 365)
+        return false;
+      rule.type = 'D';
+      rule.day = a;
+    }
+    if (*p == '/')
+    {
+      p++;
+      if (!parseHms(p, rule.time))
+        return false;
+    }
+    return true;
+  };
+
+  const char *p = tz;
+  long stdWest, dstWest = 0;
+  bool dst = false;
+  Rule start = {'M', 3, 2, 0, 0, 7200}; // US rules when a DST zone omits them
+  Rule end = {'M', 11, 1, 0, 0, 7200};
+  if (!parseName(p) || !parseHms(p, stdWest))
+    return false;
+  if (*p)
+  {
+    if (!parseName(p))
+      return false;
+    dst = true;
+    dstWest = stdWest - 3600;
+    if (*p && *p != ',' && !parseHms(p, dstWest))
+      return false;
+    if (*p == ',')
+    {
+      p++;
+      if (!parseRule(p, start) || *p++ != ',' || !parseRule(p, end))
+        return false;
+    }
+  }
+  if (*p)
+    return false;
+
+  portENTER_CRITICAL(&tableLock);
+  strcpy(spec, tz);
+  stdOffset = -stdWest;
+  dstOffset = dst ? -dstWest : stdOffset;
+  hasDst = dst;
+  startRule = start;
+  endRule = end;
+  tableCount = 0;
+  tableFirstYear = 0;
+  portEXIT_CRITICAL(&tableLock);
+  return true;
+}
+
+time_t TimeZoneRules::ruleTime(const Rule &rule, int year) const
+{
+  long days;
+  if (rule.type == 'J')
+  {
+    days = daysFromCivil(year, 1, 1) + rule.day - 1 + ((isLeapYear(year) && rule.day >= 60) ? 1 : 0);
+  }
+  else if (rule.type == 'D')
+  {
+    days = daysFromCivil(year, 1, 1) + rule.day;
+  }
+  else
+  {
+    long first = daysFromCivil(year, rule.month, 1);
+    int firstWday = (int)(((first % 7) + 11) % 7); // 1970-01-01 was a Thursday
+    int d = (rule.wday - firstWday + 7) % 7 + (rule.week - 1) * 7;
+    while (d >= daysInMonth(year, rule.month))
+      d -= 7;
+    days = first + d;
+  }
+  return (time_t)days * 86400 + rule.time;
+}
+
+void TimeZoneRules::buildTable(int firstYear)
+{
+  tableCount = 0;
+  tableFirstYear = firstYear;
+  for (int y = firstYear; y < firstYear + TZ_TABLE_YEARS; y++)
+  {
+    table[tableCount++] = {ruleTime(startRule, y) - stdOffset, dstOffset};
+    table[tableCount++] = {ruleTime(endRule, y) - dstOffset, stdOffset};
+  }
+  // Southern-hemisphere rules end DST before they start it; keep the table ordered
+  for (int i = 1; i < tableCount; i++)
+  {
+    Transition t = table[i];
+    int j = i - 1;
+    while (j >= 0 && table[j].utc > t.utc)
+    {
+      table[j + 1] = table[j];
+      j--;
+    }
+    table[j + 1] = t;
+  }
+}
+
+long TimeZoneRules::offsetAt(time_t utc)
+{
+  portENTER_CRITICAL(&tableLock);
+  long offset = lookup(utc);
+  portEXIT_CRITICAL(&tableLock);
+  return offset;
+}
+
+long TimeZoneRules::lookup(time_t utc)
+{
+  if (!hasDst)
+    return stdOffset;
+  int y = yearOf(utc);
+  // Keep the previous year in the table so the state at Jan 1 is known
+  if (tableCount == 0 || y <= tableFirstYear || y >= tableFirstYear + TZ_TABLE_YEARS)
+    buildTable(y - 1);
+
+  int lo = 0, hi = tableCount;
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    if (table[mid].utc <= utc)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo > 0 ? table[lo - 1].offset : stdOffset;
+}
+
+time_t TimeZoneRules::toLocal(time_t utc)
+{
+  return utc + offsetAt(utc);
+}
+
+time_t TimeZoneRules::toUtc(time_t local, LocalKind *kind)
+{
+  time_t a = local - stdOffset;
+  time_t b = local - dstOffset;
+  bool aValid = toLocal(a) == local;
+  bool bValid = hasDst && toLocal(b) == local;
+  time_t first = a < b ? a : b;
+  time_t last = a < b ? b : a;
+
+  if (aValid && bValid && a != b)
+  {
+    if (kind)
+      *kind = LOCAL_REPEATED;
+    return first;
+  }
+  if (kind)
+    *kind = (aValid || bValid) ? LOCAL_UNIQUE : LOCAL_SKIPPED;
+  if (aValid)
+    return a;
+  if (bValid)
+    return b;
+
+  // Skipped: the first valid instant is the transition between both candidates
+  time_t end = last;
+  portENTER_CRITICAL(&tableLock);
+  lookup(last);
+  for (int i = 0; i < tableCount; i++)
+  {
+    if (table[i].utc > first && table[i].utc <= last)
+    {
+      end = table[i].utc;
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&tableLock);
+  return end;
+}
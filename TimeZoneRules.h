@@ -0,0 +1,64 @@
+#ifndef TIME_ZONE_RULES_H
+#define TIME_ZONE_RULES_H
+
+#include <Arduino.h>
+#include <time.h>
+
+#define TZ_TABLE_YEARS 8 // Years of DST transitions kept precomputed
+#define TZ_SPEC_LEN 48   // Longest POSIX TZ string accepted
+
+// POSIX TZ rules (e.g. "CET-1CEST,M3.5.0,M10.5.0/3") with a precomputed
+// transition table. All conversions are between UTC and local epoch seconds.
+// Any task may convert; the table is rebuilt under a spinlock when a lookup
+// leaves its years.
+class TimeZoneRules
+{
+public:
+  enum LocalKind
+  {
+    LOCAL_UNIQUE,   // Local time occurs exactly once
+    LOCAL_SKIPPED,  // Local time falls in a spring-forward gap
+    LOCAL_REPEATED  // Local time occurs twice (fall-back overlap)
+  };
+
+  TimeZoneRules(long utcOffset = 0);
+  bool setPosix(const char *tz);       // false (rules unchanged) if malformed
+  void setFixedOffset(long utcOffset); // Seconds east of UTC, no DST
+  long offsetAt(time_t utc);           // Seconds east of UTC in effect at 'utc'
+  time_t toLocal(time_t utc);
+  time_t toUtc(time_t local, LocalKind *kind = nullptr); // Gap -> end of gap, overlap -> first occurrence
+  const char *posix() const { return spec; }
+
+private:
+  struct Rule
+  {
+    char type;     // 'M' month.week.day, 'J' 1–365 without Feb 29, 'D' 0–365
+    uint8_t month; // 1–12 ('M')
+    uint8_t week;  // 1–5, 5 = last ('M')
+    uint8_t wday;  // sun=0, ..., sat=6 ('M')
+    uint16_t day;  // Day number ('J'/'D')
+    long time;     // Seconds after local midnight (may be negative or past 24h)
+  };
+  struct Transition
+  {
+    time_t utc;  // Instant of the change
+    long offset; // Offset in effect from this instant on
+  };
+
+  char spec[TZ_SPEC_LEN];
+  long stdOffset;
+  long dstOffset;
+  bool hasDst;
+  Rule startRule; // Into DST, in standard local time
+  Rule endRule;   // Back to standard, in DST local time
+  Transition table[TZ_TABLE_YEARS * 2];
+  uint8_t tableCount;
+  int tableFirstYear;
+  portMUX_TYPE tableLock; // Guards the rules and the table
+
+  void buildTable(int firstYear);
+  long lookup(time_t utc); // offsetAt() with tableLock held
+  time_t ruleTime(const Rule &rule, int year) const;
+};
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef WEEK_INDEX_H
+#define WEEK_INDEX_H
+
+#include <Arduino.h>
+
+#define MINUTES_PER_WEEK 10080 // 7 * 1440; minute 0 is Sunday 00:00
+
+// One bit per minute of the week, set where any zone has a day-based alarm,
+// so most minutes are ruled out with a single bit test (1260 bytes).
+// Adding sets bits at once. Removing only marks the index stale, since another
+// zone may share the bits; the scheduler rebuilds it before its next check.
+// Guarded by the scheduler's state lock.
+class WeekIndex
+{
+public:
+  WeekIndex() { clear(); }
+  void clear()
+  {
+    memset(bits, 0, sizeof(bits));
+    outdated = false;
+  }
+  void add(uint8_t days, uint16_t minuteOfDay) // days: bit per weekday, sun = bit 0
+  {
+    for (int d = 0; d < 7; d++)
+    {
+      if (days & (1 << d))
+      {
+        uint16_t m = d * 1440 + minuteOfDay;
+        bits[m >> 3] |= 1 << (m & 7);
+      }
+    }
+  }
+  void release() { outdated = true; } // A day-based alarm was removed or moved
+  bool stale() const { return outdated; }
+  bool test(uint16_t minuteOfWeek) const { return bits[minuteOfWeek >> 3] & (1 << (minuteOfWeek & 7)); }
+
+private:
+  uint8_t bits[MINUTES_PER_WEEK / 8];
+  bool outdated;
+};
+
+#endif
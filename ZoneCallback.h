@@ -0,0 +1,60 @@
+#ifndef ZONE_CALLBACK_H
+#define ZONE_CALLBACK_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// Non-owning zone handler: a function plus a context pointer, no heap.
+// Binds plain functions, functions taking a context, member functions of
+// an object, or any callable the caller keeps alive.
+class ZoneCallback
+{
+public:
+  typedef void (*Legacy)(int id, String action, JsonObject &zoneData); // Original registerZone() signature
+  typedef void (*Function)(void *context, int id, const char *action, JsonObject &zoneData);
+
+  ZoneCallback() : fn(nullptr), context(nullptr), legacyFn(nullptr) {}
+  ZoneCallback(Function function, void *context = nullptr) : fn(function), context(context), legacyFn(nullptr) {}
+  ZoneCallback(Legacy legacy) : fn(nullptr), context(nullptr), legacyFn(legacy) {}
+
+  // ZoneCallback::method<Valve, &Valve::onAlarm>(&valve)
+  template <class T, void (T::*Method)(int id, const char *action, JsonObject &zoneData)>
+  static ZoneCallback method(T *object)
+  {
+    return ZoneCallback(methodThunk<T, Method>, object);
+  }
+
+  // Any callable with operator()(int, const char *, JsonObject &); it is referenced, not copied
+  template <class F>
+  static ZoneCallback ref(F &callable)
+  {
+    return ZoneCallback(callableThunk<F>, &callable);
+  }
+
+  void operator()(int id, const char *action, JsonObject &zoneData) const
+  {
+    if (fn)
+      fn(context, id, action, zoneData);
+    else
+      legacyFn(id, action, zoneData); // Builds the String the old signature expects
+  }
+  explicit operator bool() const { return fn || legacyFn; }
+
+private:
+  Function fn;
+  void *context;
+  Legacy legacyFn;
+
+  template <class T, void (T::*Method)(int, const char *, JsonObject &)>
+  static void methodThunk(void *context, int id, const char *action, JsonObject &zoneData)
+  {
+    (static_cast<T *>(context)->*Method)(id, action, zoneData);
+  }
+  template <class F>
+  static void callableThunk(void *context, int id, const char *action, JsonObject &zoneData)
+  {
+    (*static_cast<F *>(context))(id, action, zoneData);
+  }
+};
+
+#endif
@@ -0,0 +1,107 @@
+#include "ZoneSubscribers.h"
+
+ZoneSubscribers::ZoneSubscribers() : handlerCount(0)
+{
+  memset(bucketStart, 0, sizeof(bucketStart));
+}
+
+int ZoneSubscribers::findHandler(TargetFunction fn, void *context) const
+{
+  for (int i = 0; i < handlerCount; i++)
+  {
+    if (handlers[i].fn == fn && handlers[i].context == context)
+      return i;
+  }
+  return -1;
+}
+
+void ZoneSubscribers::range(int bucket, uint32_t alarmId, uint16_t *first, uint16_t *end) const
+{
+  uint16_t lo = bucketStart[bucket], hi = bucketStart[bucket + 1];
+  while (lo < hi)
+  {
+    uint16_t mid = (lo + hi) / 2;
+    if (entries[mid].alarmId < alarmId)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  *first = lo;
+  while (lo < bucketStart[bucket + 1] && entries[lo].alarmId == alarmId)
+    lo++;
+  *end = lo;
+}
+
+void ZoneSubscribers::insert(int bucket, uint16_t pos, const Entry &entry)
+{
+  memmove(&entries[pos + 1], &entries[pos], (size() - pos) * sizeof(Entry));
+  entries[pos] = entry;
+  for (int b = bucket + 1; b <= 4 * BUCKETS; b++)
+    bucketStart[b]++;
+}
+
+bool ZoneSubscribers::subscribe(uint8_t zone, uint16_t target, TargetFunction fn, void *context, uint32_t alarmId)
+{
+  if (zone < 1 || zone > 4 || !fn)
+    return false;
+  int handler = findHandler(fn, context);
+  if (size() >= FANOUT_MAX || (handler < 0 && handlerCount >= SUBSCRIBER_HANDLERS))
+    return false;
+  if (handler < 0)
+  {
+    handler = handlerCount++;
+    handlers[handler].fn = fn;
+    handlers[handler].context = context;
+  }
+
+  Entry entry = {alarmId, target, (uint8_t)handler, 0};
+  int bucket = (zone - 1) * BUCKETS + (alarmId == SUBSCRIBE_ALL_ALARMS ? ALL_BUCKET : ALARM_BUCKET);
+  // After the alarm's existing targets, keeping the bucket sorted by id
+  uint16_t first, end = bucketStart[bucket + 1];
+  if (alarmId != SUBSCRIBE_ALL_ALARMS)
+    range(bucket, alarmId, &first, &end);
+  insert(bucket, end, entry);
+  return true;
+}
+
+size_t ZoneSubscribers::unsubscribe(uint8_t zone, uint16_t target, TargetFunction fn, void *context)
+{
+  int handler = findHandler(fn, context);
+  if (zone < 1 || zone > 4 || handler < 0)
+    return 0;
+  // Compact the whole table in one pass, shifting bucket bounds as entries go
+  size_t removed = 0;
+  int bucket = 0;
+  size_t total = size();
+  for (size_t i = 0; i < total; i++)
+  {
+    while (i >= bucketStart[bucket + 1])
+      bucketStart[++bucket] -= removed;
+    bool inZone = bucket >= (zone - 1) * BUCKETS && bucket < zone * BUCKETS;
+    if (inZone && entries[i].target == target && entries[i].handler == handler)
+      removed++;
+    else
+      entries[i - removed] = entries[i];
+  }
+  while (bucket < 4 * BUCKETS)
+    bucketStart[++bucket] -= removed;
+  return removed;
+}
+
+void ZoneSubscribers::run(uint16_t first, uint16_t end, uint8_t zone, const char *action, JsonObject &zoneData) const
+{
+  for (uint16_t i = first; i < end; i++)
+  {
+    const Handler &handler = handlers[entries[i].handler];
+    handler.fn(handler.context, entries[i].target, zone, action, zoneData);
+  }
+}
+
+void ZoneSubscribers::fanOut(uint8_t zone, uint32_t alarmId, const char *action, JsonObject &zoneData) const
+{
+  int base = (zone - 1) * BUCKETS;
+  run(bucketStart[base + ALL_BUCKET], bucketStart[base + ALL_BUCKET + 1], zone, action, zoneData);
+  uint16_t first, end;
+  range(base + ALARM_BUCKET, alarmId, &first, &end);
+  run(first, end, zone, action, zoneData);
+}
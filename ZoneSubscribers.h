@@ -0,0 +1,59 @@
+#ifndef ZONE_SUBSCRIBERS_H
+#define ZONE_SUBSCRIBERS_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#define SUBSCRIBER_HANDLERS 8        // Distinct handler/context pairs
+#define FANOUT_MAX 512               // Fan-out entries; raise for thousands of targets (8 bytes each)
+#define SUBSCRIBE_ALL_ALARMS 0       // Alarm id: every alarm of the zone, one entry per target
+
+// Handler shared by many targets, e.g. one relay bank driver for all its channels
+typedef void (*TargetFunction)(void *context, uint16_t target, int zone, const char *action, JsonObject &zoneData);
+
+// Fan-out index from a zone's alarms to subscribed targets. Entries live in
+// one array ordered by bucket (the zone's "all alarms" bucket, then its
+// per-alarm bucket sorted by alarm id), so a fire walks two contiguous runs.
+// Keyed by id rather than slot, so an alarm added to a freed slot does not
+// reach the deleted alarm's targets. Inserting shifts the tail, which is
+// meant for setup rather than the dispatch path.
+class ZoneSubscribers
+{
+public:
+  ZoneSubscribers();
+  bool subscribe(uint8_t zone, uint16_t target, TargetFunction fn, void *context, uint32_t alarmId);
+  size_t unsubscribe(uint8_t zone, uint16_t target, TargetFunction fn, void *context); // Returns entries removed
+  void fanOut(uint8_t zone, uint32_t alarmId, const char *action, JsonObject &zoneData) const;
+  size_t count(uint8_t zone) const { return bucketStart[zone * BUCKETS] - bucketStart[(zone - 1) * BUCKETS]; }
+  size_t size() const { return bucketStart[4 * BUCKETS]; }
+
+private:
+  enum
+  {
+    BUCKETS = 2, // Per zone: all alarms, then single alarms
+    ALL_BUCKET = 0,
+    ALARM_BUCKET = 1
+  };
+  struct Handler
+  {
+    TargetFunction fn;
+    void *context;
+  };
+  struct Entry
+  {
+    uint32_t alarmId; // SUBSCRIBE_ALL_ALARMS in the all-alarms bucket
+    uint16_t target;
+    uint8_t handler; // Index into handlers
+    uint8_t reserved;
+  };
+  Handler handlers[SUBSCRIBER_HANDLERS];
+  uint8_t handlerCount;
+  Entry entries[FANOUT_MAX];
+  uint16_t bucketStart[4 * BUCKETS + 1]; // Bucket b spans [bucketStart[b], bucketStart[b + 1])
+  int findHandler(TargetFunction fn, void *context) const;
+  void range(int bucket, uint32_t alarmId, uint16_t *first, uint16_t *end) const; // Entries of alarmId in the sorted bucket
+  void insert(int bucket, uint16_t pos, const Entry &entry);
+  void run(uint16_t first, uint16_t end, uint8_t zone, const char *action, JsonObject &zoneData) const;
+};
+
+#endif
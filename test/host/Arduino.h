@@ -0,0 +1,37 @@
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+// Just enough of the Arduino core to build RecordStore on a host
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+class String
+{
+public:
+  String(const char *s = "") : s(s) {}
+  const char *c_str() const { return s.c_str(); }
+  unsigned length() const { return s.size(); }
+
+private:
+  std::string s;
+};
+
+class Print
+{
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+};
+
+// AlarmLog.h names these FreeRTOS types; nothing here runs a task
+typedef void *QueueHandle_t;
+typedef void *TaskHandle_t;
+typedef struct
+{
+  uint8_t opaque[80];
+} StaticQueue_t;
+
+#endif
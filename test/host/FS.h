@@ -0,0 +1,104 @@
+#ifndef HOST_FS_H
+#define HOST_FS_H
+
+// In-memory fs::FS for host tests. cutAfter(n) simulates a power loss: the
+// next n units of work (one per byte written, file created, removed or
+// renamed) still happen, everything after them is silently lost.
+#include <map>
+#include <memory>
+#include <string>
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+
+namespace fs
+{
+class FS;
+
+class File
+{
+public:
+  File() : fs(nullptr), pos(0), writable(false) {}
+  File(FS *fs, std::shared_ptr<std::string> data, bool writable) : fs(fs), data(data), pos(0), writable(writable) {}
+  operator bool() const { return (bool)data; }
+  size_t size() const { return data ? data->size() : 0; }
+  bool seek(uint32_t to)
+  {
+    if (!data || to > data->size())
+      return false;
+    pos = to;
+    return true;
+  }
+  size_t read(uint8_t *buffer, size_t len)
+  {
+    if (!data || pos >= data->size())
+      return 0;
+    size_t n = len < data->size() - pos ? len : data->size() - pos;
+    memcpy(buffer, data->data() + pos, n);
+    pos += n;
+    return n;
+  }
+  size_t write(const uint8_t *buffer, size_t len);
+  void close() { data.reset(); }
+
+private:
+  FS *fs;
+  std::shared_ptr<std::string> data;
+  size_t pos;
+  bool writable;
+};
+
+class FS
+{
+public:
+  FS() : budget(-1) {}
+  void cutAfter(long units) { budget = units; }
+  void powerOn() { budget = -1; }
+  bool spend()
+  {
+    if (budget == 0)
+      return false;
+    if (budget > 0)
+      budget--;
+    return true;
+  }
+  bool exists(const char *path) { return files.count(path) > 0; }
+  File open(const char *path, const char *mode = FILE_READ)
+  {
+    if (mode[0] == 'r')
+      return exists(path) ? File(this, files[path], false) : File();
+    if (!spend())
+      return File();
+    files[path] = std::make_shared<std::string>();
+    return File(this, files[path], true);
+  }
+  bool remove(const char *path) { return exists(path) && spend() && files.erase(path) > 0; }
+  bool rename(const char *from, const char *to)
+  {
+    if (!exists(from) || exists(to) || !spend())
+      return false;
+    files[to] = files[from];
+    files.erase(from);
+    return true;
+  }
+  std::map<std::string, std::shared_ptr<std::string>> files;
+
+private:
+  long budget; // Units left before the cut, -1 = powered
+};
+
+inline size_t File::write(const uint8_t *buffer, size_t len)
+{
+  size_t n = 0;
+  while (writable && n < len && fs->spend())
+    n++;
+  if (data)
+    data->replace(pos, n < data->size() - pos ? n : data->size() - pos, (const char *)buffer, n);
+  pos += n;
+  return n;
+}
+} // namespace fs
+
+using fs::File;
+
+#endif
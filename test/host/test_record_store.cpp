@@ -0,0 +1,118 @@
+// Host test of RecordStore's A/B slots against an in-memory fs::FS that
+// loses power partway through a write. From the repository root:
+//   g++ -std=c++11 -DALARM_LOG_LEVEL=0 -Itest/host -I. test/host/test_record_store.cpp RecordStore.cpp -o test_record_store && ./test_record_store
+
+#include "RecordStore.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                               \
+  do                                                              \
+  {                                                               \
+    if (!(cond))                                                  \
+    {                                                             \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      failures++;                                                 \
+    }                                                             \
+  } while (0)
+
+static std::string readBack(RecordStore &records, const char *name, size_t capacity = 256)
+{
+  uint8_t buffer[256];
+  size_t n = records.read(name, buffer, capacity);
+  return std::string((const char *)buffer, n);
+}
+
+static RecordStore::StepResult readSteps(RecordStore &records, const char *name, uint8_t *buffer, size_t len, size_t budget)
+{
+  RecordStore::Cursor cursor;
+  cursor.reset();
+  RecordStore::StepResult result;
+  while ((result = records.readStep(name, buffer, len, cursor, budget)) == RecordStore::STEP_MORE)
+    ;
+  return result;
+}
+
+static void testRoundTrip()
+{
+  fs::FS fs;
+  RecordStore records(fs);
+  CHECK(records.write("/alarms.json", String("first")));
+  CHECK(readBack(records, "/alarms.json") == "first");
+  CHECK(records.write("/alarms.json", String("second")));
+  CHECK(readBack(records, "/alarms.json") == "second");
+  CHECK(records.size("/alarms.json") == 6);
+  CHECK(records.remove("/alarms.json"));
+  CHECK(readBack(records, "/alarms.json") == "");
+}
+
+// Every cut point of a rewrite leaves the old or the new value, and the
+// new one whenever write() reported success
+static void testTornWrites()
+{
+  const char *oldValue = "{\"alarms\":[1,2,3]}";
+  const char *newValue = "{\"alarms\":[4,5,6,7,8,9]}";
+  for (long cut = 0; cut < 200; cut++)
+  {
+    fs::FS fs;
+    RecordStore records(fs);
+    CHECK(records.write("/alarms.json", String(oldValue)));
+    fs.cutAfter(cut);
+    bool written = records.write("/alarms.json", String(newValue));
+    fs.powerOn();
+
+    RecordStore rebooted(fs);
+    rebooted.recover("/alarms.json");
+    std::string value = readBack(rebooted, "/alarms.json");
+    CHECK(value == newValue || (!written && value == oldValue));
+
+    // The store keeps working after the loss
+    CHECK(rebooted.write("/alarms.json", String("after")));
+    CHECK(readBack(rebooted, "/alarms.json") == "after");
+  }
+}
+
+// A newest slot larger than the buffer is reported, not skipped for the
+// older, smaller copy
+static void testNewestTooLarge()
+{
+  fs::FS fs;
+  RecordStore records(fs);
+  CHECK(records.write("/alarms.json", String("short")));
+  CHECK(records.write("/alarms.json", String("a much longer value")));
+  uint8_t buffer[8];
+  CHECK(readSteps(records, "/alarms.json", buffer, sizeof(buffer), 4) == RecordStore::STEP_TOO_SMALL);
+  CHECK(records.read("/alarms.json", buffer, sizeof(buffer)) == 0);
+  CHECK(records.size("/alarms.json") == 19);
+  CHECK(readBack(records, "/alarms.json") == "a much longer value");
+}
+
+// Plain files of older versions are read whole or reported as too large
+static void testLegacyFile()
+{
+  fs::FS fs;
+  RecordStore records(fs);
+  File file = fs.open("/alarms.json", FILE_WRITE);
+  file.write((const uint8_t *)"legacy content", 14);
+  file.close();
+  uint8_t buffer[32];
+  CHECK(readSteps(records, "/alarms.json", buffer, 8, 4) == RecordStore::STEP_TOO_SMALL);
+  CHECK(readSteps(records, "/alarms.json", buffer, sizeof(buffer), 4) == RecordStore::STEP_DONE);
+  CHECK(readBack(records, "/alarms.json") == "legacy content");
+  CHECK(records.size("/alarms.json") == 14);
+
+  // The first write supersedes the plain file
+  CHECK(records.write("/alarms.json", String("slotted")));
+  CHECK(!fs.exists("/alarms.json"));
+  CHECK(readBack(records, "/alarms.json") == "slotted");
+}
+
+int main()
+{
+  testRoundTrip();
+  testTornWrites();
+  testNewestTooLarge();
+  testLegacyFile();
+  printf(failures ? "%d check(s) failed\n" : "All RecordStore checks passed\n", failures);
+  return failures ? 1 : 0;
+}